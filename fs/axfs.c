@@ -3,29 +3,170 @@
 #include <mm/slab.h>
 #include <kernel/bio.h>
 #include <kernel/ide.h>
+#include <kernel/iosched.h>
 #include <kernel/klib.h>
+#include <kernel/process.h>
+#include <kernel/scheduler.h>
+#include <kernel/wait.h>
+#include <mm/pmm.h>
+#include <mm/paging.h>
 #include <stdbool.h>
 #include <string.h>
 
 #define AX_FS_SECTORS_PER_BLOCK (AX_FS_BLOCK_SIZE / SECTOR_SIZE)
 #define SECTOR_NO(block) ((block) * AX_FS_SECTORS_PER_BLOCK)
 
+/* Block numbers in an indirect block */
+#define AX_FS_BLOCK_ENTRIES (AX_FS_BLOCK_SIZE / sizeof(uint32_t))
+
+/* Incompatible features this driver reads */
+#define AX_FEATURE_INCOMPAT_SUPPORTED AX_FEATURE_INCOMPAT_EXTENTS
+
+/* Max blocks of a contiguous run read through the block cache */
+#define AX_FS_READ_RUN_MAX (IOSCHED_MAX_SECTORS / AX_FS_SECTORS_PER_BLOCK)
+
+/* Blocks of a file page, delayed data is buffered per page */
+#define AX_FS_BLOCKS_PER_PAGE (PAGE_SIZE / AX_FS_BLOCK_SIZE)
+
+/* An inode is written back if it buffers more delayed pages */
+#define AX_DELAYED_MAX_PAGES 64
+
+/* Size of a directory entry with name of length, aligned to 4 bytes */
+#define AX_DIR_REC_LEN(length) \
+    ((sizeof(struct ax_directory_entry) + (length) + 3) & ~3u)
+
+/* Mode bits of file flags */
+#define AX_OPEN_MODE(flags) ((flags) & (O_RDONLY | O_WRONLY | O_RDWR))
+
+/* A block of the user buffer is in two pages at most */
+#define AX_FS_BLOCK_SEGMENTS 2
+
+/* Direct IO of adjacent blocks, DMA to the user buffer */
+struct direct_io
+{
+    struct ide_dma_io io;
+    struct ide_dma_segment segments[IOSCHED_MAX_SEGMENTS];
+    struct process *proc;   /* Owner of a user buffer, NULL for kernel */
+    bool done;
+    bool error;
+    struct wait_queue wait;
+};
+
+/*
+ * Inodes are cached in memory, keyed on device and inode number. At most
+ * 128 unreferenced inodes are kept in LRU list, referenced inodes are
+ * shared by all users.
+ */
+#define AX_INODE_CACHE_MAX 128
+#define AX_INODE_HASH_BITS 6
+#define AX_INODE_HASH_SIZE (1 << AX_INODE_HASH_BITS)
+
+/*
+ * Written data of blocks which are not allocated yet, blocks are allocated
+ * when the inode is written back.
+ */
+struct delayed_page
+{
+    uint32_t index;                 /* Page index in file */
+    uint8_t blocks;                 /* Bit mask of buffered blocks */
+    char *data;
+    struct delayed_page *next;      /* Sorted by index */
+};
+
+struct inode_entry
+{
+    struct ax_inode inode;          /* Must be the first member */
+    struct ax_mount *mnt;
+    uint8_t device;
+    uint32_t ino;
+    uint32_t refs;
+
+    bool dirty;                     /* Inode is changed in memory */
+    bool locked;                    /* Locked by a reader or a writer */
+    struct wait_queue lock_wait;
+    uint32_t delayed_count;
+    struct delayed_page *delayed;
+
+    struct inode_entry *hash_prev;  /* Hash bucket list */
+    struct inode_entry *hash_next;
+    struct inode_entry *prev;       /* LRU list of unreferenced inodes */
+    struct inode_entry *next;
+};
+
+/* Mounted file system, metadata is read when mounting */
+struct ax_mount
+{
+    uint8_t device;
+    struct ax_super_block sb;
+    uint32_t group_count;
+    uint32_t groups_order;                      /* Pages order of groups */
+    struct ax_block_group_descriptor *groups;   /* All group descriptors */
+};
+
+/*
+ * Directory entries are cached, keyed on device, parent directory inode
+ * number and name, a negative entry caches a name which does not exist.
+ * At most 256 entries are kept in LRU order, longer names are not cached.
+ */
+#define AX_DENTRY_CACHE_MAX 256
+#define AX_DENTRY_HASH_BITS 7
+#define AX_DENTRY_HASH_SIZE (1 << AX_DENTRY_HASH_BITS)
+#define AX_DENTRY_NAME_MAX 32
+
+struct dentry
+{
+    uint8_t device;
+    uint8_t name_len;
+    uint32_t parent;                /* Inode number of parent directory */
+    uint32_t ino;                   /* 0 if the name does not exist */
+    char name[AX_DENTRY_NAME_MAX];
+
+    struct dentry *hash_prev;       /* Hash bucket list */
+    struct dentry *hash_next;
+    struct dentry *prev;            /* LRU list */
+    struct dentry *next;
+};
+
 static struct kmem_cache *inode_cache;
+static struct inode_entry *inode_hash[AX_INODE_HASH_SIZE];
+static struct inode_entry inode_lru_head;
+static uint32_t inode_unused_count;
+
+static struct kmem_cache *dentry_cache;
+static struct dentry *dentry_hash[AX_DENTRY_HASH_SIZE];
+static struct dentry dentry_lru_head;
+static uint32_t dentry_count;
+
+static struct kmem_cache *delayed_cache;
+
+static bool inode_writeback(struct inode_entry *entry);
 
 static void ax_fs_initialize()
 {
     inode_cache = slab_create_kmem_cache(
-        sizeof(struct ax_inode), sizeof(void *));
+        sizeof(struct inode_entry), sizeof(void *));
+    inode_lru_head.prev = &inode_lru_head;
+    inode_lru_head.next = &inode_lru_head;
+
+    dentry_cache = slab_create_kmem_cache(
+        sizeof(struct dentry), sizeof(void *));
+    dentry_lru_head.prev = &dentry_lru_head;
+    dentry_lru_head.next = &dentry_lru_head;
+
+    delayed_cache = slab_create_kmem_cache(
+        sizeof(struct delayed_page), sizeof(void *));
 }
 
-static void get_super_block(struct ax_super_block *sb, uint8_t device)
+static bool get_super_block(struct ax_super_block *sb, uint8_t device)
 {
     uint64_t sb_sector = SECTOR_NO(AX_FS_SUPER_BLOCK_NO);
     struct bio *bio = bio_get(device, sb_sector);
+    bool success = bio_read(bio);
 
-    bio_read(bio);
+    bio_mark_metadata(bio);
     memcpy(sb, bio_data(bio), sizeof(*sb));
     bio_release(bio);
+    return success;
 }
 
 static inline uint32_t block_group(const struct ax_super_block *sb)
@@ -46,56 +187,293 @@ static inline uint32_t inode_index_in_bg(const struct ax_super_block *sb,
     return (ino - 1) % sb->s_inodes_per_group;
 }
 
-static inline uint32_t get_bg_inode_table(uint8_t device, uint32_t bg_index)
+/* Read all group descriptors, they follow the super block */
+static bool get_group_descriptors(struct ax_mount *mnt)
 {
-    uint32_t bg_inode_table = 0;
+    uint32_t size = sizeof(struct ax_block_group_descriptor) * mnt->group_count;
+    uint32_t block = AX_FS_SUPER_BLOCK_NO + 1;
+    char *groups = NULL;
 
-    uint32_t offset = sizeof(struct ax_block_group_descriptor) * bg_index;
-    uint32_t sector = (offset % AX_FS_BLOCK_SIZE) / SECTOR_SIZE;
-    uint64_t block = offset / AX_FS_BLOCK_SIZE + AX_FS_SUPER_BLOCK_NO + 1;
+    while ((uint32_t)(PAGE_SIZE << mnt->groups_order) < size)
+        ++mnt->groups_order;
 
-    struct bio *bio = bio_get(device, SECTOR_NO(block) + sector);
-    struct ax_block_group_descriptor *desc = NULL;
+    groups = cast_p2v_or_null(pmm_alloc_pages_address(mnt->groups_order));
+    if (!groups)
+        return false;
 
-    bio_read(bio);
-    desc = (struct ax_block_group_descriptor *)
-        (bio_data(bio) + (offset % SECTOR_SIZE));
-    bg_inode_table = desc->bg_inode_table;
-    bio_release(bio);
+    mnt->groups = (struct ax_block_group_descriptor *)groups;
 
-    return bg_inode_table;
+    for (uint32_t offset = 0; offset < size;
+         offset += AX_FS_BLOCK_SIZE, ++block)
+    {
+        struct bio *bio = bio_get(mnt->device, SECTOR_NO(block));
+        bool success = bio_read(bio);
+
+        memcpy(groups + offset, bio_data(bio),
+               KMIN(size - offset, AX_FS_BLOCK_SIZE));
+        bio_release(bio);
+
+        if (!success)
+            return false;
+    }
+
+    return true;
 }
 
-static void inode_read(struct ax_inode *inode, uint8_t device,
+static bool inode_read(struct ax_inode *inode, const struct ax_mount *mnt,
                        uint32_t bg_index, uint32_t index)
 {
-    uint32_t inode_table = get_bg_inode_table(device, bg_index);
+    uint8_t device = mnt->device;
+    uint32_t inode_table = 0;
     uint32_t offset = sizeof(struct ax_inode) * index;
 
     uint32_t sector = (offset % AX_FS_BLOCK_SIZE) / SECTOR_SIZE;
     uint32_t offset_in_sector = (offset % AX_FS_BLOCK_SIZE) % SECTOR_SIZE;
-    uint64_t block = inode_table + offset / AX_FS_BLOCK_SIZE;
+    uint64_t block = 0;
+    struct bio *bio = NULL;
+    bool success = false;
+
+    if (bg_index >= mnt->group_count)
+        return false;
 
-    struct bio *bio = bio_get(device, SECTOR_NO(block) + sector);
-    bio_read(bio);
+    inode_table = mnt->groups[bg_index].bg_inode_table;
+    block = inode_table + offset / AX_FS_BLOCK_SIZE;
+    bio = bio_get(device, SECTOR_NO(block) + sector);
+    success = bio_read(bio);
+
+    bio_mark_metadata(bio);
     memcpy(inode, bio_data(bio) + offset_in_sector, sizeof(*inode));
     bio_release(bio);
+    return success;
 }
 
-static struct ax_inode * inode_get(const struct ax_super_block *sb,
-                                   uint8_t device, uint32_t ino)
+/*
+ * Copy data to offset of the metadata block through the block cache, it
+ * is written back later. data must not cross a sector.
+ */
+static bool metadata_write(uint8_t device, uint32_t block, uint32_t offset,
+                           const void *data, size_t size)
 {
-    struct ax_inode *inode = slab_alloc(inode_cache);
-    uint32_t bg_index = inode_bg_index(sb, ino);
-    uint32_t index = inode_index_in_bg(sb, ino);
-    if (inode) inode_read(inode, device, bg_index, index);
-    return inode;
+    struct bio *bio = bio_get(device, SECTOR_NO((uint64_t)block) +
+                              offset / SECTOR_SIZE);
+    bool success = bio_read(bio);
+
+    bio_mark_metadata(bio);
+    if (success)
+    {
+        memcpy(bio_data(bio) + offset % SECTOR_SIZE, data, size);
+        bio_write(bio);
+    }
+
+    bio_release(bio);
+    return success;
+}
+
+static bool inode_write(const struct ax_mount *mnt, uint32_t ino,
+                        const struct ax_inode *inode)
+{
+    uint32_t bg_index = inode_bg_index(&mnt->sb, ino);
+    uint32_t offset =
+        sizeof(struct ax_inode) * inode_index_in_bg(&mnt->sb, ino);
+
+    if (bg_index >= mnt->group_count)
+        return false;
+
+    return metadata_write(mnt->device,
+                          mnt->groups[bg_index].bg_inode_table +
+                          offset / AX_FS_BLOCK_SIZE,
+                          offset % AX_FS_BLOCK_SIZE, inode, sizeof(*inode));
+}
+
+/* Write free counts of the group descriptor and the super block */
+static bool group_write(const struct ax_mount *mnt, uint32_t group)
+{
+    uint32_t offset = sizeof(struct ax_block_group_descriptor) * group;
+
+    return metadata_write(mnt->device, AX_FS_SUPER_BLOCK_NO + 1 +
+                          offset / AX_FS_BLOCK_SIZE,
+                          offset % AX_FS_BLOCK_SIZE, &mnt->groups[group],
+                          sizeof(struct ax_block_group_descriptor)) &&
+        metadata_write(mnt->device, AX_FS_SUPER_BLOCK_NO, 0,
+                       &mnt->sb, sizeof(mnt->sb));
+}
+
+static inline uint32_t inode_hash_index(uint8_t device, uint32_t ino)
+{
+    uint32_t key = ino + ((uint32_t)device << 24);
+    return (key * 2654435761u) >> (32 - AX_INODE_HASH_BITS);
+}
+
+static struct inode_entry * inode_lookup(uint8_t device, uint32_t ino)
+{
+    struct inode_entry *entry = inode_hash[inode_hash_index(device, ino)];
+
+    while (entry && !(entry->device == device && entry->ino == ino))
+        entry = entry->hash_next;
+
+    return entry;
+}
+
+static void inode_insert_hash(struct inode_entry *entry)
+{
+    struct inode_entry **head =
+        &inode_hash[inode_hash_index(entry->device, entry->ino)];
+
+    entry->hash_prev = NULL;
+    entry->hash_next = *head;
+    if (*head)
+        (*head)->hash_prev = entry;
+    *head = entry;
 }
 
-static inline void inode_release(struct ax_inode *inode)
+static void inode_remove_hash(struct inode_entry *entry)
 {
-    if (inode)
-        slab_free(inode_cache, inode);
+    if (entry->hash_prev)
+        entry->hash_prev->hash_next = entry->hash_next;
+    else
+        inode_hash[inode_hash_index(entry->device, entry->ino)] =
+            entry->hash_next;
+
+    if (entry->hash_next)
+        entry->hash_next->hash_prev = entry->hash_prev;
+}
+
+static void inode_lru_remove(struct inode_entry *entry)
+{
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    entry->prev = entry->next = NULL;
+    --inode_unused_count;
+}
+
+static void inode_lru_insert(struct inode_entry *entry)
+{
+    entry->next = inode_lru_head.next;
+    entry->prev = &inode_lru_head;
+    inode_lru_head.next->prev = entry;
+    inode_lru_head.next = entry;
+    ++inode_unused_count;
+}
+
+/* Reference the cached inode, it leaves LRU list when first referenced */
+static struct ax_inode * inode_ref(struct inode_entry *entry)
+{
+    if (entry->refs++ == 0)
+        inode_lru_remove(entry);
+    return &entry->inode;
+}
+
+static struct ax_inode * inode_get(struct ax_mount *mnt, uint32_t ino)
+{
+    uint8_t device = mnt->device;
+    struct inode_entry *entry = inode_lookup(device, ino);
+    struct inode_entry *found = NULL;
+
+    if (entry)
+        return inode_ref(entry);
+
+    entry = slab_alloc(inode_cache);
+    if (!entry)
+        return NULL;
+
+    if (!inode_read(&entry->inode, mnt, inode_bg_index(&mnt->sb, ino),
+                    inode_index_in_bg(&mnt->sb, ino)))
+    {
+        slab_free(inode_cache, entry);
+        return NULL;
+    }
+
+    /* Another process may have cached it while reading */
+    found = inode_lookup(device, ino);
+    if (found)
+    {
+        slab_free(inode_cache, entry);
+        return inode_ref(found);
+    }
+
+    entry->mnt = mnt;
+    entry->device = device;
+    entry->ino = ino;
+    entry->refs = 1;
+    entry->dirty = false;
+    entry->locked = false;
+    wait_queue_init(&entry->lock_wait);
+    entry->delayed_count = 0;
+    entry->delayed = NULL;
+    entry->prev = entry->next = NULL;
+    inode_insert_hash(entry);
+    return &entry->inode;
+}
+
+/* Lock the inode while reading or changing its data */
+static void inode_lock(struct inode_entry *entry)
+{
+    while (entry->locked)
+        wait_queue_sleep_exclusive(&entry->lock_wait);
+    entry->locked = true;
+}
+
+static void inode_unlock(struct inode_entry *entry)
+{
+    entry->locked = false;
+    wait_queue_wake_one(&entry->lock_wait);
+}
+
+/* Drop a reference, the unused inode enters LRU list */
+static void inode_unref(struct inode_entry *entry)
+{
+    if (--entry->refs > 0)
+        return ;
+
+    inode_lru_insert(entry);
+
+    /* Evict the least recently used inode, a dirty one is never evicted */
+    if (inode_unused_count > AX_INODE_CACHE_MAX)
+    {
+        struct inode_entry *victim = inode_lru_head.prev;
+
+        while (victim != &inode_lru_head &&
+               (victim->dirty || victim->delayed))
+            victim = victim->prev;
+
+        if (victim != &inode_lru_head)
+        {
+            inode_lru_remove(victim);
+            inode_remove_hash(victim);
+            slab_free(inode_cache, victim);
+        }
+    }
+}
+
+/*
+ * Release the inode, the last user writes back delayed data and the inode.
+ * If it fails, the data is kept cached for a later close to write back,
+ * and false is returned.
+ */
+static bool inode_release(struct ax_inode *inode)
+{
+    struct inode_entry *entry = (struct inode_entry *)inode;
+    bool success = true;
+
+    if (!entry)
+        return true;
+
+    /* Others may reference and change it while writing back */
+    while (success && entry->refs == 1 && (entry->dirty || entry->delayed))
+    {
+        inode_lock(entry);
+        success = inode_writeback(entry);
+        inode_unlock(entry);
+
+        if (!success)
+        {
+            printk("[%-8s] write back inode %u failed, keep it cached\n",
+                   "AXFS", entry->ino);
+        }
+    }
+
+    inode_unref(entry);
+    return success;
 }
 
 static inline const char * str_find(const char *str, int c)
@@ -127,17 +505,22 @@ static inline void block_release(struct bio *bio)
 }
 
 static uint32_t block_find_ino(const char *name, size_t length,
-                               uint8_t device, uint32_t block)
+                               uint8_t device, uint32_t block, bool *error)
 {
     uint32_t ino = 0;
     struct bio *bio = block_read(device, block);
 
+    if (!bio)
+        *error = true;
+
     if (bio)
     {
         char *it = bio_data(bio);
         char *end = it + AX_FS_BLOCK_SIZE;
         struct ax_directory_entry *entry = NULL;
 
+        bio_mark_metadata(bio);
+
         for (; it < end; it += entry->rec_len)
         {
             entry = (struct ax_directory_entry *)(it);
@@ -158,161 +541,2392 @@ static uint32_t block_find_ino(const char *name, size_t length,
     return ino;
 }
 
-static uint32_t dir_find_ino(const struct ax_inode *dir,
-                             const char *name, size_t length,
-                             uint8_t device)
+/*
+ * Map the block index of inode to the block on disk, 0 if it is not
+ * allocated. count is set to the number of blocks from it which are
+ * contiguous on disk and in the same block table, at most max, so a run
+ * is mapped by reading indirect blocks once. error is set if an indirect
+ * block read fails.
+ */
+static uint32_t block_map_run(uint8_t device, const struct ax_inode *inode,
+                              uint32_t index, uint32_t max,
+                              uint32_t *count, bool *error)
 {
-    uint32_t ino = 0;
+    const uint32_t *table = inode->i_block;
+    uint32_t table_size = AX_FS_DIRECT_BLOCK_COUNT;
+    uint32_t pos = index;
+    uint32_t level = 1;
+    uint32_t span = 1;
+    uint32_t block = 0;
+    struct bio *bio = NULL;
 
-    for (int i = 0; i < AX_FS_DIRECT_BLOCK_COUNT; ++i)
+    *count = 1;
+
+    if (index < AX_FS_DIRECT_BLOCK_COUNT)
     {
-        if (dir->i_block[i] == 0)
-            break;
+        block = table[pos];
+    }
+    else
+    {
+        /* Find the level of indirect blocks, span is blocks it maps */
+        index -= AX_FS_DIRECT_BLOCK_COUNT;
+        for (; level <= 3; ++level)
+        {
+            span *= AX_FS_BLOCK_ENTRIES;
+            if (index < span)
+                break;
+            index -= span;
+        }
 
-        ino = block_find_ino(name, length, device, dir->i_block[i]);
-        if (ino != 0)
-            break;
+        if (level > 3)
+            return 0;
+
+        block = inode->i_block[AX_FS_1_INDIRECT_BLOCK_INDEX + level - 1];
+        for (; block != 0 && level > 0; --level)
+        {
+            if (bio)
+                block_release(bio);
+
+            bio = block_read(device, block);
+            if (!bio)
+            {
+                *error = true;
+                return 0;
+            }
+
+            bio_mark_metadata(bio);
+            span /= AX_FS_BLOCK_ENTRIES;
+            table = (const uint32_t *)bio_data(bio);
+            table_size = AX_FS_BLOCK_ENTRIES;
+            pos = index / span;
+            block = table[pos];
+            index %= span;
+        }
     }
 
-    /* TODO: Find in indirect blocks */
+    /* The run ends at a gap on disk or at the end of the table */
+    if (block != 0)
+    {
+        while (*count < max && pos + *count < table_size &&
+               table[pos + *count] == block + *count)
+            *count += 1;
+    }
 
-    return ino;
+    if (bio)
+        block_release(bio);
+
+    return block;
 }
 
-static uint32_t namex(const struct ax_super_block *sb,
-                      const char *name, uint8_t device,
-                      uint32_t ino)
+static inline uint32_t block_map(uint8_t device, const struct ax_inode *inode,
+                                 uint32_t index, bool *error)
 {
-    const char *begin = name;
-    const char *end = str_find(begin, '/');
-    struct ax_inode *inode = NULL;
+    uint32_t count = 0;
+    return block_map_run(device, inode, index, 1, &count, error);
+}
 
-    while (end - begin != 0)
+static inline bool extent_header_valid(const struct ax_extent_header *header,
+                                       uint16_t max)
+{
+    return header->eh_magic == AX_EXT_MAGIC && header->eh_max == max &&
+        header->eh_entries <= max && header->eh_depth <= AX_EXT_MAX_DEPTH;
+}
+
+static inline bool inode_has_extents(const struct ax_mount *mnt,
+                                     const struct ax_inode *inode)
+{
+    const struct ax_extent_header *header = (const void *)inode->i_block;
+
+    return (mnt->sb.s_feature_incompat & AX_FEATURE_INCOMPAT_EXTENTS) &&
+        inode->i_mode == AX_S_IFREG && header->eh_magic == AX_EXT_MAGIC;
+}
+
+/* Find the last entry whose first logical block is not after index */
+static const struct ax_extent * extent_search(
+    const struct ax_extent_header *header, uint32_t index)
+{
+    const struct ax_extent *entries = (const struct ax_extent *)(header + 1);
+    uint32_t low = 0;
+    uint32_t high = header->eh_entries;
+
+    while (low < high)
     {
-        inode = inode_get(sb, device, ino);
+        uint32_t mid = low + (high - low) / 2;
 
-        if (!inode || inode->i_mode != AX_S_IFDIR)
+        if (entries[mid].ee_block <= index)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low > 0 ? &entries[low - 1] : NULL;
+}
+
+/*
+ * Map the block index of an extent mapped file to the block on disk, count
+ * is set to the number of blocks contiguous on disk from it. 0 is returned
+ * for a hole with count 1, error is set if the tree can not be read.
+ */
+static uint32_t extent_map(uint8_t device, const struct ax_inode *inode,
+                           uint32_t index, uint32_t *count, bool *error)
+{
+    const struct ax_extent_header *header = (const void *)inode->i_block;
+    const struct ax_extent *extent = NULL;
+    uint16_t max = AX_EXT_ROOT_MAX;
+    uint32_t depth = header->eh_depth;
+    struct bio *bio = NULL;
+    uint32_t block = 0;
+
+    *count = 1;
+
+    for (;;)
+    {
+        if (!extent_header_valid(header, max) || header->eh_depth != depth)
         {
-            ino = 0;
+            *error = true;
             break;
         }
 
-        ino = dir_find_ino(inode, begin, end - begin, device);
-
-        if (ino == 0)
+        extent = extent_search(header, index);
+        if (!extent)
             break;
 
-        inode_release(inode);
-        inode = NULL;
-
-        if (*end == '\0')
+        if (depth == 0)
         {
-            begin = end;
+            if (index - extent->ee_block < extent->ee_len)
+            {
+                block = extent->ee_start + (index - extent->ee_block);
+                *count = extent->ee_len - (index - extent->ee_block);
+            }
+            break;
         }
-        else
+
+        /* Go down to the child node, depth decreases by one each level */
+        block = extent->ee_start;
+        if (bio)
+            block_release(bio);
+
+        bio = block_read(device, block);
+        block = 0;
+        if (!bio)
         {
-            begin = end + 1;
-            end = str_find(begin, '/');
+            *error = true;
+            break;
         }
+
+        bio_mark_metadata(bio);
+        header = (const struct ax_extent_header *)bio_data(bio);
+        max = AX_EXT_NODE_MAX;
+        depth -= 1;
     }
 
-    inode_release(inode);
-    return ino;
+    if (bio)
+        block_release(bio);
+
+    return block;
 }
 
-static struct ax_inode * namei(const struct ax_super_block *sb,
-                               const char *name, uint8_t device,
-                               uint32_t *ino)
+/*
+ * Map the block index of file to the block on disk, count is set to the
+ * number of blocks contiguous on disk from it, at most max. 0 is returned
+ * for a hole.
+ */
+static uint32_t file_block_map(const struct ax_mount *mnt,
+                               const struct ax_inode *inode, uint32_t index,
+                               uint32_t max, uint32_t *count, bool *error)
 {
-    struct ax_inode *inode = NULL;
+    uint32_t block = 0;
 
-    if (*name == '/')
+    if (!inode_has_extents(mnt, inode))
+        return block_map_run(mnt->device, inode, index, max, count, error);
+
+    block = extent_map(mnt->device, inode, index, count, error);
+    *count = KMIN(*count, max);
+    return block;
+}
+
+/* Read the logical block of directory, error is set if it fails */
+static struct bio * dir_block_read(uint8_t device, const struct ax_inode *dir,
+                                   uint32_t index, bool *error)
+{
+    uint32_t block = block_map(device, dir, index, error);
+    struct bio *bio = NULL;
+
+    if (block != 0)
+        bio = block_read(device, block);
+
+    if (bio)
+        bio_mark_metadata(bio);
+    else
+        *error = true;
+
+    return bio;
+}
+
+/* Find the last index entry whose hash is not greater than hash */
+static uint32_t dx_search(const struct ax_dx_countlimit *countlimit,
+                          const struct ax_dx_entry *entries, uint32_t hash)
+{
+    uint32_t low = 1;
+    uint32_t high = countlimit->count;
+
+    while (low < high)
     {
-        *ino = namex(sb, name + 1, device, AX_FS_ROOT_INO);
-        if (*ino != 0)
-            inode = inode_get(sb, device, *ino);
+        uint32_t mid = low + (high - low) / 2;
+
+        if (entries[mid].hash <= hash)
+            low = mid + 1;
+        else
+            high = mid;
     }
 
-    return inode;
+    return entries[low - 1].block;
 }
 
-static int read_file(struct inode *inode, uint64_t pos,
-                     char *buffer, size_t size)
+static inline bool dx_valid(const struct ax_dx_countlimit *countlimit,
+                            uint16_t limit)
 {
-    struct ax_inode *ax_inode = inode->i_private;
-    uint32_t block_index = pos / AX_FS_BLOCK_SIZE;
-    uint32_t block_pos = pos % AX_FS_BLOCK_SIZE;
-    char *begin = buffer;
+    return countlimit->limit == limit && countlimit->count > 0 &&
+        countlimit->count <= limit;
+}
 
-    /* EOF */
-    if (pos >= ax_inode->i_size)
+/*
+ * Find name through the hashed index of directory, indexed is set if the
+ * directory has a valid index. Only one block of each level is read.
+ */
+static uint32_t dx_find_ino(uint8_t device, const struct ax_inode *dir,
+                            const char *name, size_t length,
+                            bool *indexed, bool *error)
+{
+    uint32_t hash = ax_dx_hash(name, length);
+    uint32_t block = 0;
+    uint32_t levels = 0;
+    struct bio *bio = NULL;
+    struct ax_directory_entry *dotdot = NULL;
+    struct ax_dx_root *root = NULL;
+
+    if (dir->i_block[0] == 0)
         return 0;
 
-    if (block_index >= AX_FS_DIRECT_BLOCK_COUNT)
-        return -1;
+    bio = dir_block_read(device, dir, 0, error);
+    if (!bio)
+        return 0;
 
-    size = KMIN(size, ax_inode->i_size - pos);
-    while (size > 0 && block_index < AX_FS_DIRECT_BLOCK_COUNT)
+    dotdot = (struct ax_directory_entry *)(bio_data(bio) + AX_FS_DOT_REC_LEN);
+    root = (struct ax_dx_root *)(bio_data(bio) + AX_FS_DX_ROOT_OFFSET);
+
+    /* A linear directory, or an index of unknown version */
+    if (dotdot->rec_len != AX_FS_BLOCK_SIZE - AX_FS_DOT_REC_LEN ||
+        root->magic != AX_FS_DX_MAGIC ||
+        root->hash_version != AX_FS_DX_HASH_FNV ||
+        root->levels > AX_FS_DX_MAX_LEVELS ||
+        !dx_valid(&root->countlimit, AX_FS_DX_ROOT_LIMIT))
     {
-        uint32_t bytes = 0;
-        struct bio *block = block_read(inode->i_device,
-                                       ax_inode->i_block[block_index]);
-        if (!block)
-            return -1;
+        block_release(bio);
+        return 0;
+    }
 
-        bytes = KMIN(size, AX_FS_BLOCK_SIZE - block_pos);
-        memcpy(buffer, bio_data(block) + block_pos, bytes);
-        block_release(block);
+    *indexed = true;
+    levels = root->levels;
+    block = dx_search(&root->countlimit, root->entries, hash);
+    block_release(bio);
 
-        size -= bytes;
-        buffer += bytes;
+    for (; levels > 0; --levels)
+    {
+        struct ax_dx_node *node = NULL;
 
-        block_index += 1;
-        block_pos = 0;
+        bio = dir_block_read(device, dir, block, error);
+        if (!bio)
+            return 0;
+
+        node = (struct ax_dx_node *)(bio_data(bio) + AX_FS_DX_NODE_OFFSET);
+        if (!dx_valid(&node->countlimit, AX_FS_DX_NODE_LIMIT))
+        {
+            *error = true;
+            block_release(bio);
+            return 0;
+        }
+
+        block = dx_search(&node->countlimit, node->entries, hash);
+        block_release(bio);
     }
 
-    /* TODO: read from indirect blocks */
+    block = block_map(device, dir, block, error);
+    if (block == 0)
+    {
+        *error = true;
+        return 0;
+    }
 
-    return buffer - begin;
+    return block_find_ino(name, length, device, block, error);
 }
 
-static int ax_open(struct file *file)
+/*
+ * Find name in directory, through the hashed index if the directory has
+ * one, otherwise all blocks are searched. error is set if a block read
+ * fails.
+ */
+static uint32_t dir_find_ino(const struct ax_mount *mnt,
+                             const struct ax_inode *dir,
+                             const char *name, size_t length, bool *error)
 {
-    struct ax_super_block sb;
-    struct ax_inode *inode;
-    uint32_t ino;
+    uint32_t ino = 0;
 
-    if (file->f_flags != O_RDONLY)
-        return -1;
+    if (mnt->sb.s_feature_compat & AX_FEATURE_COMPAT_DIR_INDEX)
+    {
+        bool indexed = false;
 
-    get_super_block(&sb, file->f_inode->i_device);
-    inode = namei(&sb, file->f_path, file->f_inode->i_device, &ino);
+        ino = dx_find_ino(mnt->device, dir, name, length, &indexed, error);
+        if (indexed || ino != 0)
+            return ino;
+    }
 
-    if (!inode || inode->i_mode == AX_S_IFDIR)
+    for (uint32_t i = 0; ino == 0; ++i)
     {
-        inode_release(inode);
-        return -1;
+        uint32_t block = block_map(mnt->device, dir, i, error);
+
+        if (block == 0)
+            break;
+
+        ino = block_find_ino(name, length, mnt->device, block, error);
     }
 
-    file->f_inode->i_ino = ino;
-    file->f_inode->i_private = inode;
-    return 0;
+    return ino;
 }
 
-static int ax_close(struct file *file)
+static uint32_t dentry_hash_index(uint8_t device, uint32_t parent,
+                                  const char *name, size_t length)
 {
-    inode_release(file->f_inode->i_private);
-    return 0;
+    /* FNV-1a hash of the name, mixed with device and parent */
+    uint32_t key = 2166136261u ^ parent ^ ((uint32_t)device << 24);
+
+    for (size_t i = 0; i < length; ++i)
+        key = (key ^ (unsigned char)name[i]) * 16777619u;
+
+    return (key * 2654435761u) >> (32 - AX_DENTRY_HASH_BITS);
 }
 
-static int ax_read(struct file *file, char *buffer, size_t size)
+static void dentry_remove(struct dentry *dentry)
 {
+    if (dentry->hash_prev)
+        dentry->hash_prev->hash_next = dentry->hash_next;
+    else
+        dentry_hash[dentry_hash_index(dentry->device, dentry->parent,
+                                      dentry->name, dentry->name_len)] =
+            dentry->hash_next;
+
+    if (dentry->hash_next)
+        dentry->hash_next->hash_prev = dentry->hash_prev;
+
+    dentry->prev->next = dentry->next;
+    dentry->next->prev = dentry->prev;
+    --dentry_count;
+}
+
+static void dentry_insert(struct dentry *dentry)
+{
+    struct dentry **head = &dentry_hash[dentry_hash_index(
+        dentry->device, dentry->parent, dentry->name, dentry->name_len)];
+
+    dentry->hash_prev = NULL;
+    dentry->hash_next = *head;
+    if (*head)
+        (*head)->hash_prev = dentry;
+    *head = dentry;
+
+    dentry->next = dentry_lru_head.next;
+    dentry->prev = &dentry_lru_head;
+    dentry_lru_head.next->prev = dentry;
+    dentry_lru_head.next = dentry;
+    ++dentry_count;
+}
+
+/* Find the cached entry, it becomes the most recently used one */
+static struct dentry * dentry_lookup(uint8_t device, uint32_t parent,
+                                     const char *name, size_t length)
+{
+    struct dentry *dentry =
+        dentry_hash[dentry_hash_index(device, parent, name, length)];
+
+    for (; dentry; dentry = dentry->hash_next)
+    {
+        if (dentry->device == device && dentry->parent == parent &&
+            dentry->name_len == length &&
+            memcmp(dentry->name, name, length) == 0)
+        {
+            dentry_remove(dentry);
+            dentry_insert(dentry);
+            break;
+        }
+    }
+
+    return dentry;
+}
+
+static void dentry_add(uint8_t device, uint32_t parent,
+                       const char *name, size_t length, uint32_t ino)
+{
+    struct dentry *dentry = NULL;
+
+    if (length > AX_DENTRY_NAME_MAX)
+        return ;
+
+    /* Another process may have cached it while reading directory */
+    if (dentry_lookup(device, parent, name, length))
+        return ;
+
+    /* Reuse the least recently used entry */
+    if (dentry_count >= AX_DENTRY_CACHE_MAX)
+    {
+        dentry = dentry_lru_head.prev;
+        dentry_remove(dentry);
+    }
+    else
+    {
+        dentry = slab_alloc(dentry_cache);
+        if (!dentry)
+            return ;
+    }
+
+    dentry->device = device;
+    dentry->parent = parent;
+    dentry->ino = ino;
+    dentry->name_len = length;
+    memcpy(dentry->name, name, length);
+    dentry_insert(dentry);
+}
+
+/* Set the cached entry of name after it is added to the directory */
+static void dentry_set(uint8_t device, uint32_t parent,
+                       const char *name, size_t length, uint32_t ino)
+{
+    struct dentry *dentry = dentry_lookup(device, parent, name, length);
+
+    if (dentry)
+        dentry->ino = ino;
+    else
+        dentry_add(device, parent, name, length, ino);
+}
+
+/* Find name in the directory through the dentry cache */
+static uint32_t dir_lookup(const struct ax_mount *mnt,
+                           const struct ax_inode *dir, uint32_t dir_ino,
+                           const char *name, size_t length)
+{
+    struct dentry *dentry = dentry_lookup(mnt->device, dir_ino, name, length);
+    bool error = false;
+    uint32_t ino = 0;
+
+    if (dentry)
+        return dentry->ino;
+
+    ino = dir_find_ino(mnt, dir, name, length, &error);
+
+    /* A name is not known to be missing if a block is not read */
+    if (ino != 0 || !error)
+        dentry_add(mnt->device, dir_ino, name, length, ino);
+
+    return ino;
+}
+
+static uint32_t namex(struct ax_mount *mnt, const char *name,
+                      uint32_t ino)
+{
+    const char *begin = name;
+    const char *end = str_find(begin, '/');
+    struct ax_inode *inode = NULL;
+
+    while (end - begin != 0)
+    {
+        inode = inode_get(mnt, ino);
+
+        if (!inode || inode->i_mode != AX_S_IFDIR)
+        {
+            ino = 0;
+            break;
+        }
+
+        ino = dir_lookup(mnt, inode, ino, begin, end - begin);
+
+        if (ino == 0)
+            break;
+
+        inode_release(inode);
+        inode = NULL;
+
+        if (*end == '\0')
+        {
+            begin = end;
+        }
+        else
+        {
+            begin = end + 1;
+            end = str_find(begin, '/');
+        }
+    }
+
+    inode_release(inode);
+    return ino;
+}
+
+static struct ax_inode * namei(struct ax_mount *mnt,
+                               const char *name, uint32_t *ino)
+{
+    struct ax_inode *inode = NULL;
+
+    if (*name == '/')
+    {
+        *ino = namex(mnt, name + 1, AX_FS_ROOT_INO);
+        if (*ino != 0)
+            inode = inode_get(mnt, *ino);
+    }
+
+    return inode;
+}
+
+/*
+ * Write support. Data written to blocks which are not allocated is buffered
+ * in delayed pages of the inode, and blocks are allocated when the inode is
+ * written back, so a file written by small writes still gets contiguous
+ * blocks. Bitmaps, group descriptors and inodes are changed through the
+ * block cache, which writes them back later.
+ */
+static inline bool bitmap_test(const uint8_t *bitmap, uint32_t bit)
+{
+    return (bitmap[bit / 8] & (0x80 >> (bit % 8))) != 0;
+}
+
+static inline void bitmap_set(uint8_t *bitmap, uint32_t bit, bool value)
+{
+    if (value)
+        bitmap[bit / 8] |= 0x80 >> (bit % 8);
+    else
+        bitmap[bit / 8] &= ~(0x80 >> (bit % 8));
+}
+
+/* Blocks in the group, the last group may be smaller */
+static inline uint32_t group_block_count(const struct ax_mount *mnt,
+                                         uint32_t group)
+{
+    return KMIN(AX_FS_BLOCKS_PER_GROUP,
+                mnt->sb.s_blocks_count - group * AX_FS_BLOCKS_PER_GROUP);
+}
+
+/*
+ * Allocate up to count free blocks in a row from bit start of the group,
+ * the run has min blocks at least. Returns the first block and sets got,
+ * 0 if there is no such run.
+ */
+static uint32_t group_alloc_blocks(struct ax_mount *mnt, uint32_t group,
+                                   uint32_t start, uint32_t min,
+                                   uint32_t count, uint32_t *got, bool *error)
+{
+    uint32_t size = group_block_count(mnt, group);
+    uint32_t first = 0;
+    uint32_t length = 0;
+    uint8_t *bitmap = NULL;
+    struct bio *bio = block_read(mnt->device,
+                                 mnt->groups[group].bg_block_bitmap);
+
+    if (!bio)
+    {
+        *error = true;
+        return 0;
+    }
+
+    bio_mark_metadata(bio);
+    bitmap = (uint8_t *)bio_data(bio);
+
+    for (uint32_t bit = start; bit < size && length < count; ++bit)
+    {
+        if (!bitmap_test(bitmap, bit))
+        {
+            if (length++ == 0)
+                first = bit;
+        }
+        else if (length >= min)
+        {
+            break;
+        }
+        else
+        {
+            length = 0;
+        }
+    }
+
+    if (length < min)
+    {
+        block_release(bio);
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < length; ++i)
+        bitmap_set(bitmap, first + i, true);
+
+    bio_write(bio);
+    block_release(bio);
+
+    mnt->groups[group].bg_free_blocks_count -= length;
+    mnt->sb.s_free_blocks_count -= length;
+    group_write(mnt, group);
+
+    *got = length;
+    return group * AX_FS_BLOCKS_PER_GROUP + AX_FS_SUPER_BLOCK_NO + first;
+}
+
+/*
+ * Allocate up to count contiguous blocks near goal. Groups are searched
+ * from the group of goal for count free blocks in a row, otherwise the
+ * first free blocks are taken. Returns the first block and sets got, 0 if
+ * no block is free.
+ */
+static uint32_t alloc_blocks(struct ax_mount *mnt, uint32_t goal,
+                             uint32_t count, uint32_t *got)
+{
+    uint32_t goal_group = 0;
+    uint32_t goal_bit = 0;
+    uint32_t min = count;
+    bool error = false;
+
+    if (goal >= AX_FS_SUPER_BLOCK_NO &&
+        goal - AX_FS_SUPER_BLOCK_NO < mnt->sb.s_blocks_count)
+    {
+        goal_group = (goal - AX_FS_SUPER_BLOCK_NO) / AX_FS_BLOCKS_PER_GROUP;
+        goal_bit = (goal - AX_FS_SUPER_BLOCK_NO) % AX_FS_BLOCKS_PER_GROUP;
+    }
+
+    for (;;)
+    {
+        /* The group of goal is searched from goal, and from 0 at last */
+        for (uint32_t i = 0; i <= mnt->group_count && !error; ++i)
+        {
+            uint32_t group = (goal_group + i) % mnt->group_count;
+            uint32_t block = 0;
+
+            if (mnt->groups[group].bg_free_blocks_count < min)
+                continue;
+
+            block = group_alloc_blocks(mnt, group, i == 0 ? goal_bit : 0,
+                                       min, count, got, &error);
+            if (block != 0)
+                return block;
+        }
+
+        if (error || min == 1)
+            return 0;
+
+        min = 1;
+    }
+}
+
+/* Free count blocks from block, they may be in several groups */
+static void free_blocks(struct ax_mount *mnt, uint32_t block, uint32_t count)
+{
+    while (count > 0 && block >= AX_FS_SUPER_BLOCK_NO &&
+           block - AX_FS_SUPER_BLOCK_NO < mnt->sb.s_blocks_count)
+    {
+        uint32_t group =
+            (block - AX_FS_SUPER_BLOCK_NO) / AX_FS_BLOCKS_PER_GROUP;
+        uint32_t bit = (block - AX_FS_SUPER_BLOCK_NO) % AX_FS_BLOCKS_PER_GROUP;
+        uint32_t length = KMIN(count, AX_FS_BLOCKS_PER_GROUP - bit);
+        uint8_t *bitmap = NULL;
+        struct bio *bio = block_read(mnt->device,
+                                     mnt->groups[group].bg_block_bitmap);
+
+        if (!bio)
+            return ;
+
+        bio_mark_metadata(bio);
+        bitmap = (uint8_t *)bio_data(bio);
+        for (uint32_t i = 0; i < length; ++i)
+            bitmap_set(bitmap, bit + i, false);
+
+        bio_write(bio);
+        block_release(bio);
+
+        mnt->groups[group].bg_free_blocks_count += length;
+        mnt->sb.s_free_blocks_count += length;
+        group_write(mnt, group);
+
+        block += length;
+        count -= length;
+    }
+}
+
+/* Blocks are freed in runs, a run is freed at a gap */
+struct free_run
+{
+    uint32_t start;
+    uint32_t count;
+};
+
+static void free_run_add(struct ax_mount *mnt, struct free_run *run,
+                         uint32_t block)
+{
+    if (run->count > 0 && run->start + run->count == block)
+    {
+        run->count += 1;
+        return ;
+    }
+
+    free_blocks(mnt, run->start, run->count);
+    run->start = block;
+    run->count = 1;
+}
+
+/* Allocate an inode number, from the goal group first. 0 if none is free */
+static uint32_t alloc_inode_no(struct ax_mount *mnt, uint32_t goal_group)
+{
+    uint32_t size = KMIN(mnt->sb.s_inodes_per_group, AX_FS_BLOCKS_PER_GROUP);
+
+    for (uint32_t i = 0; i < mnt->group_count; ++i)
+    {
+        uint32_t group = (goal_group + i) % mnt->group_count;
+        uint32_t bit = 0;
+        uint8_t *bitmap = NULL;
+        struct bio *bio = NULL;
+
+        if (mnt->groups[group].bg_free_inodes_count == 0)
+            continue;
+
+        bio = block_read(mnt->device, mnt->groups[group].bg_inode_bitmap);
+        if (!bio)
+            return 0;
+
+        bio_mark_metadata(bio);
+        bitmap = (uint8_t *)bio_data(bio);
+        while (bit < size && bitmap_test(bitmap, bit))
+            ++bit;
+
+        if (bit == size)
+        {
+            block_release(bio);
+            continue;
+        }
+
+        bitmap_set(bitmap, bit, true);
+        bio_write(bio);
+        block_release(bio);
+
+        mnt->groups[group].bg_free_inodes_count -= 1;
+        mnt->sb.s_free_inodes_count -= 1;
+        group_write(mnt, group);
+        return group * mnt->sb.s_inodes_per_group + bit + 1;
+    }
+
+    return 0;
+}
+
+static void free_inode_no(struct ax_mount *mnt, uint32_t ino)
+{
+    uint32_t group = inode_bg_index(&mnt->sb, ino);
+    struct bio *bio = block_read(mnt->device,
+                                 mnt->groups[group].bg_inode_bitmap);
+
+    if (!bio)
+        return ;
+
+    bio_mark_metadata(bio);
+    bitmap_set((uint8_t *)bio_data(bio), inode_index_in_bg(&mnt->sb, ino),
+               false);
+    bio_write(bio);
+    block_release(bio);
+
+    mnt->groups[group].bg_free_inodes_count += 1;
+    mnt->sb.s_free_inodes_count += 1;
+    group_write(mnt, group);
+}
+
+static bool block_load(uint8_t device, uint32_t block, void *buffer)
+{
+    struct bio *bio = block_read(device, block);
+
+    if (!bio)
+        return false;
+
+    bio_mark_metadata(bio);
+    memcpy(buffer, bio_data(bio), AX_FS_BLOCK_SIZE);
+    block_release(bio);
+    return true;
+}
+
+/* Write buffer to the metadata block, zeros if buffer is NULL */
+static bool block_store(uint8_t device, uint32_t block, const void *buffer)
+{
+    struct bio *bio = block_read(device, block);
+
+    if (!bio)
+        return false;
+
+    bio_mark_metadata(bio);
+    if (buffer)
+        memcpy(bio_data(bio), buffer, AX_FS_BLOCK_SIZE);
+    else
+        memset(bio_data(bio), 0, AX_FS_BLOCK_SIZE);
+
+    bio_write(bio);
+    block_release(bio);
+    return true;
+}
+
+/* Allocate a zeroed indirect block near goal, 0 on failure */
+static uint32_t alloc_table(struct ax_mount *mnt, uint32_t goal)
+{
+    uint32_t got = 0;
+    uint32_t block = alloc_blocks(mnt, goal, 1, &got);
+
+    if (block != 0 && !block_store(mnt->device, block, NULL))
+    {
+        free_blocks(mnt, block, 1);
+        block = 0;
+    }
+
+    return block;
+}
+
+/*
+ * Map the block index of a block mapped inode to block, missing indirect
+ * blocks are allocated near it.
+ */
+static bool block_map_set(struct inode_entry *entry, uint32_t index,
+                          uint32_t block)
+{
+    struct ax_inode *inode = &entry->inode;
+    uint32_t *slot = NULL;
+    uint32_t table = 0;
+    uint32_t level = 1;
+    uint32_t span = 1;
+
+    if (index < AX_FS_DIRECT_BLOCK_COUNT)
+    {
+        inode->i_block[index] = block;
+        entry->dirty = true;
+        return true;
+    }
+
+    index -= AX_FS_DIRECT_BLOCK_COUNT;
+    for (; level <= 3; ++level)
+    {
+        span *= AX_FS_BLOCK_ENTRIES;
+        if (index < span)
+            break;
+        index -= span;
+    }
+
+    if (level > 3)
+        return false;
+
+    slot = &inode->i_block[AX_FS_1_INDIRECT_BLOCK_INDEX + level - 1];
+    if (*slot == 0)
+    {
+        *slot = alloc_table(entry->mnt, block);
+        if (*slot == 0)
+            return false;
+        entry->dirty = true;
+    }
+
+    /* Go down the tables, a missing one is linked after allocating it */
+    for (table = *slot; level > 0; --level)
+    {
+        struct bio *bio = block_read(entry->device, table);
+        uint32_t *entries = NULL;
+        uint32_t pos = 0;
+        uint32_t next = 0;
+
+        if (!bio)
+            return false;
+
+        bio_mark_metadata(bio);
+        span /= AX_FS_BLOCK_ENTRIES;
+        pos = index / span;
+        index %= span;
+        entries = (uint32_t *)bio_data(bio);
+
+        if (level == 1)
+        {
+            entries[pos] = block;
+            bio_write(bio);
+            block_release(bio);
+            return true;
+        }
+
+        next = entries[pos];
+        block_release(bio);
+
+        if (next == 0)
+        {
+            next = alloc_table(entry->mnt, block);
+            if (next == 0 ||
+                !metadata_write(entry->device, table, pos * sizeof(uint32_t),
+                                &next, sizeof(next)))
+                return false;
+        }
+
+        table = next;
+    }
+
+    return false;
+}
+
+/* Free the indirect block of level and the blocks it maps */
+static void table_free(struct inode_entry *entry, uint32_t table,
+                       uint32_t level, struct free_run *run)
+{
+    uint32_t *entries = kmalloc(AX_FS_BLOCK_SIZE);
+
+    if (entries && block_load(entry->device, table, entries))
+    {
+        for (uint32_t i = 0; i < AX_FS_BLOCK_ENTRIES; ++i)
+        {
+            if (entries[i] == 0)
+                continue;
+
+            if (level > 1)
+                table_free(entry, entries[i], level - 1, run);
+            else
+                free_run_add(entry->mnt, run, entries[i]);
+        }
+    }
+
+    if (entries)
+        kfree(entries);
+
+    free_run_add(entry->mnt, run, table);
+}
+
+static void extent_init(struct ax_inode *inode)
+{
+    struct ax_extent_header *header = (struct ax_extent_header *)inode->i_block;
+
+    memset(inode->i_block, 0, sizeof(inode->i_block));
+    header->eh_magic = AX_EXT_MAGIC;
+    header->eh_entries = 0;
+    header->eh_max = AX_EXT_ROOT_MAX;
+    header->eh_depth = 0;
+}
+
+/* Insert extent at pos of the node, it has room */
+static void extent_node_insert(struct ax_extent_header *node, uint32_t pos,
+                               const struct ax_extent *extent)
+{
+    struct ax_extent *entries = (struct ax_extent *)(node + 1);
+
+    for (uint32_t i = node->eh_entries; i > pos; --i)
+        entries[i] = entries[i - 1];
+    entries[pos] = *extent;
+    node->eh_entries += 1;
+}
+
+/* Blocks reserved for the new nodes of an extent insert */
+struct extent_reserve
+{
+    uint32_t blocks[AX_EXT_MAX_DEPTH + 1];
+    uint32_t count;
+};
+
+/*
+ * Reserve a block for each node which an insert into a full leaf splits,
+ * the leaf and full ancestors above it. Returns false if any fails, then
+ * no block is kept.
+ */
+static bool extent_reserve_blocks(struct inode_entry *entry,
+                                  struct extent_reserve *reserve,
+                                  uint32_t count, uint32_t goal)
+{
+    uint32_t got = 0;
+
+    while (reserve->count < count)
+    {
+        uint32_t block = alloc_blocks(entry->mnt, goal, 1, &got);
+
+        if (block == 0)
+        {
+            while (reserve->count > 0)
+                free_blocks(entry->mnt, reserve->blocks[--reserve->count], 1);
+            return false;
+        }
+
+        reserve->blocks[reserve->count++] = block;
+    }
+
+    return true;
+}
+
+/*
+ * Insert extent into node of the extent tree, node is the root in the
+ * inode if block is 0, otherwise it is a copy of block which the caller
+ * writes back. Entries of a full root move to a new child, a full node is
+ * split and the index of its new upper half is set to split for the
+ * parent. full is the number of full ancestors right above node which are
+ * split with it, or -1 if the full root can not grow. Blocks of all new
+ * nodes are reserved before any node changes, so a failure does not lose
+ * a half of a split node. Returns 1 if node is split, 0 if not, -1 on
+ * failure.
+ */
+static int extent_insert_node(struct inode_entry *entry,
+                              struct ax_extent_header *node, uint32_t block,
+                              const struct ax_extent *extent,
+                              struct ax_extent *split, int full,
+                              struct extent_reserve *reserve)
+{
+    struct ax_extent *entries = (struct ax_extent *)(node + 1);
+    struct ax_extent *found =
+        (struct ax_extent *)extent_search(node, extent->ee_block);
+    struct ax_extent_header *child = NULL;
+    struct ax_extent insert = *extent;
+    uint32_t pos = found ? found - entries + 1 : 0;
+    uint32_t new_block = 0;
+    int result = -1;
+
+    /* Count this node if it splits, a full root grows unless too deep */
+    if (node->eh_entries < node->eh_max)
+        full = 0;
+    else if (full >= 0 && (block != 0 || node->eh_depth < AX_EXT_MAX_DEPTH))
+        full += 1;
+    else
+        full = -1;
+
+    if (node->eh_depth > 0)
+    {
+        if (node->eh_entries == 0)
+            return -1;
+
+        /* The first index covers extents before all of them */
+        if (!found)
+        {
+            found = &entries[0];
+            found->ee_block = extent->ee_block;
+        }
+
+        child = kmalloc(AX_FS_BLOCK_SIZE);
+        if (!child)
+            return -1;
+
+        if (block_load(entry->device, found->ee_start, child) &&
+            extent_header_valid(child, AX_EXT_NODE_MAX) &&
+            child->eh_depth == node->eh_depth - 1)
+        {
+            result = extent_insert_node(entry, child, found->ee_start,
+                                        extent, &insert, full, reserve);
+            if (result >= 0 &&
+                !block_store(entry->device, found->ee_start, child))
+                result = -1;
+        }
+
+        if (result != 1)
+        {
+            kfree(child);
+            return result;
+        }
+
+        /* The new child follows the split one */
+        pos = found - entries + 1;
+    }
+    else if (found && found->ee_block + found->ee_len == extent->ee_block &&
+             found->ee_start + found->ee_len == extent->ee_start)
+    {
+        /* Extend the extent before it if they are contiguous */
+        found->ee_len += extent->ee_len;
+        return 0;
+    }
+    else if (full != 0)
+    {
+        /* The leaf splits, reserve blocks of all new nodes first */
+        if (full < 0)
+            return -1;
+
+        child = kmalloc(AX_FS_BLOCK_SIZE);
+        if (!child)
+            return -1;
+
+        if (!extent_reserve_blocks(entry, reserve, full, insert.ee_start))
+        {
+            kfree(child);
+            return -1;
+        }
+    }
+
+    if (node->eh_entries < node->eh_max)
+    {
+        if (child)
+            kfree(child);
+        extent_node_insert(node, pos, &insert);
+        return 0;
+    }
+
+    /* The buffer of the split child is reused for the new node */
+    new_block = reserve->blocks[--reserve->count];
+    memset(child, 0, AX_FS_BLOCK_SIZE);
+    child->eh_magic = AX_EXT_MAGIC;
+    child->eh_max = AX_EXT_NODE_MAX;
+    child->eh_depth = node->eh_depth;
+
+    if (block == 0)
+    {
+        /* The tree grows, all entries of the root move to the new child */
+        child->eh_entries = node->eh_entries;
+        memcpy(child + 1, entries, node->eh_entries * sizeof(*entries));
+        extent_node_insert(child, pos, &insert);
+    }
+    else
+    {
+        /* The upper half of the node moves to the new node */
+        uint32_t half = node->eh_entries / 2;
+
+        child->eh_entries = node->eh_entries - half;
+        memcpy(child + 1, &entries[half],
+               child->eh_entries * sizeof(*entries));
+        if (pos > half)
+            extent_node_insert(child, pos - half, &insert);
+    }
+
+    /* The new node is written before anything refers to it */
+    if (!block_store(entry->device, new_block, child))
+    {
+        kfree(child);
+        free_blocks(entry->mnt, new_block, 1);
+        return -1;
+    }
+
+    if (block == 0)
+    {
+        node->eh_depth += 1;
+        node->eh_entries = 1;
+        entries[0].ee_block = ((struct ax_extent *)(child + 1))[0].ee_block;
+        entries[0].ee_len = 0;
+        entries[0].ee_start = new_block;
+        result = 0;
+    }
+    else
+    {
+        uint32_t half = node->eh_entries / 2;
+
+        node->eh_entries = half;
+        if (pos <= half)
+            extent_node_insert(node, pos, &insert);
+
+        split->ee_block = ((struct ax_extent *)(child + 1))[0].ee_block;
+        split->ee_len = 0;
+        split->ee_start = new_block;
+        result = 1;
+    }
+
+    kfree(child);
+    return result;
+}
+
+static bool extent_insert(struct inode_entry *entry,
+                          const struct ax_extent *extent)
+{
+    struct extent_reserve reserve = { { 0 }, 0 };
+    struct ax_extent split;
+    bool success = false;
+
+    entry->dirty = true;
+    success = extent_insert_node(entry,
+                                 (struct ax_extent_header *)entry->inode.i_block,
+                                 0, extent, &split, 0, &reserve) == 0;
+
+    /* Reserved blocks are left if writing a new node fails */
+    while (reserve.count > 0)
+        free_blocks(entry->mnt, reserve.blocks[--reserve.count], 1);
+
+    return success;
+}
+
+/* Free the blocks of extents under node, and the child nodes */
+static void extent_free_node(struct inode_entry *entry,
+                             const struct ax_extent_header *node)
+{
+    const struct ax_extent *entries = (const struct ax_extent *)(node + 1);
+
+    for (uint32_t i = 0; i < node->eh_entries; ++i)
+    {
+        struct ax_extent_header *child = NULL;
+
+        if (node->eh_depth == 0)
+        {
+            free_blocks(entry->mnt, entries[i].ee_start, entries[i].ee_len);
+            continue;
+        }
+
+        child = kmalloc(AX_FS_BLOCK_SIZE);
+        if (child && block_load(entry->device, entries[i].ee_start, child) &&
+            extent_header_valid(child, AX_EXT_NODE_MAX) &&
+            child->eh_depth == node->eh_depth - 1)
+            extent_free_node(entry, child);
+
+        if (child)
+            kfree(child);
+
+        free_blocks(entry->mnt, entries[i].ee_start, 1);
+    }
+}
+
+/*
+ * Map count blocks from the block index of file to blocks from block,
+ * nothing is mapped if it fails so the caller can free the blocks.
+ */
+static bool file_map_set(struct inode_entry *entry, uint32_t index,
+                         uint32_t block, uint32_t count)
+{
+    if (inode_has_extents(entry->mnt, &entry->inode))
+    {
+        struct ax_extent extent = { index, count, block };
+        return extent_insert(entry, &extent);
+    }
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        if (!block_map_set(entry, index + i, block + i))
+        {
+            /* Tables of the blocks mapped before exist, unmap them */
+            while (i-- > 0)
+                block_map_set(entry, index + i, 0);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Block to allocate the block index near, after the block before it */
+static uint32_t block_goal(struct inode_entry *entry, uint32_t index)
+{
+    uint32_t block = 0;
+    uint32_t run = 0;
+    bool error = false;
+
+    if (index > 0)
+        block = file_block_map(entry->mnt, &entry->inode, index - 1, 1,
+                               &run, &error);
+
+    if (block != 0)
+        return block + 1;
+
+    /* The first block of the inode's group */
+    return inode_bg_index(&entry->mnt->sb, entry->ino) *
+        AX_FS_BLOCKS_PER_GROUP + AX_FS_SUPER_BLOCK_NO;
+}
+
+static struct delayed_page * delayed_find(const struct inode_entry *entry,
+                                          uint32_t index)
+{
+    struct delayed_page *page = entry->delayed;
+
+    while (page && page->index < index)
+        page = page->next;
+
+    return page && page->index == index ? page : NULL;
+}
+
+/* Whether the block index of file is buffered */
+static inline bool delayed_test(const struct inode_entry *entry,
+                                uint32_t index)
+{
+    struct delayed_page *page = delayed_find(entry,
+                                             index / AX_FS_BLOCKS_PER_PAGE);
+
+    return page && (page->blocks & (1 << (index % AX_FS_BLOCKS_PER_PAGE)));
+}
+
+/* Find the delayed page of index, a zeroed page is added if it is missing */
+static struct delayed_page * delayed_get(struct inode_entry *entry,
+                                         uint32_t index)
+{
+    struct delayed_page **link = &entry->delayed;
+    struct delayed_page *page = NULL;
+
+    while (*link && (*link)->index < index)
+        link = &(*link)->next;
+
+    if (*link && (*link)->index == index)
+        return *link;
+
+    page = slab_alloc(delayed_cache);
+    if (!page)
+        return NULL;
+
+    page->data = cast_p2v_or_null(pmm_alloc_pages_address(0));
+    if (!page->data)
+    {
+        slab_free(delayed_cache, page);
+        return NULL;
+    }
+
+    memset(page->data, 0, PAGE_SIZE);
+    page->index = index;
+    page->blocks = 0;
+    page->next = *link;
+    *link = page;
+    entry->delayed_count += 1;
+    return page;
+}
+
+static void delayed_free(struct inode_entry *entry, struct delayed_page **link)
+{
+    struct delayed_page *page = *link;
+
+    *link = page->next;
+    entry->delayed_count -= 1;
+    pmm_free_pages_address(CAST_VIRTUAL_TO_PHYSICAL(page->data), 0);
+    slab_free(delayed_cache, page);
+}
+
+static void delayed_free_all(struct inode_entry *entry)
+{
+    while (entry->delayed)
+        delayed_free(entry, &entry->delayed);
+}
+
+/* Drop count buffered blocks from the block index, after writing them */
+static void delayed_clear(struct inode_entry *entry, uint32_t index,
+                          uint32_t count)
+{
+    struct delayed_page **link = &entry->delayed;
+
+    for (uint32_t i = index; i < index + count; ++i)
+    {
+        uint32_t page_index = i / AX_FS_BLOCKS_PER_PAGE;
+
+        while (*link && (*link)->index < page_index)
+            link = &(*link)->next;
+
+        if (!*link || (*link)->index != page_index)
+            continue;
+
+        (*link)->blocks &= ~(1 << (i % AX_FS_BLOCKS_PER_PAGE));
+        if ((*link)->blocks == 0)
+            delayed_free(entry, link);
+    }
+}
+
+/*
+ * Write count buffered blocks from the block index of file to blocks from
+ * block on disk through the block cache, a bio which the run covers is
+ * not read from disk.
+ */
+static bool delayed_write_run(struct inode_entry *entry, uint32_t index,
+                              uint32_t block, uint32_t count)
+{
+    uint64_t start = SECTOR_NO((uint64_t)block);
+    uint64_t end = SECTOR_NO((uint64_t)block + count);
+
+    for (uint32_t i = 0; i < count;)
+    {
+        uint64_t sector = SECTOR_NO((uint64_t)block + i);
+        struct bio *bio = bio_get(entry->device, sector);
+        uint32_t blocks = 0;
+
+        if (bio_first_sector(bio) >= start && bio_last_sector(bio) < end)
+        {
+            bio_wait(bio);
+        }
+        else if (!bio_read(bio))
+        {
+            bio_release(bio);
+            return false;
+        }
+
+        blocks = KMIN(count - i, (bio_last_sector(bio) + 1 - sector) /
+                      AX_FS_SECTORS_PER_BLOCK);
+
+        for (uint32_t j = 0; j < blocks; ++j, ++i)
+        {
+            uint32_t logical = index + i;
+            struct delayed_page *page =
+                delayed_find(entry, logical / AX_FS_BLOCKS_PER_PAGE);
+
+            memcpy(bio_data(bio) + j * AX_FS_BLOCK_SIZE,
+                   page->data + (logical % AX_FS_BLOCKS_PER_PAGE) *
+                   AX_FS_BLOCK_SIZE, AX_FS_BLOCK_SIZE);
+        }
+
+        bio_write(bio);
+        bio_release(bio);
+    }
+
+    return true;
+}
+
+/*
+ * Allocate blocks for the delayed data of the locked inode and write it,
+ * then write the inode. Each run of buffered blocks gets blocks in a row
+ * after the block before it, or in the inode's group.
+ */
+static bool inode_writeback(struct inode_entry *entry)
+{
+    while (entry->delayed)
+    {
+        struct delayed_page *page = entry->delayed;
+        uint32_t index = page->index * AX_FS_BLOCKS_PER_PAGE;
+        uint32_t count = 0;
+        uint32_t block = 0;
+        uint32_t got = 0;
+
+        while (!(page->blocks & (1 << (index % AX_FS_BLOCKS_PER_PAGE))))
+            ++index;
+
+        while (delayed_test(entry, index + count))
+            ++count;
+
+        block = alloc_blocks(entry->mnt, block_goal(entry, index), count, &got);
+        if (block == 0)
+            return false;
+
+        if (!delayed_write_run(entry, index, block, got) ||
+            !file_map_set(entry, index, block, got))
+        {
+            free_blocks(entry->mnt, block, got);
+            return false;
+        }
+
+        delayed_clear(entry, index, got);
+    }
+
+    if (entry->dirty)
+    {
+        if (!inode_write(entry->mnt, entry->ino, &entry->inode))
+            return false;
+        entry->dirty = false;
+    }
+
+    return true;
+}
+
+/* Free all blocks and delayed data of the locked inode, it becomes empty */
+static bool inode_truncate(struct inode_entry *entry)
+{
+    struct ax_mount *mnt = entry->mnt;
+    struct ax_inode *inode = &entry->inode;
+    struct free_run run = { 0, 0 };
+
+    delayed_free_all(entry);
+
+    if (inode_has_extents(mnt, inode))
+    {
+        extent_free_node(entry,
+                         (const struct ax_extent_header *)inode->i_block);
+    }
+    else
+    {
+        for (uint32_t i = 0; i < AX_FS_DIRECT_BLOCK_COUNT; ++i)
+        {
+            if (inode->i_block[i] != 0)
+                free_run_add(mnt, &run, inode->i_block[i]);
+        }
+
+        for (uint32_t level = 1; level <= 3; ++level)
+        {
+            uint32_t table =
+                inode->i_block[AX_FS_1_INDIRECT_BLOCK_INDEX + level - 1];
+
+            if (table != 0)
+                table_free(entry, table, level, &run);
+        }
+    }
+
+    free_blocks(mnt, run.start, run.count);
+
+    if (mnt->sb.s_feature_incompat & AX_FEATURE_INCOMPAT_EXTENTS)
+        extent_init(inode);
+    else
+        memset(inode->i_block, 0, sizeof(inode->i_block));
+
+    inode->i_size = 0;
+    entry->dirty = true;
+
+    if (!inode_write(mnt, entry->ino, inode))
+        return false;
+
+    entry->dirty = false;
+    return true;
+}
+
+/*
+ * Write buffer to the locked file at pos. Allocated blocks are changed in
+ * the block cache, others are buffered in delayed pages.
+ */
+static int write_file(struct inode_entry *entry, uint64_t pos,
+                      const char *buffer, size_t size)
+{
+    struct ax_inode *inode = &entry->inode;
+    const char *begin = buffer;
+
+    while (size > 0)
+    {
+        uint32_t block_index = pos / AX_FS_BLOCK_SIZE;
+        uint32_t block_pos = pos % AX_FS_BLOCK_SIZE;
+        uint32_t bytes = KMIN(size, AX_FS_BLOCK_SIZE - block_pos);
+        uint32_t run = 0;
+        bool error = false;
+        uint32_t block = file_block_map(entry->mnt, inode, block_index, 1,
+                                        &run, &error);
+
+        if (error)
+            break;
+
+        if (block != 0)
+        {
+            struct bio *bio = block_read(entry->device, block);
+
+            if (!bio)
+                break;
+
+            memcpy(bio_data(bio) + block_pos, buffer, bytes);
+            bio_write(bio);
+            block_release(bio);
+        }
+        else
+        {
+            uint32_t offset = block_index % AX_FS_BLOCKS_PER_PAGE;
+            struct delayed_page *page =
+                delayed_get(entry, block_index / AX_FS_BLOCKS_PER_PAGE);
+
+            if (!page)
+                break;
+
+            memcpy(page->data + offset * AX_FS_BLOCK_SIZE + block_pos,
+                   buffer, bytes);
+            page->blocks |= 1 << offset;
+        }
+
+        pos += bytes;
+        buffer += bytes;
+        size -= bytes;
+
+        if (pos > inode->i_size)
+        {
+            inode->i_size = pos;
+            entry->dirty = true;
+        }
+    }
+
+    /* Bound memory of delayed data */
+    if (entry->delayed_count > AX_DELAYED_MAX_PAGES &&
+        !inode_writeback(entry))
+        return -1;
+
+    return buffer == begin && size > 0 ? -1 : buffer - begin;
+}
+
+/*
+ * Add an entry into the directory block if it has room, a free entry is
+ * reused, or the space after an entry is split from it.
+ */
+static bool block_add_entry(char *data, const char *name, size_t length,
+                            uint32_t ino)
+{
+    uint32_t need = AX_DIR_REC_LEN(length);
+    struct ax_directory_entry *entry = NULL;
+
+    for (uint32_t offset = 0; offset < AX_FS_BLOCK_SIZE;
+         offset += entry->rec_len)
+    {
+        uint32_t used = 0;
+
+        entry = (struct ax_directory_entry *)(data + offset);
+        if (entry->rec_len == 0 || offset + entry->rec_len > AX_FS_BLOCK_SIZE)
+            break;
+
+        if (entry->inode != 0)
+            used = AX_DIR_REC_LEN(entry->name_len);
+
+        if (entry->rec_len < used + need)
+            continue;
+
+        if (used > 0)
+        {
+            struct ax_directory_entry *next =
+                (struct ax_directory_entry *)(data + offset + used);
+
+            next->rec_len = entry->rec_len - used;
+            entry->rec_len = used;
+            entry = next;
+        }
+
+        entry->inode = ino;
+        entry->name_len = length;
+        entry->file_type = AX_FT_REG_FILE;
+        memcpy(entry->name, name, length);
+        return true;
+    }
+
+    return false;
+}
+
+/*
+ * Add the entry into the logical block of directory. Returns 1 if it is
+ * added, 0 if the block is full, -1 on failure.
+ */
+static int dir_block_add(struct inode_entry *dir, uint32_t index,
+                         const char *name, size_t length, uint32_t ino)
+{
+    bool error = false;
+    struct bio *bio = dir_block_read(dir->device, &dir->inode, index, &error);
+    int result = 0;
+
+    if (!bio)
+        return -1;
+
+    if (block_add_entry(bio_data(bio), name, length, ino))
+    {
+        bio_write(bio);
+        result = 1;
+    }
+
+    block_release(bio);
+    return result;
+}
+
+/* Append a block of data to the directory at the logical block index */
+static bool dir_append_block(struct inode_entry *dir, uint32_t index,
+                             const void *data)
+{
+    uint32_t got = 0;
+    uint32_t block = alloc_blocks(dir->mnt, block_goal(dir, index), 1, &got);
+
+    if (block == 0)
+        return false;
+
+    if (!block_store(dir->device, block, data) ||
+        !block_map_set(dir, index, block))
+    {
+        free_blocks(dir->mnt, block, 1);
+        return false;
+    }
+
+    dir->inode.i_size = KMAX(dir->inode.i_size,
+                             (uint64_t)(index + 1) * AX_FS_BLOCK_SIZE);
+    dir->dirty = true;
+    return true;
+}
+
+/* Add the entry to the first block having room, or to a new block */
+static bool dir_linear_add(struct inode_entry *dir, const char *name,
+                           size_t length, uint32_t ino)
+{
+    struct ax_directory_entry *entry = NULL;
+    char *data = NULL;
+    uint32_t index = 0;
+    bool success = false;
+
+    for (;; ++index)
+    {
+        bool error = false;
+        int result = 0;
+
+        if (block_map(dir->device, &dir->inode, index, &error) == 0)
+        {
+            if (error)
+                return false;
+            break;
+        }
+
+        result = dir_block_add(dir, index, name, length, ino);
+        if (result != 0)
+            return result > 0;
+    }
+
+    data = kmalloc(AX_FS_BLOCK_SIZE);
+    if (!data)
+        return false;
+
+    memset(data, 0, AX_FS_BLOCK_SIZE);
+    entry = (struct ax_directory_entry *)data;
+    entry->rec_len = AX_FS_BLOCK_SIZE;
+    block_add_entry(data, name, length, ino);
+
+    success = dir_append_block(dir, index, data);
+    kfree(data);
+    return success;
+}
+
+/* Entry of a leaf block being split, sorted by hash */
+struct dx_sort_entry
+{
+    uint32_t hash;
+    const struct ax_directory_entry *entry;
+};
+
+/* Pack entries into the leaf block, the last one covers the rest */
+static void dx_pack(char *data, const struct dx_sort_entry *sorted,
+                    uint32_t count)
+{
+    struct ax_directory_entry *last = (struct ax_directory_entry *)data;
+    uint32_t offset = 0;
+
+    memset(data, 0, AX_FS_BLOCK_SIZE);
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        uint32_t rec_len = AX_DIR_REC_LEN(sorted[i].entry->name_len);
+
+        last = (struct ax_directory_entry *)(data + offset);
+        memcpy(last, sorted[i].entry,
+               sizeof(*last) + sorted[i].entry->name_len);
+        last->rec_len = rec_len;
+        offset += rec_len;
+    }
+
+    last->rec_len += AX_FS_BLOCK_SIZE - offset;
+}
+
+/*
+ * Split the full leaf of an indexed directory by hash, buffer holds four
+ * blocks. Entries from the median hash move to a new leaf appended to the
+ * directory, and its index entry is added to the parent index block whose
+ * countlimit is at parent_offset. Entries with the same hash stay in one
+ * leaf.
+ */
+static bool dx_split_leaf(struct inode_entry *dir, uint32_t parent,
+                          uint32_t parent_offset, uint32_t leaf,
+                          char *buffer, uint32_t *split_hash,
+                          uint32_t *new_leaf)
+{
+    char *old = buffer;
+    char *lower = buffer + AX_FS_BLOCK_SIZE;
+    char *upper = buffer + 2 * AX_FS_BLOCK_SIZE;
+    struct dx_sort_entry *sorted =
+        (struct dx_sort_entry *)(buffer + 3 * AX_FS_BLOCK_SIZE);
+    struct ax_dx_countlimit *countlimit = NULL;
+    struct ax_dx_entry *entries = NULL;
+    struct ax_directory_entry *entry = NULL;
+    struct bio *bio = NULL;
+    bool error = false;
+    uint32_t block = block_map(dir->device, &dir->inode, leaf, &error);
+    uint32_t count = 0;
+    uint32_t median = 0;
+    uint32_t pos = 0;
+
+    if (block == 0 || !block_load(dir->device, block, old))
+        return false;
+
+    /* Sort entries of the leaf by hash */
+    for (uint32_t offset = 0; offset < AX_FS_BLOCK_SIZE;
+         offset += entry->rec_len)
+    {
+        struct dx_sort_entry sort;
+        uint32_t i = count;
+
+        entry = (struct ax_directory_entry *)(old + offset);
+        if (entry->rec_len == 0)
+            break;
+
+        if (entry->inode == 0 || entry->name_len == 0)
+            continue;
+
+        sort.hash = ax_dx_hash((const char *)entry->name, entry->name_len);
+        sort.entry = entry;
+        for (; i > 0 && sorted[i - 1].hash > sort.hash; --i)
+            sorted[i] = sorted[i - 1];
+        sorted[i] = sort;
+        ++count;
+    }
+
+    if (count < 2)
+        return false;
+
+    median = count / 2;
+    while (median < count && sorted[median].hash == sorted[median - 1].hash)
+        ++median;
+
+    if (median == count)
+    {
+        median = count / 2;
+        while (median > 0 && sorted[median].hash == sorted[median - 1].hash)
+            --median;
+    }
+
+    if (median == 0)
+        return false;
+
+    dx_pack(lower, sorted, median);
+    dx_pack(upper, sorted + median, count - median);
+    *split_hash = sorted[median].hash;
+    *new_leaf = dir->inode.i_size / AX_FS_BLOCK_SIZE;
+
+    if (block_map(dir->device, &dir->inode, *new_leaf, &error) != 0 ||
+        error || !dir_append_block(dir, *new_leaf, upper))
+        return false;
+
+    /* Index the new leaf, and then drop its entries from the old one */
+    bio = dir_block_read(dir->device, &dir->inode, parent, &error);
+    if (!bio)
+        return false;
+
+    countlimit = (struct ax_dx_countlimit *)(bio_data(bio) + parent_offset);
+    entries = (struct ax_dx_entry *)(countlimit + 1);
+    for (pos = countlimit->count;
+         pos > 1 && entries[pos - 1].hash > *split_hash; --pos)
+        entries[pos] = entries[pos - 1];
+
+    entries[pos].hash = *split_hash;
+    entries[pos].block = *new_leaf;
+    countlimit->count += 1;
+    bio_write(bio);
+    block_release(bio);
+
+    return block_store(dir->device, block, lower);
+}
+
+/*
+ * Add the entry to the leaf block of its hash in an indexed directory, a
+ * full leaf is split. Returns 0 if the directory is not indexed, 1 if the
+ * entry is added, -1 on failure. A full index is not grown.
+ */
+static int dx_add_entry(struct inode_entry *dir, const char *name,
+                        size_t length, uint32_t ino)
+{
+    uint32_t hash = ax_dx_hash(name, length);
+    uint32_t parent = 0;
+    uint32_t parent_offset =
+        AX_FS_DX_ROOT_OFFSET + offsetof(struct ax_dx_root, countlimit);
+    uint32_t leaf = 0;
+    uint32_t levels = 0;
+    uint32_t split_hash = 0;
+    uint32_t new_leaf = 0;
+    bool full = false;
+    bool error = false;
+    char *buffer = NULL;
+    struct bio *bio = NULL;
+    struct ax_directory_entry *dotdot = NULL;
+    struct ax_dx_root *root = NULL;
+    int result = 0;
+
+    if (dir->inode.i_block[0] == 0)
+        return 0;
+
+    bio = dir_block_read(dir->device, &dir->inode, 0, &error);
+    if (!bio)
+        return -1;
+
+    dotdot = (struct ax_directory_entry *)(bio_data(bio) + AX_FS_DOT_REC_LEN);
+    root = (struct ax_dx_root *)(bio_data(bio) + AX_FS_DX_ROOT_OFFSET);
+
+    if (dotdot->rec_len != AX_FS_BLOCK_SIZE - AX_FS_DOT_REC_LEN ||
+        root->magic != AX_FS_DX_MAGIC)
+    {
+        block_release(bio);
+        return 0;
+    }
+
+    /* An index of unknown version must not be changed as linear */
+    if (root->hash_version != AX_FS_DX_HASH_FNV ||
+        root->levels > AX_FS_DX_MAX_LEVELS ||
+        !dx_valid(&root->countlimit, AX_FS_DX_ROOT_LIMIT))
+    {
+        block_release(bio);
+        return -1;
+    }
+
+    levels = root->levels;
+    leaf = dx_search(&root->countlimit, root->entries, hash);
+    full = root->countlimit.count >= root->countlimit.limit;
+    block_release(bio);
+
+    if (levels > 0)
+    {
+        struct ax_dx_node *node = NULL;
+
+        parent = leaf;
+        parent_offset = AX_FS_DX_NODE_OFFSET;
+        bio = dir_block_read(dir->device, &dir->inode, parent, &error);
+        if (!bio)
+            return -1;
+
+        node = (struct ax_dx_node *)(bio_data(bio) + AX_FS_DX_NODE_OFFSET);
+        if (!dx_valid(&node->countlimit, AX_FS_DX_NODE_LIMIT))
+        {
+            block_release(bio);
+            return -1;
+        }
+
+        leaf = dx_search(&node->countlimit, node->entries, hash);
+        full = node->countlimit.count >= node->countlimit.limit;
+        block_release(bio);
+    }
+
+    result = dir_block_add(dir, leaf, name, length, ino);
+    if (result != 0)
+        return result;
+
+    if (full)
+        return -1;
+
+    buffer = cast_p2v_or_null(pmm_alloc_pages_address(0));
+    if (!buffer)
+        return -1;
+
+    result = -1;
+    if (dx_split_leaf(dir, parent, parent_offset, leaf, buffer,
+                      &split_hash, &new_leaf))
+        result = dir_block_add(dir, hash >= split_hash ? new_leaf : leaf,
+                               name, length, ino) > 0 ? 1 : -1;
+
+    pmm_free_pages_address(CAST_VIRTUAL_TO_PHYSICAL(buffer), 0);
+    return result;
+}
+
+/*
+ * Create an empty regular file in the locked directory, its inode is
+ * written before the entry refers to it. Returns the inode number, 0 on
+ * failure.
+ */
+static uint32_t dir_create(struct inode_entry *dir, const char *name,
+                           size_t length)
+{
+    struct ax_mount *mnt = dir->mnt;
+    struct ax_inode inode;
+    uint32_t ino = alloc_inode_no(mnt, inode_bg_index(&mnt->sb, dir->ino));
+    int result = 0;
+
+    if (ino == 0)
+        return 0;
+
+    memset(&inode, 0, sizeof(inode));
+    inode.i_mode = AX_S_IFREG;
+    inode.i_links_count = 1;
+    if (mnt->sb.s_feature_incompat & AX_FEATURE_INCOMPAT_EXTENTS)
+        extent_init(&inode);
+
+    if (!inode_write(mnt, ino, &inode))
+    {
+        free_inode_no(mnt, ino);
+        return 0;
+    }
+
+    if (mnt->sb.s_feature_compat & AX_FEATURE_COMPAT_DIR_INDEX)
+        result = dx_add_entry(dir, name, length, ino);
+
+    if (result == 0)
+        result = dir_linear_add(dir, name, length, ino) ? 1 : -1;
+
+    if (dir->dirty && inode_write(mnt, dir->ino, &dir->inode))
+        dir->dirty = false;
+
+    if (result < 0)
+    {
+        free_inode_no(mnt, ino);
+        return 0;
+    }
+
+    dentry_set(mnt->device, dir->ino, name, length, ino);
+    return ino;
+}
+
+/* Create the regular file of path, ino is set to its inode number */
+static struct ax_inode * create_file(struct ax_mount *mnt, const char *path,
+                                     uint32_t *ino)
+{
+    const char *name = path;
+    const char *it = path;
+    char *dir_path = NULL;
+    uint32_t dir_length = 0;
+    uint32_t dir_ino = 0;
+    struct inode_entry *dir = NULL;
+
+    for (; *it != '\0'; ++it)
+    {
+        if (*it == '/')
+            name = it + 1;
+    }
+
+    /* Path of the parent directory is between the first and last '/' */
+    dir_length = name - path - 1;
+    if (*path != '/' || it == name || it - name > 255 ||
+        dir_length >= AX_FS_BLOCK_SIZE)
+        return NULL;
+
+    dir_path = kmalloc(dir_length + 1);
+    if (!dir_path)
+        return NULL;
+
+    memcpy(dir_path, path + 1, dir_length);
+    dir_path[dir_length > 0 ? dir_length - 1 : 0] = '\0';
+    dir_ino = namex(mnt, dir_path, AX_FS_ROOT_INO);
+    kfree(dir_path);
+
+    if (dir_ino == 0)
+        return NULL;
+
+    dir = (struct inode_entry *)inode_get(mnt, dir_ino);
+    if (!dir || dir->inode.i_mode != AX_S_IFDIR)
+    {
+        inode_release((struct ax_inode *)dir);
+        return NULL;
+    }
+
+    inode_lock(dir);
+
+    /* Another process may have created it while locking */
+    *ino = dir_lookup(mnt, &dir->inode, dir_ino, name, it - name);
+    if (*ino == 0)
+        *ino = dir_create(dir, name, it - name);
+
+    inode_unlock(dir);
+    inode_release(&dir->inode);
+
+    return *ino != 0 ? inode_get(mnt, *ino) : NULL;
+}
+
+static void direct_io_complete(struct ide_dma_io *io, bool error)
+{
+    struct direct_io *dio = io->data;
+
+    dio->done = true;
+    dio->error = error;
+    wait_queue_wake_all(&dio->wait);
+}
+
+static void add_direct_segment(struct direct_io *dio, physical_addr_t addr,
+                               size_t size)
+{
+    dio->segments[dio->io.segment_count].addr = addr;
+    dio->segments[dio->io.segment_count].size = size;
+    dio->io.segment_count += 1;
+    dio->io.size += size;
+}
+
+/*
+ * Add segments of a user buffer, each page is pinned in the process so
+ * the disk never writes memory which the process can not write.
+ */
+static bool add_direct_user_buffer(struct direct_io *dio, char *buffer,
+                                   size_t size)
+{
+    while (size > 0)
+    {
+        uint32_t offset = (uint32_t)buffer % PAGE_SIZE;
+        size_t bytes = KMIN(size, PAGE_SIZE - offset);
+        physical_addr_t paddr = 0;
+
+        if ((uint32_t)buffer >= KERNEL_BASE ||
+            !proc_pin_user_page(dio->proc, buffer, true, &paddr))
+            return false;
+
+        add_direct_segment(dio, paddr + offset, bytes);
+        buffer += bytes;
+        size -= bytes;
+    }
+
+    return true;
+}
+
+/* Add segments of a kernel buffer, it must be in the linear mapping */
+static bool add_direct_kernel_buffer(struct direct_io *dio, char *buffer,
+                                     size_t size)
+{
+    if ((uint32_t)buffer < KERNEL_BASE || (uint32_t)buffer >= PG_IO_BASE ||
+        size > PG_IO_BASE - (uint32_t)buffer)
+        return false;
+
+    while (size > 0)
+    {
+        size_t bytes = KMIN(size, PAGE_SIZE - (uint32_t)buffer % PAGE_SIZE);
+
+        add_direct_segment(dio, CAST_VIRTUAL_TO_PHYSICAL(buffer), bytes);
+        buffer += bytes;
+        size -= bytes;
+    }
+
+    return true;
+}
+
+/* Submit the direct IO and wait until it is complete */
+static bool submit_direct_io(struct direct_io *dio)
+{
+    if (dio->io.sector_count == 0)
+        return true;
+
+    /* Dirty cached data of the range is written first */
+    if (!bio_sync_range(dio->io.drive, dio->io.start,
+                        dio->io.start + dio->io.sector_count))
+        return false;
+
+    dio->done = false;
+    dio->error = false;
+    iosched_read(&dio->io);
+
+    while (!dio->done)
+        wait_queue_sleep(&dio->wait);
+
+    dio->io.sector_count = 0;
+    dio->io.size = 0;
+    dio->io.segment_count = 0;
+    return !dio->error;
+}
+
+/*
+ * Read count whole blocks from block_index into buffer by DMA without
+ * the block cache, adjacent blocks on disk are read by one IO. buffer is
+ * user memory of proc, or kernel memory if proc is NULL.
+ */
+static bool read_direct(const struct ax_mount *mnt, struct inode *inode,
+                        uint32_t block_index, uint32_t count, char *buffer,
+                        struct process *proc)
+{
+    struct ax_inode *ax_inode = inode->i_private;
+    struct direct_io dio;
+    uint32_t last = 0;
+    uint32_t block = 0;
+    uint32_t run = 0;
+
+    dio.io.drive = inode->i_device;
+    dio.io.sector_count = 0;
+    dio.io.start = 0;
+    dio.io.buffer = 0;
+    dio.io.size = 0;
+    dio.io.segments = dio.segments;
+    dio.io.segment_count = 0;
+    dio.io.data = &dio;
+    dio.io.complete_func = direct_io_complete;
+    dio.proc = proc;
+    wait_queue_init(&dio.wait);
+
+    for (uint32_t i = 0; i < count; ++i, buffer += AX_FS_BLOCK_SIZE)
+    {
+        bool error = false;
+
+        /* Blocks of a run are contiguous, map the next run after it */
+        if (run == 0)
+            block = file_block_map(mnt, ax_inode, block_index + i,
+                                   count - i, &run, &error);
+        else
+            block += 1;
+
+        if (error)
+            return false;
+
+        run -= 1;
+        if (block == 0)
+        {
+            memset(buffer, 0, AX_FS_BLOCK_SIZE);
+            continue;
+        }
+
+        if (dio.io.sector_count > 0 &&
+            (block != last + 1 ||
+             dio.io.sector_count + AX_FS_SECTORS_PER_BLOCK > IOSCHED_MAX_SECTORS ||
+             dio.io.segment_count + AX_FS_BLOCK_SEGMENTS > IOSCHED_MAX_SEGMENTS))
+        {
+            if (!submit_direct_io(&dio))
+                return false;
+        }
+
+        if (dio.io.sector_count == 0)
+            dio.io.start = SECTOR_NO((uint64_t)block);
+
+        if (!(proc ? add_direct_user_buffer(&dio, buffer, AX_FS_BLOCK_SIZE) :
+              add_direct_kernel_buffer(&dio, buffer, AX_FS_BLOCK_SIZE)))
+            return false;
+
+        dio.io.sector_count += AX_FS_SECTORS_PER_BLOCK;
+        last = block;
+    }
+
+    return submit_direct_io(&dio);
+}
+
+static int read_file(const struct ax_mount *mnt, struct inode *inode,
+                     uint64_t pos, char *buffer, size_t size, bool direct)
+{
+    struct ax_inode *ax_inode = inode->i_private;
+    struct inode_entry *entry = (struct inode_entry *)ax_inode;
+    uint32_t block_index = pos / AX_FS_BLOCK_SIZE;
+    uint32_t block_pos = pos % AX_FS_BLOCK_SIZE;
+    char *begin = buffer;
+
+    /* EOF */
+    if (pos >= ax_inode->i_size)
+        return 0;
+
+    /* Direct IO reads the disk, delayed data is written there first */
+    if (direct && entry->delayed && !inode_writeback(entry))
+        return -1;
+
+    size = KMIN(size, ax_inode->i_size - pos);
+    while (size > 0)
+    {
+        bool error = false;
+        uint32_t run = 0;
+        uint32_t bytes = 0;
+        uint32_t block = 0;
+        struct bio *bio = NULL;
+        uint32_t count = size / AX_FS_BLOCK_SIZE;
+
+        /*
+         * Whole blocks are read to an even buffer by DMA directly, the
+         * unaligned head and tail blocks are read by the block cache.
+         */
+        if (direct && block_pos == 0 && count > 0 &&
+            (uint32_t)buffer % 2 == 0)
+        {
+            /* File reads come from the read system call */
+            if (!read_direct(mnt, inode, block_index, count, buffer,
+                             sched_get_running_proc()))
+                return -1;
+
+            size -= count * AX_FS_BLOCK_SIZE;
+            buffer += count * AX_FS_BLOCK_SIZE;
+            block_index += count;
+            continue;
+        }
+
+        /* Map the run of contiguous blocks which the rest of read needs */
+        count = KMIN((block_pos + size + AX_FS_BLOCK_SIZE - 1) /
+                     AX_FS_BLOCK_SIZE, AX_FS_READ_RUN_MAX);
+        block = file_block_map(mnt, ax_inode, block_index, count,
+                               &run, &error);
+        if (error)
+            return -1;
+
+        bytes = KMIN(size, run * AX_FS_BLOCK_SIZE - block_pos);
+
+        /* A hole reads as zeros unless it is written and not allocated */
+        if (block == 0)
+        {
+            struct delayed_page *page =
+                delayed_find(entry, block_index / AX_FS_BLOCKS_PER_PAGE);
+            uint32_t offset = block_index % AX_FS_BLOCKS_PER_PAGE;
+
+            if (page && (page->blocks & (1 << offset)))
+                memcpy(buffer, page->data + offset * AX_FS_BLOCK_SIZE +
+                       block_pos, bytes);
+            else
+                memset(buffer, 0, bytes);
+        }
+        else
+        {
+            /* The run is read by one IO, and copied out per bio */
+            uint64_t sector = SECTOR_NO((uint64_t)block);
+            uint32_t available = 0;
+
+            bio = bio_get_extent(inode->i_device, sector,
+                                 (run * AX_FS_BLOCK_SIZE + PAGE_SIZE - 1) /
+                                 PAGE_SIZE);
+            if (!bio)
+                return -1;
+
+            if (!bio_read(bio))
+            {
+                block_release(bio);
+                return -1;
+            }
+
+            available = (bio_last_sector(bio) + 1 - sector) * SECTOR_SIZE;
+            bytes = KMIN(bytes, available - block_pos);
+            memcpy(buffer, bio_data(bio) + block_pos, bytes);
+            block_release(bio);
+        }
+
+        size -= bytes;
+        buffer += bytes;
+
+        block_index += (block_pos + bytes) / AX_FS_BLOCK_SIZE;
+        block_pos = (block_pos + bytes) % AX_FS_BLOCK_SIZE;
+    }
+
+    return buffer - begin;
+}
+
+static int ax_mount(struct mount *mount)
+{
+    struct ax_mount *mnt = kmalloc(sizeof(*mnt));
+
+    if (!mnt)
+        return -1;
+
+    memset(mnt, 0, sizeof(*mnt));
+    mnt->device = mount->device;
+
+    if (!get_super_block(&mnt->sb, mnt->device) ||
+        mnt->sb.s_inodes_per_group == 0 ||
+        (mnt->sb.s_feature_incompat & ~AX_FEATURE_INCOMPAT_SUPPORTED))
+    {
+        kfree(mnt);
+        return -1;
+    }
+
+    mnt->group_count = block_group(&mnt->sb);
+
+    /* Another process may have mounted it while reading */
+    if (!get_group_descriptors(mnt) || mount->private_data)
+    {
+        if (mnt->groups)
+            pmm_free_pages_address(CAST_VIRTUAL_TO_PHYSICAL(mnt->groups),
+                                   mnt->groups_order);
+        kfree(mnt);
+        return mount->private_data ? 0 : -1;
+    }
+
+    mount->private_data = mnt;
+    return 0;
+}
+
+static int ax_open(struct file *file)
+{
+    struct ax_mount *mnt = file->f_mount->private_data;
+    int mode = AX_OPEN_MODE(file->f_flags);
+    struct ax_inode *inode;
+    uint32_t ino;
+
+    if ((file->f_flags & ~(O_RDONLY | O_WRONLY | O_RDWR | O_CREAT |
+                           O_TRUNC | O_DIRECT)) ||
+        !(mode == O_RDONLY || mode == O_WRONLY || mode == O_RDWR))
+        return -1;
+
+    inode = namei(mnt, file->f_path, &ino);
+
+    if (!inode && (file->f_flags & O_CREAT))
+        inode = create_file(mnt, file->f_path, &ino);
+
+    if (!inode || inode->i_mode == AX_S_IFDIR)
+    {
+        inode_release(inode);
+        return -1;
+    }
+
+    if ((file->f_flags & O_TRUNC) && mode != O_RDONLY)
+    {
+        struct inode_entry *entry = (struct inode_entry *)inode;
+        bool success = false;
+
+        inode_lock(entry);
+        success = inode_truncate(entry);
+        inode_unlock(entry);
+
+        if (!success)
+        {
+            inode_release(inode);
+            return -1;
+        }
+    }
+
+    file->f_inode->i_ino = ino;
+    file->f_inode->i_private = inode;
+    return 0;
+}
+
+static int ax_close(struct file *file)
+{
+    return inode_release(file->f_inode->i_private) ? 0 : -1;
+}
+
+static int ax_read(struct file *file, char *buffer, size_t size)
+{
+    struct inode_entry *entry = file->f_inode->i_private;
     int read = 0;
+    int mode = AX_OPEN_MODE(file->f_flags);
 
-    if (!(file->f_flags == O_RDONLY || file->f_flags == O_RDWR))
+    if (!(mode == O_RDONLY || mode == O_RDWR))
         return -1;
 
-    read = read_file(file->f_inode, file->f_pos, buffer, size);
+    inode_lock(entry);
+    read = read_file(file->f_mount->private_data, file->f_inode,
+                     file->f_pos, buffer, size,
+                     (file->f_flags & O_DIRECT) != 0);
+    inode_unlock(entry);
 
     if (read > 0)
         file->f_pos += (uint64_t)read;
@@ -322,8 +2936,62 @@ static int ax_read(struct file *file, char *buffer, size_t size)
 
 static int ax_write(struct file *file, const char *buffer, size_t size)
 {
-    (void)file, (void)buffer, (void)size;
-    return -1;
+    struct inode_entry *entry = file->f_inode->i_private;
+    int written = 0;
+    int mode = AX_OPEN_MODE(file->f_flags);
+
+    if (!(mode == O_WRONLY || mode == O_RDWR))
+        return -1;
+
+    inode_lock(entry);
+    written = write_file(entry, file->f_pos, buffer, size);
+    inode_unlock(entry);
+
+    if (written > 0)
+        file->f_pos += (uint64_t)written;
+
+    return written;
+}
+
+/*
+ * Write back delayed data and dirty inodes of the mount, including files
+ * which are still open, then wait until the device's block cache is on
+ * disk.
+ */
+static int ax_sync(struct mount *mount)
+{
+    struct ax_mount *mnt = mount->private_data;
+    bool success = true;
+
+    for (uint32_t i = 0; i < AX_INODE_HASH_SIZE; ++i)
+    {
+        struct inode_entry *entry = inode_hash[i];
+
+        /* A referenced inode stays in the hash while writing back */
+        if (entry)
+            inode_ref(entry);
+
+        while (entry)
+        {
+            struct inode_entry *next = NULL;
+
+            if (entry->mnt == mnt && (entry->dirty || entry->delayed))
+            {
+                inode_lock(entry);
+                if (!inode_writeback(entry))
+                    success = false;
+                inode_unlock(entry);
+            }
+
+            next = entry->hash_next;
+            if (next)
+                inode_ref(next);
+            inode_unref(entry);
+            entry = next;
+        }
+    }
+
+    return bio_sync(mnt->device) && success ? 0 : -1;
 }
 
 static const struct file_operations ops =
@@ -338,5 +3006,7 @@ const struct file_system axfs =
 {
     .name       = "axfs",
     .op         = &ops,
-    .initialize = ax_fs_initialize
+    .initialize = ax_fs_initialize,
+    .mount      = ax_mount,
+    .sync       = ax_sync
 };
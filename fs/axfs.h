@@ -1,6 +1,7 @@
 #ifndef AXFS_H
 #define AXFS_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #define AX_FS_ROOT_INO 1
@@ -19,6 +20,20 @@ struct ax_super_block
     uint32_t s_free_inodes_count;
     uint32_t s_free_blocks_count;
     uint32_t s_inodes_per_group;
+    uint32_t s_feature_compat;      /* Features old kernels can ignore */
+    uint32_t s_feature_incompat;    /* Features needed to read the fs */
+};
+
+/* Values of struct ax_super_block.s_feature_compat */
+enum ax_feature_compat
+{
+    AX_FEATURE_COMPAT_DIR_INDEX = 0x1,  /* Directories may be indexed */
+};
+
+/* Values of struct ax_super_block.s_feature_incompat */
+enum ax_feature_incompat
+{
+    AX_FEATURE_INCOMPAT_EXTENTS = 0x1,  /* Files are mapped by extents */
 };
 
 struct ax_block_group_descriptor
@@ -66,4 +81,109 @@ struct ax_directory_entry
     uint8_t name[0];
 };
 
+/*
+ * Hashed directory index.
+ *
+ * Block 0 of an indexed directory has "." and "..", the ".." entry covers
+ * the rest of the block where the index root is, so the directory is
+ * still a valid linear directory. The root maps hash ranges to logical
+ * blocks of the directory, which are index nodes if levels is 1, or leaf
+ * blocks of normal directory entries. An index node is a block with an
+ * empty entry covering the whole block, followed by its index entries.
+ *
+ * Index entries are sorted by hash, the first one covers hashes from 0,
+ * entries with the same hash are always in the same leaf block.
+ */
+#define AX_FS_DX_MAGIC 0x58444e49   /* "INDX" */
+#define AX_FS_DX_HASH_FNV 1
+#define AX_FS_DX_MAX_LEVELS 1
+
+/* Size of "." entry, ".." entry follows it in block 0 */
+#define AX_FS_DOT_REC_LEN 12
+/* Offset of the index root in block 0, after "." and ".." entries */
+#define AX_FS_DX_ROOT_OFFSET (2 * AX_FS_DOT_REC_LEN)
+/* Offset of index entries in an index node, after the empty entry */
+#define AX_FS_DX_NODE_OFFSET 8
+
+struct ax_dx_entry
+{
+    uint32_t hash;          /* The lowest hash of the block */
+    uint32_t block;         /* Logical block number in directory */
+};
+
+/* Header of index entries */
+struct ax_dx_countlimit
+{
+    uint16_t limit;         /* Max number of entries */
+    uint16_t count;         /* Number of entries */
+};
+
+struct ax_dx_root
+{
+    uint32_t magic;
+    uint8_t hash_version;
+    uint8_t levels;         /* Levels of index nodes under the root */
+    uint16_t reserved;
+    struct ax_dx_countlimit countlimit;
+    struct ax_dx_entry entries[0];
+};
+
+struct ax_dx_node
+{
+    struct ax_dx_countlimit countlimit;
+    struct ax_dx_entry entries[0];
+};
+
+#define AX_FS_DX_ROOT_LIMIT \
+    ((AX_FS_BLOCK_SIZE - AX_FS_DX_ROOT_OFFSET - sizeof(struct ax_dx_root)) / \
+     sizeof(struct ax_dx_entry))
+
+#define AX_FS_DX_NODE_LIMIT \
+    ((AX_FS_BLOCK_SIZE - AX_FS_DX_NODE_OFFSET - sizeof(struct ax_dx_node)) / \
+     sizeof(struct ax_dx_entry))
+
+/* Hash of entry name in directory index, FNV-1a */
+static inline uint32_t ax_dx_hash(const char *name, size_t length)
+{
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < length; ++i)
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+
+    return hash;
+}
+
+/*
+ * Extent mapping of regular files. i_block of the inode holds a header and
+ * extents sorted by logical block. If depth is greater than 0, the entries
+ * are indexes, ee_start is the block of the child node whose entries
+ * start from ee_block, and ee_len is unused. Each node block has a header
+ * at its beginning. Blocks not covered by any extent are holes.
+ */
+#define AX_EXT_MAGIC 0xe47a
+#define AX_EXT_MAX_DEPTH 4
+
+struct ax_extent_header
+{
+    uint16_t eh_magic;
+    uint16_t eh_entries;    /* Number of entries */
+    uint16_t eh_max;        /* Max number of entries */
+    uint16_t eh_depth;      /* 0 if entries are extents */
+};
+
+struct ax_extent
+{
+    uint32_t ee_block;      /* First logical block */
+    uint32_t ee_len;        /* Number of blocks */
+    uint32_t ee_start;      /* First block on disk */
+};
+
+#define AX_EXT_ROOT_MAX \
+    ((sizeof(((struct ax_inode *)0)->i_block) - \
+      sizeof(struct ax_extent_header)) / sizeof(struct ax_extent))
+
+#define AX_EXT_NODE_MAX \
+    ((AX_FS_BLOCK_SIZE - sizeof(struct ax_extent_header)) / \
+     sizeof(struct ax_extent))
+
 #endif /* AXFS_H */
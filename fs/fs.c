@@ -11,13 +11,30 @@ static struct kmem_cache *inode_cache;
 
 extern const struct file_system axfs;
 
-static const struct mount * find_mount(const char *path)
+static struct mount * find_mount(const char *path)
 {
     if (*path != VFS_ROOT_DIR)
         return NULL;
     return &root;
 }
 
+/*
+ * Mount the file system when it is used first, reading metadata needs
+ * interrupt and process context which are not ready in vfs_initialize.
+ */
+static int mount_fs(struct mount *mount)
+{
+    if (!mount->mounted)
+    {
+        if (mount->fs->mount(mount) != 0)
+            return -1;
+
+        mount->mounted = true;
+    }
+
+    return 0;
+}
+
 static inline char *path_dup(const char *path)
 {
     char *dup = kmalloc(strlen(path) + 1);
@@ -74,11 +91,15 @@ void vfs_free_file(struct file *file)
 int vfs_open(struct file *file, const char *path, int flags)
 {
     int error;
+    struct mount *mount = find_mount(path);
 
-    file->f_mount = find_mount(path);
-    if (!file->f_mount)
+    if (!mount)
         panic("Can not find file '%s' mount path.", path);
 
+    if (mount_fs(mount) != 0)
+        return -1;
+
+    file->f_mount = mount;
     file->f_path = path_dup(path);
     file->f_inode = alloc_inode();
     file->f_op = file->f_mount->fs->op;
@@ -111,8 +132,18 @@ int vfs_write(struct file *file, const char *data, size_t bytes)
 
 int vfs_close(struct file *file)
 {
-    file->f_op->close(file);
+    int result = file->f_op->close(file);
+
     free_path(&file->f_path);
     free_inode(&file->f_inode);
-    return 0;
+    return result;
+}
+
+int vfs_sync()
+{
+    /* Nothing is cached before the file system is used */
+    if (!root.mounted)
+        return 0;
+
+    return root.fs->sync(&root);
 }
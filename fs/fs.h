@@ -1,6 +1,7 @@
 #ifndef FS_H
 #define FS_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -11,6 +12,7 @@ enum open_flags
     O_RDWR      = 1 << 2,
     O_CREAT     = 1 << 3,
     O_TRUNC     = 1 << 4,
+    O_DIRECT    = 1 << 5,   /* Transfer whole blocks bypassing the cache */
 };
 
 struct inode;
@@ -50,6 +52,8 @@ struct file_system
     const char *name;                   /* File system name */
     const struct file_operations *op;   /* File operations of file system */
     void (*initialize)();               /* File system initialize function */
+    int (*mount)(struct mount *);       /* Read metadata of the device */
+    int (*sync)(struct mount *);        /* Write cached data to the device */
 };
 
 struct mount
@@ -57,6 +61,8 @@ struct mount
     uint8_t device;                     /* Mount device ID */
     const char *mount_root;             /* File system mount root path */
     const struct file_system *fs;       /* File system type */
+    bool mounted;                       /* File system has been mounted */
+    void *private_data;                 /* Mounted file system data */
 };
 
 void vfs_initialize();
@@ -68,4 +74,7 @@ int vfs_read(struct file *file, char *buffer, size_t bytes);
 int vfs_write(struct file *file, const char *data, size_t bytes);
 int vfs_close(struct file *file);
 
+/* Write cached data of mounted file systems to disk */
+int vfs_sync();
+
 #endif /* FS_H */
@@ -0,0 +1,738 @@
+#include <kernel/ahci.h>
+#include <kernel/iosched.h>
+#include <kernel/klib.h>
+#include <kernel/pic.h>
+#include <mm/paging.h>
+#include <mm/pmm.h>
+
+#define AHCI_MAX_PORTS 32
+#define AHCI_MAX_SLOTS 32
+
+/* Command table is 1KB, so the PRD table has 56 entries */
+#define AHCI_PRDT_ENTRIES 56
+
+/* Loops of polling a register before giving up */
+#define AHCI_SPIN_LIMIT 1000000
+
+#define SATA_SIG_ATA 0x00000101
+
+/* HBA global registers */
+enum hba_cap
+{
+    HBA_CAP_NCS_SHIFT = 8,          /* Number of command slots - 1 */
+    HBA_CAP_NCS_MASK = 0x1f,
+    HBA_CAP_SNCQ = 1 << 30,         /* Native command queuing */
+};
+
+enum hba_ghc
+{
+    HBA_GHC_IE = 1 << 1,            /* Interrupt enable */
+    HBA_GHC_AE = 1u << 31,          /* AHCI enable */
+};
+
+/* Port registers */
+enum port_cmd
+{
+    PORT_CMD_ST = 1 << 0,           /* Start */
+    PORT_CMD_SUD = 1 << 1,          /* Spin-up device */
+    PORT_CMD_POD = 1 << 2,          /* Power on device */
+    PORT_CMD_FRE = 1 << 4,          /* FIS receive enable */
+    PORT_CMD_FR = 1 << 14,          /* FIS receive running */
+    PORT_CMD_CR = 1 << 15,          /* Command list running */
+};
+
+enum port_int
+{
+    PORT_INT_DHRS = 1 << 0,         /* Device to host register FIS */
+    PORT_INT_PSS = 1 << 1,          /* PIO setup FIS */
+    PORT_INT_SDBS = 1 << 3,         /* Set device bits FIS */
+    PORT_INT_IFS = 1 << 27,         /* Interface fatal error */
+    PORT_INT_HBDS = 1 << 28,        /* Host bus data error */
+    PORT_INT_HBFS = 1 << 29,        /* Host bus fatal error */
+    PORT_INT_TFES = 1 << 30,        /* Task file error */
+
+    PORT_INT_ERRORS = PORT_INT_IFS | PORT_INT_HBDS |
+        PORT_INT_HBFS | PORT_INT_TFES,
+};
+
+enum port_tfd
+{
+    PORT_TFD_DRQ = 0x08,
+    PORT_TFD_BSY = 0x80,
+};
+
+enum port_ssts
+{
+    PORT_SSTS_DET_MASK = 0xf,
+    PORT_SSTS_DET_PRESENT = 0x3,    /* Device present, PHY established */
+    PORT_SSTS_IPM_SHIFT = 8,
+    PORT_SSTS_IPM_MASK = 0xf,
+    PORT_SSTS_IPM_ACTIVE = 0x1,
+};
+
+enum ata_command
+{
+    ATA_COMMAND_READ_DMA_EXT = 0x25,
+    ATA_COMMAND_READ_LOG_EXT = 0x2f,
+    ATA_COMMAND_WRITE_DMA_EXT = 0x35,
+    ATA_COMMAND_READ_FPDMA_QUEUED = 0x60,
+    ATA_COMMAND_WRITE_FPDMA_QUEUED = 0x61,
+    ATA_COMMAND_IDENTIFY = 0xec,
+};
+
+/* NCQ command error log page, its first byte is the failed tag */
+#define ATA_LOG_NCQ_ERROR 0x10
+#define NCQ_LOG_TAG_MASK 0x1f
+#define NCQ_LOG_NQ 0x80                 /* Not an NCQ command error */
+
+struct hba_port
+{
+    uint32_t clb;                   /* Command list base address */
+    uint32_t clbu;
+    uint32_t fb;                    /* FIS base address */
+    uint32_t fbu;
+    uint32_t is;                    /* Interrupt status */
+    uint32_t ie;                    /* Interrupt enable */
+    uint32_t cmd;                   /* Command and status */
+    uint32_t reserved0;
+    uint32_t tfd;                   /* Task file data */
+    uint32_t sig;                   /* Signature */
+    uint32_t ssts;                  /* SATA status */
+    uint32_t sctl;                  /* SATA control */
+    uint32_t serr;                  /* SATA error */
+    uint32_t sact;                  /* SATA active, NCQ tags */
+    uint32_t ci;                    /* Command issue */
+    uint32_t sntf;
+    uint32_t fbs;
+    uint32_t reserved1[11];
+    uint32_t vendor[4];
+};
+
+struct hba_memory
+{
+    uint32_t cap;                   /* Host capabilities */
+    uint32_t ghc;                   /* Global host control */
+    uint32_t is;                    /* Interrupt status of ports */
+    uint32_t pi;                    /* Ports implemented */
+    uint32_t vs;
+    uint32_t ccc_ctl;
+    uint32_t ccc_ports;
+    uint32_t em_loc;
+    uint32_t em_ctl;
+    uint32_t cap2;
+    uint32_t bohc;
+    uint8_t reserved[0xa0 - 0x2c];
+    uint8_t vendor[0x100 - 0xa0];
+    struct hba_port ports[AHCI_MAX_PORTS];
+};
+
+/* Register FIS, host to device */
+struct fis_reg_h2d
+{
+    uint8_t type;
+    uint8_t flags;                  /* Bit 7 is set for command */
+    uint8_t command;
+    uint8_t feature_lo;
+    uint8_t lba0;
+    uint8_t lba1;
+    uint8_t lba2;
+    uint8_t device;
+    uint8_t lba3;
+    uint8_t lba4;
+    uint8_t lba5;
+    uint8_t feature_hi;
+    uint8_t count_lo;
+    uint8_t count_hi;
+    uint8_t icc;
+    uint8_t control;
+    uint8_t reserved[4];
+};
+
+#define FIS_TYPE_REG_H2D 0x27
+#define FIS_FLAG_COMMAND 0x80
+#define FIS_DEVICE_LBA 0x40
+
+struct command_header
+{
+    uint16_t flags;                 /* FIS length in dwords, write bit */
+    uint16_t prdtl;                 /* PRD table entries */
+    uint32_t prdbc;                 /* Transferred bytes */
+    uint32_t ctba;                  /* Command table base address */
+    uint32_t ctbau;
+    uint32_t reserved[4];
+};
+
+#define COMMAND_HEADER_WRITE 0x40
+
+struct prd_entry
+{
+    uint32_t dba;                   /* Data base address */
+    uint32_t dbau;
+    uint32_t reserved;
+    uint32_t dbc;                   /* Bytes - 1, bit 0 is always set */
+};
+
+struct command_table
+{
+    uint8_t cfis[64];
+    uint8_t acmd[16];
+    uint8_t reserved[48];
+    struct prd_entry prdt[AHCI_PRDT_ENTRIES];
+};
+
+/* Command list is 1KB, received FIS is 256 bytes, share one page */
+#define RECEIVED_FIS_OFFSET 0x400
+
+/* IO occupying a command slot */
+struct slot_io
+{
+    struct ide_dma_io io;
+    uint8_t retry;
+    uint8_t write;
+};
+
+struct port
+{
+    volatile struct hba_port *regs;
+    volatile struct command_header *cmd_list;
+    volatile struct command_table *cmd_tables;
+    uint8_t exist;
+    uint8_t ncq;                    /* Use NCQ commands */
+    uint8_t index;                  /* Port number */
+    uint32_t depth;                 /* Command slots in use at most */
+    uint32_t busy;                  /* Bitmap of used command slots */
+    uint64_t sectors;               /* Total sectors */
+    char model[41];                 /* Model string */
+    struct slot_io slots[AHCI_MAX_SLOTS];
+};
+
+static volatile struct hba_memory *hba;
+static struct port ports[AHCI_MAX_PORTS];
+static struct port *dev_ports[IOSCHED_MAX_DEVICES];
+
+/* Buffer of NCQ error log, ports are recovered one by one in IRQ ISR */
+static physical_addr_t log_buffer;
+
+static bool wait_clear(volatile uint32_t *reg, uint32_t bits)
+{
+    for (uint32_t i = 0; i < AHCI_SPIN_LIMIT; ++i)
+    {
+        if (!(*reg & bits))
+            return true;
+    }
+
+    return false;
+}
+
+static bool stop_port(struct port *p)
+{
+    p->regs->cmd &= ~PORT_CMD_ST;
+    if (!wait_clear(&p->regs->cmd, PORT_CMD_CR))
+        return false;
+
+    p->regs->cmd &= ~PORT_CMD_FRE;
+    return wait_clear(&p->regs->cmd, PORT_CMD_FR);
+}
+
+static bool start_port(struct port *p)
+{
+    p->regs->serr = 0xffffffff;
+    p->regs->is = 0xffffffff;
+    p->regs->cmd |= PORT_CMD_FRE | PORT_CMD_SUD | PORT_CMD_POD;
+
+    if (!wait_clear(&p->regs->tfd, PORT_TFD_BSY | PORT_TFD_DRQ))
+        return false;
+
+    p->regs->cmd |= PORT_CMD_ST;
+    return true;
+}
+
+static void fill_command_fis(volatile struct command_table *table,
+                             uint8_t command, uint64_t start, uint16_t count,
+                             uint32_t tag, bool ncq)
+{
+    volatile struct fis_reg_h2d *fis = (volatile void *)table->cfis;
+
+    fis->type = FIS_TYPE_REG_H2D;
+    fis->flags = FIS_FLAG_COMMAND;
+    fis->command = command;
+    fis->device = command == ATA_COMMAND_READ_DMA_EXT ||
+        command == ATA_COMMAND_WRITE_DMA_EXT ||
+        command == ATA_COMMAND_READ_FPDMA_QUEUED ||
+        command == ATA_COMMAND_WRITE_FPDMA_QUEUED ? FIS_DEVICE_LBA : 0;
+    fis->lba0 = start & 0xff;
+    fis->lba1 = (start >> 8) & 0xff;
+    fis->lba2 = (start >> 16) & 0xff;
+    fis->lba3 = (start >> 24) & 0xff;
+    fis->lba4 = (start >> 32) & 0xff;
+    fis->lba5 = (start >> 40) & 0xff;
+    fis->icc = 0;
+    fis->control = 0;
+
+    if (ncq)
+    {
+        /* NCQ commands put sector count in feature, tag in count */
+        fis->feature_lo = count & 0xff;
+        fis->feature_hi = (count >> 8) & 0xff;
+        fis->count_lo = tag << 3;
+        fis->count_hi = 0;
+    }
+    else
+    {
+        fis->feature_lo = 0;
+        fis->feature_hi = 0;
+        fis->count_lo = count & 0xff;
+        fis->count_hi = (count >> 8) & 0xff;
+    }
+}
+
+/* Fill PRD table, returns the number of entries */
+static uint32_t fill_prdt(volatile struct command_table *table,
+                          const struct ide_dma_io *io)
+{
+    uint32_t count = io->segments ? io->segment_count : 1;
+
+    if (count > AHCI_PRDT_ENTRIES)
+        panic("[AHCI] - too many segments: %u.", count);
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        physical_addr_t addr = io->segments ? io->segments[i].addr : io->buffer;
+        size_t size = io->segments ? io->segments[i].size : io->size;
+
+        table->prdt[i].dba = addr;
+        table->prdt[i].dbau = 0;
+        table->prdt[i].reserved = 0;
+        table->prdt[i].dbc = size - 1;
+    }
+
+    return count;
+}
+
+static void issue_command(struct port *p, uint32_t slot)
+{
+    const struct slot_io *s = &p->slots[slot];
+    volatile struct command_header *header = &p->cmd_list[slot];
+    volatile struct command_table *table = &p->cmd_tables[slot];
+    uint8_t command = 0;
+
+    if (p->ncq)
+        command = s->write ? ATA_COMMAND_WRITE_FPDMA_QUEUED :
+            ATA_COMMAND_READ_FPDMA_QUEUED;
+    else
+        command = s->write ? ATA_COMMAND_WRITE_DMA_EXT :
+            ATA_COMMAND_READ_DMA_EXT;
+
+    fill_command_fis(table, command, s->io.start,
+                     s->io.sector_count, slot, p->ncq);
+
+    header->prdtl = fill_prdt(table, &s->io);
+    header->prdbc = 0;
+    header->flags = (sizeof(struct fis_reg_h2d) / 4) |
+        (s->write ? COMMAND_HEADER_WRITE : 0);
+
+    /* Tag is active before the command is issued */
+    if (p->ncq)
+        p->regs->sact = 1u << slot;
+    p->regs->ci = 1u << slot;
+}
+
+/* Free the slots and call complete functions of their IOs */
+static void complete_slots(struct port *p, uint32_t slots, bool error)
+{
+    while (slots)
+    {
+        uint32_t slot = __builtin_ctz(slots);
+        struct ide_dma_io io = p->slots[slot].io;
+
+        slots &= slots - 1;
+        p->busy &= ~(1u << slot);
+
+        /* Slot can be reused by the complete function */
+        io.complete_func(&io, error);
+    }
+}
+
+/*
+ * Issue the prepared non-queued command of the slot and poll until it is
+ * done, interrupt status of the port is cleared. Returns false on error.
+ */
+static bool poll_command(struct port *p, uint32_t slot)
+{
+    bool success = false;
+
+    p->regs->ci = 1u << slot;
+    for (uint32_t i = 0; i < AHCI_SPIN_LIMIT; ++i)
+    {
+        if (p->regs->is & PORT_INT_TFES)
+            break;
+
+        if (!(p->regs->ci & (1u << slot)))
+        {
+            success = true;
+            break;
+        }
+    }
+
+    p->regs->is = 0xffffffff;
+    return success;
+}
+
+/*
+ * Read the NCQ command error log of the restarted port, which also clears
+ * the error state of the device. Slot 0 is used, its IO is issued again
+ * from the slot data. Returns the bit of the failed slot, 0 if unknown.
+ */
+static uint32_t read_ncq_error(struct port *p)
+{
+    volatile struct command_header *header = &p->cmd_list[0];
+    volatile struct command_table *table = &p->cmd_tables[0];
+    const uint8_t *log = CAST_PHYSICAL_TO_VIRTUAL(log_buffer);
+
+    fill_command_fis(table, ATA_COMMAND_READ_LOG_EXT, ATA_LOG_NCQ_ERROR,
+                     1, 0, false);
+    table->prdt[0].dba = log_buffer;
+    table->prdt[0].dbau = 0;
+    table->prdt[0].reserved = 0;
+    table->prdt[0].dbc = SECTOR_SIZE - 1;
+
+    header->prdtl = 1;
+    header->prdbc = 0;
+    header->flags = sizeof(struct fis_reg_h2d) / 4;
+
+    if (!poll_command(p, 0) || (log[0] & NCQ_LOG_NQ))
+        return 0;
+
+    return 1u << (log[0] & NCQ_LOG_TAG_MASK);
+}
+
+/*
+ * The port stops processing commands on error, restart it. The NCQ error
+ * log tells the failed command, it fails and the others are issued again.
+ * If the failed command is unknown, all are issued again if it is the
+ * first error of them.
+ */
+static void recover_port(struct port *p)
+{
+    uint32_t done = p->busy & ~(p->regs->sact | p->regs->ci);
+    uint32_t failed = 0;
+    uint32_t retry = p->busy & ~done;
+
+    if (!stop_port(p) || !start_port(p))
+        panic("[AHCI] - restart port %u failed.", p->index);
+
+    if (p->ncq && retry)
+    {
+        failed = read_ncq_error(p) & retry;
+        retry &= ~failed;
+    }
+
+    for (uint32_t slots = retry; slots; slots &= slots - 1)
+    {
+        uint32_t slot = __builtin_ctz(slots);
+
+        if (failed)
+        {
+            /* Commands aborted with the failed one are not at fault */
+            issue_command(p, slot);
+        }
+        else if (p->slots[slot].retry == 0)
+        {
+            p->slots[slot].retry = 1;
+            issue_command(p, slot);
+        }
+        else
+        {
+            failed |= 1u << slot;
+        }
+    }
+
+    complete_slots(p, done, false);
+    complete_slots(p, failed, true);
+}
+
+static void handle_port(struct port *p)
+{
+    uint32_t status = p->regs->is;
+
+    /* Clear interrupt status of the port */
+    p->regs->is = status;
+
+    if (status & PORT_INT_ERRORS)
+    {
+        recover_port(p);
+    }
+    else
+    {
+        /* NCQ commands are done when SACT bits are cleared */
+        complete_slots(p, p->busy & ~(p->regs->sact | p->regs->ci), false);
+    }
+}
+
+static void irq_isr()
+{
+    uint32_t status = hba->is;
+
+    /* The IRQ line may be shared with other devices */
+    for (uint32_t pending = status; pending; pending &= pending - 1)
+    {
+        struct port *p = &ports[__builtin_ctz(pending)];
+        if (p->exist)
+            handle_port(p);
+        else
+            hba->ports[p - ports].is = 0xffffffff;
+    }
+
+    hba->is = status;
+}
+
+static void check_io(const struct ide_dma_io *io)
+{
+    struct port *p = NULL;
+    size_t size = 0;
+
+    if (io->drive >= IOSCHED_MAX_DEVICES || !dev_ports[io->drive])
+        panic("[AHCI] - device not exist, device no: %d.", io->drive);
+
+    p = dev_ports[io->drive];
+    if (io->start >= p->sectors || p->sectors - io->start < io->sector_count)
+        panic("[AHCI] - out of sector's range, total sectors: %u, start: %u, count: %u.",
+              (uint32_t)p->sectors, (uint32_t)io->start, io->sector_count);
+
+    /* NCQ/DMA EXT commands take 16 bits sector count */
+    if (io->sector_count == 0)
+        panic("[AHCI] - invalid sector count: %u.", io->sector_count);
+
+    if (io->segments)
+    {
+        for (uint32_t i = 0; i < io->segment_count; ++i)
+        {
+            const struct ide_dma_segment *seg = &io->segments[i];
+            if (seg->size == 0 || ((seg->addr | seg->size) & 1))
+                panic("[AHCI] - invalid segment, address: 0x%x, size: %u.",
+                      seg->addr, seg->size);
+            size += seg->size;
+        }
+    }
+    else
+    {
+        size = io->size;
+    }
+
+    if (size != io->sector_count * SECTOR_SIZE)
+        panic("[AHCI] - io size(%u) != 512 * sector_count(%u).",
+              size, io->sector_count);
+}
+
+static void dma_io_sectors(const struct ide_dma_io *io, bool write)
+{
+    struct port *p = NULL;
+    uint32_t slot = 0;
+
+    check_io(io);
+    p = dev_ports[io->drive];
+
+    /* IO scheduler dispatches at most depth requests */
+    if (p->busy == (p->depth == AHCI_MAX_SLOTS ? 0xffffffff : (1u << p->depth) - 1))
+        panic("[AHCI] - no free command slot of port %u.", p->index);
+
+    slot = __builtin_ctz(~p->busy);
+    p->busy |= 1u << slot;
+    p->slots[slot].io = *io;
+    p->slots[slot].retry = 0;
+    p->slots[slot].write = write;
+
+    issue_command(p, slot);
+}
+
+static void ahci_dma_read_sectors(const struct ide_dma_io *io)
+{
+    dma_io_sectors(io, false);
+}
+
+static void ahci_dma_write_sectors(const struct ide_dma_io *io)
+{
+    dma_io_sectors(io, true);
+}
+
+/* Send identify command by polling, interrupt of the port is disabled */
+static bool identify_drive(struct port *p, uint16_t *identify)
+{
+    physical_addr_t buffer = pmm_alloc_page_address();
+    volatile struct command_header *header = &p->cmd_list[0];
+    volatile struct command_table *table = &p->cmd_tables[0];
+    bool success = false;
+
+    if (!buffer)
+        panic("[AHCI] - alloc identify buffer failed.");
+
+    fill_command_fis(table, ATA_COMMAND_IDENTIFY, 0, 0, 0, false);
+    table->prdt[0].dba = buffer;
+    table->prdt[0].dbau = 0;
+    table->prdt[0].reserved = 0;
+    table->prdt[0].dbc = 256 * sizeof(uint16_t) - 1;
+
+    header->prdtl = 1;
+    header->prdbc = 0;
+    header->flags = sizeof(struct fis_reg_h2d) / 4;
+
+    success = poll_command(p, 0);
+    if (success)
+    {
+        const uint16_t *data = CAST_PHYSICAL_TO_VIRTUAL(buffer);
+        for (uint32_t i = 0; i < 256; ++i)
+            identify[i] = data[i];
+    }
+
+    pmm_free_page_address(buffer);
+    return success;
+}
+
+static bool setup_port(struct port *p, uint32_t slots, bool hba_ncq)
+{
+    physical_addr_t cmd_list = 0;
+    physical_addr_t cmd_tables = 0;
+    uint16_t identify[256];
+    uint32_t qdepth = 0;
+
+    if (!stop_port(p))
+        return false;
+
+    /* 32 command tables of 1KB */
+    cmd_list = pmm_alloc_page_address();
+    cmd_tables = pmm_alloc_pages_address(3);
+    if (!cmd_list || !cmd_tables)
+        panic("[AHCI] - alloc command list failed.");
+
+    p->cmd_list = CAST_PHYSICAL_TO_VIRTUAL(cmd_list);
+    p->cmd_tables = CAST_PHYSICAL_TO_VIRTUAL(cmd_tables);
+
+    for (uint32_t i = 0; i < AHCI_MAX_SLOTS; ++i)
+    {
+        physical_addr_t table = cmd_tables + i * sizeof(struct command_table);
+        p->cmd_list[i].flags = 0;
+        p->cmd_list[i].prdtl = 0;
+        p->cmd_list[i].prdbc = 0;
+        p->cmd_list[i].ctba = table;
+        p->cmd_list[i].ctbau = 0;
+    }
+
+    p->regs->clb = cmd_list;
+    p->regs->clbu = 0;
+    p->regs->fb = cmd_list + RECEIVED_FIS_OFFSET;
+    p->regs->fbu = 0;
+    p->regs->ie = 0;
+
+    /* LBA48 is required by DMA EXT and NCQ commands */
+    if (!start_port(p) || !identify_drive(p, identify) ||
+        !(identify[83] & 0x0400))
+    {
+        stop_port(p);
+        pmm_free_page_address(cmd_list);
+        pmm_free_pages_address(cmd_tables, 3);
+        return false;
+    }
+
+    p->sectors = *(uint64_t *)(identify + 100);
+
+    /* Word 76 bit 8 is NCQ support, word 75 is queue depth - 1 */
+    qdepth = (identify[75] & 0x1f) + 1;
+    p->ncq = hba_ncq && (identify[76] & 0x0100);
+    p->depth = p->ncq ? KMIN(slots, qdepth) : 1;
+
+    for (uint32_t i = 0; i < sizeof(p->model) - 1; i += 2)
+    {
+        const char *buffer = (char *)(identify + 27 + i / 2);
+        p->model[i] = buffer[1];
+        p->model[i + 1] = buffer[0];
+    }
+    p->model[sizeof(p->model) - 1] = 0;
+
+    /* IO completion is handled in IRQ ISR */
+    p->regs->is = 0xffffffff;
+    p->regs->ie = PORT_INT_DHRS | PORT_INT_PSS |
+        PORT_INT_SDBS | PORT_INT_ERRORS;
+    return true;
+}
+
+void ahci_initialize(physical_addr_t abar, uint8_t irq)
+{
+    static const struct iosched_driver driver =
+    {
+        "AHCI", ahci_dma_read_sectors, ahci_dma_write_sectors, NULL
+    };
+
+    uint32_t count = 0;
+    uint32_t slots = 0;
+    bool hba_ncq = false;
+
+    printk("[%-8s] find AHCI:\n", "AHCI");
+
+    if (hba)
+    {
+        printk("[%-8s] only one controller is supported.\n", "AHCI");
+        return ;
+    }
+
+    hba = pg_map_io(abar, sizeof(struct hba_memory));
+    if (!hba)
+        panic("[AHCI] - map HBA registers failed.");
+
+    log_buffer = pmm_alloc_page_address();
+    if (!log_buffer)
+        panic("[AHCI] - alloc NCQ error log buffer failed.");
+
+    hba->ghc |= HBA_GHC_AE;
+    slots = ((hba->cap >> HBA_CAP_NCS_SHIFT) & HBA_CAP_NCS_MASK) + 1;
+    hba_ncq = hba->cap & HBA_CAP_SNCQ;
+
+    for (uint32_t i = 0; i < AHCI_MAX_PORTS; ++i)
+    {
+        struct port *p = &ports[i];
+        uint32_t ssts = 0;
+        int dev = 0;
+
+        if (!(hba->pi & (1u << i)))
+            continue;
+
+        p->index = i;
+        p->regs = &hba->ports[i];
+        ssts = p->regs->ssts;
+
+        /* Only SATA drives which are present and active */
+        if ((ssts & PORT_SSTS_DET_MASK) != PORT_SSTS_DET_PRESENT ||
+            ((ssts >> PORT_SSTS_IPM_SHIFT) & PORT_SSTS_IPM_MASK) !=
+            PORT_SSTS_IPM_ACTIVE || p->regs->sig != SATA_SIG_ATA)
+            continue;
+
+        if (!setup_port(p, slots, hba_ncq))
+        {
+            printk("  [SATA%u] setup failed\n", i);
+            continue;
+        }
+
+        dev = iosched_add_device(&driver, p->depth, p->sectors, -1);
+        if (dev < 0)
+        {
+            printk("  [SATA%u] no free device number\n", i);
+            p->regs->ie = 0;
+            continue;
+        }
+
+        p->exist = 1;
+        dev_ports[dev] = p;
+        printk("  [SATA%u] dev %d, %u bytes, queue depth %u, model: %s\n",
+               i, dev, (uint32_t)(p->sectors * SECTOR_SIZE),
+               p->depth, p->model);
+        ++count;
+    }
+
+    if (count > 0)
+    {
+        hba->is = 0xffffffff;
+        hba->ghc |= HBA_GHC_IE;
+        pic_register_isr(irq, irq_isr);
+    }
+
+    printk("[%-8s] total drives %u.\n", "AHCI", count);
+}
@@ -0,0 +1,14 @@
+#ifndef AHCI_H
+#define AHCI_H
+
+#include <kernel/base.h>
+
+/*
+ * Init AHCI controller, abar is the physical address of HBA registers,
+ * irq is the IRQ line of the controller. Each SATA drive is added to the
+ * IO scheduler as a block device, NCQ drives get one request per command
+ * slot.
+ */
+void ahci_initialize(physical_addr_t abar, uint8_t irq);
+
+#endif /* AHCI_H */
@@ -1,40 +1,175 @@
 #include <kernel/bio.h>
 #include <kernel/klib.h>
 #include <kernel/ide.h>
+#include <kernel/iosched.h>
 #include <kernel/process.h>
 #include <kernel/scheduler.h>
+#include <kernel/ktask.h>
+#include <kernel/pit.h>
+#include <kernel/wait.h>
 #include <mm/slab.h>
 #include <mm/pmm.h>
 #include <string.h>
+#include <stdlib.h>
 
-#define MAX_CACHE_COUNT 4096
 #define SECTORS_PER_BIO (PAGE_SIZE / SECTOR_SIZE)
 #define BASE_SECTOR(sector) \
     (((sector) / SECTORS_PER_BIO) * SECTORS_PER_BIO)
 
+/*
+ * A bio has 2 ^ order pages, a multi-page bio starts at sector aligned
+ * to its size, and it is keyed on the start sector like others. Any
+ * sector is cached in one bio at most.
+ */
+#define BIO_MAX_ORDER 4
+#define BIO_MAX_PAGES (1 << BIO_MAX_ORDER)
+#define ORDER_BASE_SECTOR(sector, order) \
+    ((sector) & ~(uint64_t)((SECTORS_PER_BIO << (order)) - 1))
+
+/*
+ * Cache limit is 1/4 of free memory at boot, it may grow to 1/2 of it.
+ * Every 1024 gets, the limit grows by 256 bios if 25% of gets missed,
+ * bios were evicted and there are 16MB free memory. It shrinks when pmm
+ * reclaims memory.
+ */
+#define BIO_CACHE_MIN 256
+#define BIO_CACHE_BOOT_SHIFT 2
+#define BIO_CACHE_MAX_SHIFT 1
+#define BIO_CACHE_STEP 256
+#define BIO_TUNE_GETS 1024
+#define BIO_GROW_MISS_RATIO 25
+#define BIO_GROW_FREE_PAGES 4096
+
+/*
+ * Dirty bios are written back by flusher when they are dirty for 5
+ * seconds, or when dirty bios exceed 10% of the cache.
+ */
+#define BIO_DIRTY_EXPIRE (5 * TIMER_HZ)
+#define BIO_DIRTY_RATIO 10
+#define BIO_FLUSH_INTERVAL TIMER_HZ
+#define BIO_FLUSH_BATCH 64
+
+/*
+ * A failed write is retried when the bio expires again, after 3 failures
+ * in a row the bio is left clean, its data is lost on disk.
+ */
+#define BIO_WRITE_RETRIES 3
+
+/*
+ * Read-ahead window of sequential reads in bios, it grows from min to
+ * max, and it is min when memory is low or the cache is full.
+ */
+#define BIO_READAHEAD_MIN 4
+#define BIO_READAHEAD_MAX 32
+#define BIO_READAHEAD_LOW_PAGES 1024
+
+/*
+ * Cached bios are in two LRU lists. New bios enter probation list, bios
+ * referenced again are promoted to protected list, which holds at most
+ * 50% of the cache. Bios are reused from probation list first, so a
+ * large sequential scan does not flush frequently used bios.
+ */
+#define BIO_PROTECTED_RATIO 50
+
+/* Hash table of cached bios, keyed on device and base sector */
+#define BIO_HASH_BITS 12
+#define BIO_HASH_SIZE (1 << BIO_HASH_BITS)
+
 enum bio_flag
 {
     BIO_FLAG_UPDATED    = 1,
-    BIO_FLAG_DIRTY      = 1 << 1,
+    BIO_FLAG_DIRTY      = 1 << 1,   /* Modified, not written back yet */
     BIO_FLAG_REFFED     = 1 << 2,
+    BIO_FLAG_WRITEBACK  = 1 << 3,   /* Write IO is in flight */
+    BIO_FLAG_READING    = 1 << 4,   /* Read IO is in flight */
+    BIO_FLAG_PROTECTED  = 1 << 5,   /* In protected list */
+    BIO_FLAG_ACCESSED   = 1 << 6,   /* Got by bio_get since cached */
+    BIO_FLAG_METADATA   = 1 << 7,   /* File system metadata */
+};
+
+/* Sequential read state of a device */
+struct readahead
+{
+    uint64_t next;          /* Sector after the last read bio */
+    uint64_t end;           /* Sector after the last read-ahead bio */
+    uint32_t window;        /* Bios to read ahead, 0 if not sequential */
 };
 
 struct bio
 {
     void *buffer;           /* Buffer of bio */
-    uint8_t flag;           /* Flags of bio */
+    uint16_t flag;          /* Flags of bio */
     uint8_t iter;           /* Sector iterator */
     uint8_t dev;            /* Device ID */
+    uint8_t order;          /* The bio has 2 ^ order pages */
+    uint8_t write_errors;   /* Failed writes in a row */
     uint64_t sector;        /* Base sector */
+    bio_callback_t callback;    /* Read complete callback */
 
-    struct process *sleep;  /* Sleep process of waiting the bio */
-    struct bio *prev;
+    struct wait_queue wait;     /* Processes waiting for the bio */
+    uint32_t waiters;           /* Woken or sleeping waiters of the bio */
+    struct wait_queue io_wait;  /* Processes waiting for the IO */
+    struct bio *prev;           /* Probation or protected LRU list */
     struct bio *next;
+    struct bio *hash_prev;      /* Hash bucket list */
+    struct bio *hash_next;
+
+    uint32_t dirty_ticks;       /* Ticks when the bio became dirty */
+    struct bio *dirty_prev;     /* Dirty list in dirty order */
+    struct bio *dirty_next;
 };
 
 static struct kmem_cache *bio_cache;
 static struct bio bio_cache_head;
-static int bio_cache_count;
+static uint32_t bio_cache_pages;
+static uint32_t bio_cache_limit;
+static uint32_t bio_cache_max;
+
+/* Cached multi-page bios, other lookup orders are skipped if it is 0 */
+static uint32_t bio_extent_count;
+
+/* Counters at the start of the current tuning window */
+static uint32_t bio_tune_gets;
+static uint32_t bio_tune_misses;
+static uint32_t bio_tune_evictions;
+static struct bio bio_protected_head;
+static uint32_t bio_protected_pages;
+
+/* The last bio got of each device, repeated gets of it are one access */
+static struct bio *bio_last_get[IOSCHED_MAX_DEVICES];
+
+static struct bio *bio_hash[BIO_HASH_SIZE];
+static struct bio_stats bio_stats;
+
+/* Bios which are dirty or under writeback */
+static struct bio bio_dirty_head;
+static uint32_t bio_dirty_pages;
+
+/* Processes waiting for writeback in bio_sync */
+static struct wait_queue bio_sync_wait;
+
+/* Failed writes of each device, bio_sync reports them */
+static uint32_t bio_write_errors[IOSCHED_MAX_DEVICES];
+
+static struct readahead readaheads[IOSCHED_MAX_DEVICES];
+
+/* Processes waiting for an unused bio */
+static struct wait_queue bio_free_wait;
+
+static inline uint32_t bio_pages(const struct bio *bio)
+{
+    return 1u << bio->order;
+}
+
+static inline uint32_t bio_sectors(const struct bio *bio)
+{
+    return SECTORS_PER_BIO << bio->order;
+}
+
+static inline uint64_t bio_end(const struct bio *bio)
+{
+    return bio->sector + bio_sectors(bio);
+}
 
 static inline void split_bio_node(struct bio *bio)
 {
@@ -43,69 +178,246 @@ static inline void split_bio_node(struct bio *bio)
     if (bio->next)
         bio->next->prev = bio->prev;
     bio->prev = bio->next = NULL;
+
+    if (bio->flag & BIO_FLAG_PROTECTED)
+    {
+        bio->flag &= ~BIO_FLAG_PROTECTED;
+        bio_protected_pages -= bio_pages(bio);
+    }
 }
 
-static inline void insert_into_list_head(struct bio *bio)
+static inline void insert_into_list_head(struct bio *head, struct bio *bio)
 {
-    bio->next = bio_cache_head.next;
-    bio->prev = &bio_cache_head;
-    bio_cache_head.next->prev = bio;
-    bio_cache_head.next = bio;
+    bio->next = head->next;
+    bio->prev = head;
+    head->next->prev = bio;
+    head->next = bio;
 }
 
+/* Demote bios from protected list tail, metadata bios are demoted last */
+static void balance_protected_list()
+{
+    uint32_t limit = bio_cache_limit * BIO_PROTECTED_RATIO / 100;
+
+    while (bio_protected_pages > limit)
+    {
+        struct bio *bio = bio_protected_head.prev;
+
+        while (bio != &bio_protected_head && (bio->flag & BIO_FLAG_METADATA))
+            bio = bio->prev;
+
+        if (bio == &bio_protected_head)
+            bio = bio_protected_head.prev;
+
+        split_bio_node(bio);
+        insert_into_list_head(&bio_cache_head, bio);
+    }
+}
+
+static void protect_bio(struct bio *bio)
+{
+    split_bio_node(bio);
+    insert_into_list_head(&bio_protected_head, bio);
+    bio->flag |= BIO_FLAG_PROTECTED;
+    bio_protected_pages += bio_pages(bio);
+    balance_protected_list();
+}
+
+/*
+ * Move the bio got by bio_get to head of its LRU list. It is promoted if
+ * it has been accessed before, repeated gets of the last got bio of the
+ * device, e.g. reading its blocks one by one, are counted as one access.
+ */
+static void touch_bio(struct bio *bio)
+{
+    bool reused = (bio->flag & BIO_FLAG_ACCESSED) &&
+        bio_last_get[bio->dev] != bio;
+
+    bio->flag |= BIO_FLAG_ACCESSED;
+    bio_last_get[bio->dev] = bio;
+
+    if (bio->flag & (BIO_FLAG_PROTECTED | BIO_FLAG_METADATA) || reused)
+    {
+        if (!(bio->flag & BIO_FLAG_PROTECTED))
+            bio_stats.promotions += 1;
+        protect_bio(bio);
+    }
+    else
+    {
+        split_bio_node(bio);
+        insert_into_list_head(&bio_cache_head, bio);
+    }
+}
+
+static void bio_flush_task(void *data);
+static uint32_t bio_reclaim(uint32_t pages);
+
 void bio_initialize()
 {
+    static struct kernel_task flush_task = { bio_flush_task, NULL, NULL, NULL };
+
     bio_cache_head.next = &bio_cache_head;
     bio_cache_head.prev = &bio_cache_head;
+    bio_protected_head.next = &bio_protected_head;
+    bio_protected_head.prev = &bio_protected_head;
+    bio_dirty_head.dirty_next = &bio_dirty_head;
+    bio_dirty_head.dirty_prev = &bio_dirty_head;
+    wait_queue_init(&bio_free_wait);
+    wait_queue_init(&bio_sync_wait);
 
     bio_cache = slab_create_kmem_cache(
         sizeof(struct bio), sizeof(void *));
     if (!bio_cache)
         panic("bio slab initialize failed");
+
+    /* Size the cache by free memory, and give it back under pressure */
+    bio_cache_max = KMAX(pmm_num_free_pages() >> BIO_CACHE_MAX_SHIFT,
+                         BIO_CACHE_MIN);
+    bio_cache_limit = KMAX(pmm_num_free_pages() >> BIO_CACHE_BOOT_SHIFT,
+                           BIO_CACHE_MIN);
+    pmm_register_reclaim(bio_reclaim);
+
+    /* Flusher writes dirty bios back in kernel task process */
+    ktask_register(&flush_task);
 }
 
-static struct bio * find_bio(uint8_t dev, uint64_t sector)
+static inline void insert_into_dirty_list(struct bio *bio)
+{
+    bio->dirty_prev = bio_dirty_head.dirty_prev;
+    bio->dirty_next = &bio_dirty_head;
+    bio_dirty_head.dirty_prev->dirty_next = bio;
+    bio_dirty_head.dirty_prev = bio;
+    bio_dirty_pages += bio_pages(bio);
+}
+
+static inline void remove_from_dirty_list(struct bio *bio)
 {
-    struct bio *cache = bio_cache_head.next;
+    bio->dirty_prev->dirty_next = bio->dirty_next;
+    bio->dirty_next->dirty_prev = bio->dirty_prev;
+    bio->dirty_prev = bio->dirty_next = NULL;
+    bio_dirty_pages -= bio_pages(bio);
+}
 
-    while (cache != &bio_cache_head)
+static inline bool dirty_over_limit()
+{
+    return bio_dirty_pages * 100 >= bio_cache_limit * BIO_DIRTY_RATIO;
+}
+
+static inline uint32_t hash_index(uint8_t dev, uint64_t sector)
+{
+    uint32_t key = (uint32_t)(sector / SECTORS_PER_BIO) + ((uint32_t)dev << 24);
+    return (key * 2654435761u) >> (32 - BIO_HASH_BITS);
+}
+
+static void insert_into_hash(struct bio *bio)
+{
+    struct bio **head = &bio_hash[hash_index(bio->dev, bio->sector)];
+
+    bio->hash_prev = NULL;
+    bio->hash_next = *head;
+    if (*head)
+        (*head)->hash_prev = bio;
+    *head = bio;
+}
+
+static void remove_from_hash(struct bio *bio)
+{
+    if (bio->hash_prev)
+        bio->hash_prev->hash_next = bio->hash_next;
+    else
+        bio_hash[hash_index(bio->dev, bio->sector)] = bio->hash_next;
+
+    if (bio->hash_next)
+        bio->hash_next->hash_prev = bio->hash_prev;
+    bio->hash_prev = bio->hash_next = NULL;
+}
+
+/* Find the bio starts at the sector */
+static struct bio * lookup_bio(uint8_t dev, uint64_t sector)
+{
+    struct bio *cache = bio_hash[hash_index(dev, sector)];
+
+    while (cache)
     {
         if (cache->dev == dev && cache->sector == sector)
             break;
 
-        cache = cache->next;
+        cache = cache->hash_next;
     }
 
-    return cache == &bio_cache_head ? NULL : cache;
+    return cache;
 }
 
-static struct bio * find_unused_bio()
+/* Find the bio which caches the sector */
+static struct bio * find_bio(uint8_t dev, uint64_t sector)
 {
-    struct bio *cache = bio_cache_head.prev;
+    struct bio *bio = lookup_bio(dev, BASE_SECTOR(sector));
 
-    while (cache != &bio_cache_head)
+    /* A multi-page bio is found at the start sector of its order */
+    for (uint32_t order = 1;
+         !bio && bio_extent_count > 0 && order <= BIO_MAX_ORDER; ++order)
     {
-        if (!(cache->flag & (BIO_FLAG_REFFED | BIO_FLAG_DIRTY)))
+        bio = lookup_bio(dev, ORDER_BASE_SECTOR(sector, order));
+        if (bio && bio->order != order)
+            bio = NULL;
+    }
+
+    return bio;
+}
+
+/*
+ * A waiter woken from the bio wait queue has left it but not referenced
+ * the bio yet, it is counted in waiters until it does.
+ */
+static inline bool bio_unused(struct bio *bio)
+{
+    return !(bio->flag & (BIO_FLAG_REFFED | BIO_FLAG_DIRTY |
+                          BIO_FLAG_WRITEBACK | BIO_FLAG_READING)) &&
+        bio->waiters == 0 && wait_queue_empty(&bio->wait);
+}
+
+static struct bio * find_unused_bio_in_list(struct bio *head)
+{
+    struct bio *cache = head->prev;
+
+    while (cache != head)
+    {
+        if (bio_unused(cache))
             break;
 
         cache = cache->prev;
     }
 
-    return cache == &bio_cache_head ? NULL : cache;
+    return cache == head ? NULL : cache;
+}
+
+static struct bio * find_unused_bio()
+{
+    struct bio *cache = find_unused_bio_in_list(&bio_cache_head);
+
+    if (!cache)
+        cache = find_unused_bio_in_list(&bio_protected_head);
+
+    return cache;
 }
 
-static struct bio * slab_alloc_bio()
+static struct bio * slab_alloc_bio(uint32_t order)
 {
     struct bio *bio = slab_alloc(bio_cache);
 
     if (bio)
     {
         memset(bio, 0, sizeof(*bio));
-        bio->buffer = cast_p2v_or_null(pmm_alloc_page_address());
+        wait_queue_init(&bio->wait);
+        wait_queue_init(&bio->io_wait);
+        bio->order = order;
+        bio->buffer = cast_p2v_or_null(pmm_alloc_pages_address(order));
 
         if (bio->buffer)
         {
-            ++bio_cache_count;
+            bio_cache_pages += bio_pages(bio);
+            if (order > 0)
+                ++bio_extent_count;
         }
         else
         {
@@ -117,113 +429,310 @@ static struct bio * slab_alloc_bio()
     return bio;
 }
 
-static void sleep_wait_bio(struct bio *bio)
+/* Free an unused bio and its buffer, returns the previous bio in list */
+static struct bio * free_bio(struct bio *bio)
 {
-    struct process *proc = sched_get_running_proc();
+    struct bio *prev = bio->prev;
 
-    /* Insert into the sleep process list */
-    if (bio->sleep)
-    {
-        struct process *sleep = bio->sleep;
-        while (sleep->sleep)
-            sleep = sleep->sleep;
-        sleep->sleep = proc;
-    }
-    else
+    if (bio_last_get[bio->dev] == bio)
+        bio_last_get[bio->dev] = NULL;
+
+    remove_from_hash(bio);
+    split_bio_node(bio);
+    pmm_free_pages_address(CAST_VIRTUAL_TO_PHYSICAL(bio->buffer),
+                           bio->order);
+    bio_cache_pages -= bio_pages(bio);
+    if (bio->order > 0)
+        --bio_extent_count;
+
+    slab_free(bio_cache, bio);
+    return prev;
+}
+
+static uint32_t reclaim_list(struct bio *head, uint32_t pages)
+{
+    struct bio *bio = head->prev;
+    uint32_t freed = 0;
+
+    while (bio != head && freed < pages)
     {
-        /* The first sleep process */
-        bio->sleep = proc;
+        if (bio_unused(bio))
+        {
+            freed += bio_pages(bio);
+            bio = free_bio(bio);
+        }
+        else
+        {
+            bio = bio->prev;
+        }
     }
 
-    proc->state = PROC_STATE_IO;
-    sched();
+    return freed;
 }
 
-static void sleep_wait_bio_complete(struct bio *bio)
+/* Reclaim function of pmm, it frees pages of least recently used bios */
+static uint32_t bio_reclaim(uint32_t pages)
 {
-    struct process *proc = sched_get_running_proc();
+    uint32_t freed = reclaim_list(&bio_cache_head, pages);
+
+    if (freed < pages)
+        freed += reclaim_list(&bio_protected_head, pages - freed);
 
-    proc->sleep = bio->sleep;
-    bio->sleep = proc;
+    /* Do not grow back until the tuning finds free memory again */
+    bio_cache_limit = KMAX(KMIN(bio_cache_limit, bio_cache_pages),
+                           BIO_CACHE_MIN);
+    bio_stats.reclaimed += freed;
+    return freed;
+}
+
+/*
+ * Called every BIO_TUNE_GETS gets, grow the cache limit when the cache
+ * is too small for the working set and there is plenty of free memory.
+ */
+static void tune_cache_limit()
+{
+    uint32_t misses = bio_stats.misses - bio_tune_misses;
+    uint32_t evictions = bio_stats.evictions - bio_tune_evictions;
+
+    bio_stats.eviction_rate = evictions * 100 / BIO_TUNE_GETS;
+
+    if (misses * 100 >= BIO_TUNE_GETS * BIO_GROW_MISS_RATIO &&
+        evictions > 0 && bio_cache_limit < bio_cache_max &&
+        pmm_num_free_pages() >= BIO_GROW_FREE_PAGES)
+    {
+        bio_cache_limit = KMIN(bio_cache_limit + BIO_CACHE_STEP,
+                               bio_cache_max);
+    }
 
-    proc->state = PROC_STATE_IO;
-    sched();
+    bio_tune_gets = 0;
+    bio_tune_misses = bio_stats.misses;
+    bio_tune_evictions = bio_stats.evictions;
 }
 
 static void wake_up_sleep_process(struct bio *bio)
 {
-    if (bio->sleep)
+    if (!wait_queue_empty(&bio->wait))
     {
         /* Wake up a sleep process waiting on the bio */
-        struct process *proc = bio->sleep;
-        bio->sleep = proc->sleep;
-        proc->sleep = NULL;
-        proc->state = PROC_STATE_RUNNING;
+        wait_queue_wake_one(&bio->wait);
     }
-    else if (bio_cache_head.sleep)
+    else
     {
-        /* Wake up a sleep process waiting on the bio list */
-        struct process *proc = bio_cache_head.sleep;
-        bio_cache_head.sleep = proc->sleep;
-        proc->sleep = NULL;
-        proc->state = PROC_STATE_RUNNING;
+        /* Wake up a sleep process waiting for an unused bio */
+        wait_queue_wake_one(&bio_free_wait);
     }
 }
 
-static struct bio * alloc_bio()
+/* Alloc a bio without sleeping, returns NULL if there is no one */
+static struct bio * try_alloc_bio()
 {
     struct bio *cache = NULL;
 
-    while (!cache)
+    /* Alloc from slab */
+    if (bio_cache_pages < bio_cache_limit)
+        cache = slab_alloc_bio(0);
+
+    /* Reuse bio in the cache list */
+    if (!cache)
+    {
+        cache = find_unused_bio();
+        if (cache)
+            bio_stats.evictions += bio_pages(cache);
+
+        /* Multi-page bio is freed, its first page is reused */
+        if (cache && cache->order > 0)
+        {
+            free_bio(cache);
+            cache = slab_alloc_bio(0);
+        }
+    }
+
+    return cache;
+}
+
+/*
+ * Alloc a bio of 2 ^ order pages without sleeping, unused bios are
+ * freed to make room for it. Returns NULL if memory is low.
+ */
+static struct bio * try_alloc_extent(uint32_t order)
+{
+    uint32_t pages = 1u << order;
+
+    if (pmm_num_free_pages() < BIO_READAHEAD_LOW_PAGES)
+        return NULL;
+
+    if (bio_cache_pages + pages > bio_cache_limit)
     {
-        /* Alloc from slab */
-        if (bio_cache_count < MAX_CACHE_COUNT)
-            cache = slab_alloc_bio();
+        uint32_t need = bio_cache_pages + pages - bio_cache_limit;
+        uint32_t freed = reclaim_list(&bio_cache_head, need);
+
+        bio_stats.evictions += freed;
+        if (freed < need)
+            return NULL;
+    }
+
+    return slab_alloc_bio(order);
+}
 
-        /* Reuse bio in the cache list */
-        if (!cache)
-            cache = find_unused_bio();
+static struct bio * alloc_bio()
+{
+    struct bio *cache = NULL;
 
-        /* Sleep waiting a bio */
-        if (!cache)
-            sleep_wait_bio(&bio_cache_head);
+    while (!(cache = try_alloc_bio()))
+    {
+        /* Sleep waiting a bio, dirty bios are written back to free */
+        ktask_wake_up();
+        wait_queue_sleep_exclusive(&bio_free_wait);
     }
 
     return cache;
 }
 
-struct bio * bio_get(uint8_t dev, uint64_t sector)
+/* Give back a bio from alloc_bio which is not assigned */
+static void put_back_bio(struct bio *bio)
 {
-    uint64_t base_sector = BASE_SECTOR(sector);
-    struct bio *bio = find_bio(dev, base_sector);
+    /* A reused bio is left unused in its list, a new one is freed */
+    if (!bio->prev)
+    {
+        pmm_free_pages_address(CAST_VIRTUAL_TO_PHYSICAL(bio->buffer),
+                               bio->order);
+        bio_cache_pages -= bio_pages(bio);
+        slab_free(bio_cache, bio);
+    }
+
+    /* Pass the wakeup on to the next process waiting a bio */
+    wait_queue_wake_one(&bio_free_wait);
+}
 
-    if (!bio)
+/* Set the key of an allocated bio, and put it at head of probation list */
+static void assign_bio(struct bio *bio, uint8_t dev, uint64_t base_sector)
+{
+    /* Reused bio is rehashed with its new key */
+    if (bio->prev)
     {
-        bio = alloc_bio();
-        bio->flag = 0;
-        bio->dev = dev;
-        bio->sector = base_sector;
+        remove_from_hash(bio);
+        split_bio_node(bio);
     }
 
-    while (bio->flag & (BIO_FLAG_REFFED | BIO_FLAG_DIRTY))
-        sleep_wait_bio(bio);
+    bio->flag = 0;
+    bio->write_errors = 0;
+    bio->dev = dev;
+    bio->sector = base_sector;
+    bio->callback = NULL;
+    insert_into_hash(bio);
+    insert_into_list_head(&bio_cache_head, bio);
+}
 
-    split_bio_node(bio);
-    insert_into_list_head(bio);
+/* Reference the bio for a get of the sector */
+static struct bio * ref_bio(struct bio *bio, uint64_t sector)
+{
+    if (++bio_tune_gets == BIO_TUNE_GETS)
+        tune_cache_limit();
+
+    /* Dirty bio is still usable, its data is up to date */
+    while (bio->flag & BIO_FLAG_REFFED)
+    {
+        /* The bio is pinned until the waiter runs again */
+        ++bio->waiters;
+        wait_queue_sleep_exclusive(&bio->wait);
+        --bio->waiters;
+    }
+
+    touch_bio(bio);
 
     bio->iter = sector - bio->sector;
     bio->flag |= BIO_FLAG_REFFED;
     return bio;
 }
 
+struct bio * bio_get(uint8_t dev, uint64_t sector)
+{
+    struct bio *bio = find_bio(dev, sector);
+    struct bio *cached = NULL;
+
+    if (bio)
+    {
+        bio_stats.hits += 1;
+        return ref_bio(bio, sector);
+    }
+
+    bio_stats.misses += 1;
+    bio = alloc_bio();
+
+    /* Another process may cache the sector while alloc_bio sleeps */
+    cached = find_bio(dev, sector);
+    if (cached)
+    {
+        put_back_bio(bio);
+        bio = cached;
+    }
+    else
+    {
+        assign_bio(bio, dev, BASE_SECTOR(sector));
+    }
+
+    return ref_bio(bio, sector);
+}
+
+/* Check whether no sector of [start, end) is cached */
+static bool range_uncached(uint8_t dev, uint64_t start, uint64_t end)
+{
+    for (uint64_t sector = start; sector < end; sector += SECTORS_PER_BIO)
+    {
+        if (find_bio(dev, sector))
+            return false;
+    }
+
+    return true;
+}
+
+struct bio * bio_get_extent(uint8_t dev, uint64_t sector, uint32_t pages)
+{
+    uint64_t capacity = iosched_get_capacity(dev);
+    uint32_t order = 0;
+
+    /* A cached sector is got from its bio */
+    if (find_bio(dev, sector))
+        return bio_get(dev, sector);
+
+    while (order < BIO_MAX_ORDER && (2u << order) <= pages)
+        ++order;
+
+    /* Try smaller extents if the range is partly cached */
+    for (; order > 0; --order)
+    {
+        uint64_t start = ORDER_BASE_SECTOR(sector, order);
+        uint64_t end = start + (SECTORS_PER_BIO << order);
+        struct bio *bio = NULL;
+
+        if (end > capacity || !range_uncached(dev, start, end))
+            continue;
+
+        bio = try_alloc_extent(order);
+        if (!bio)
+            break;
+
+        bio_stats.misses += 1;
+        assign_bio(bio, dev, start);
+        return ref_bio(bio, sector);
+    }
+
+    return bio_get(dev, sector);
+}
+
+uint64_t bio_first_sector(struct bio *bio)
+{
+    return bio->sector;
+}
+
 uint64_t bio_last_sector(struct bio *bio)
 {
-    return bio->sector + SECTORS_PER_BIO - 1;
+    return bio_end(bio) - 1;
 }
 
 char * bio_data(struct bio *bio)
 {
-    if (bio->iter < SECTORS_PER_BIO)
+    if (bio->iter < bio_sectors(bio))
     {
         char *buffer = bio->buffer;
         buffer += bio->iter * SECTOR_SIZE;
@@ -237,88 +746,451 @@ char * bio_data(struct bio *bio)
 
 void bio_advance_iter(struct bio *bio)
 {
-    if (bio->iter < SECTORS_PER_BIO)
+    if (bio->iter < bio_sectors(bio))
         bio->iter++;
 }
 
 static void ide_read_complete(struct ide_dma_io *io, bool error)
 {
     struct bio *bio = io->data;
-    struct process *proc = bio->sleep;
-
-    /* Close interrupt as lock */
-    close_int();
+    bio_callback_t callback = bio->callback;
 
+    bio->flag &= ~BIO_FLAG_READING;
     if (!error)
         bio->flag |= BIO_FLAG_UPDATED;
 
-    /* Wake up the reader process */
-    bio->sleep = proc->sleep;
-    proc->sleep = NULL;
-    proc->state = PROC_STATE_RUNNING;
+    bio->callback = NULL;
+    if (callback)
+        callback(bio, !error);
 
-    start_int();
+    /* Wake up the reader processes */
+    wait_queue_wake_all(&bio->io_wait);
+
+    /* Read-ahead bio is not referenced, it can be reused now */
+    if (!(bio->flag & BIO_FLAG_REFFED))
+        wake_up_sleep_process(bio);
 }
 
-bool bio_read(struct bio *bio)
+static void submit_read(struct bio *bio)
+{
+    struct ide_dma_io io;
+
+    io.drive = bio->dev;
+    io.sector_count = bio_sectors(bio);
+    io.start = bio->sector;
+    io.buffer = CAST_VIRTUAL_TO_PHYSICAL(bio->buffer);
+    io.size = bio_pages(bio) * PAGE_SIZE;
+    io.segments = NULL;
+    io.segment_count = 0;
+    io.data = bio;
+    io.complete_func = ide_read_complete;
+
+    bio->flag |= BIO_FLAG_READING;
+    iosched_read(&io);
+}
+
+static inline uint32_t readahead_max_window()
+{
+    /* Do not evict cached bios or use the last free memory for it */
+    if (bio_cache_pages >= bio_cache_limit ||
+        pmm_num_free_pages() < BIO_READAHEAD_LOW_PAGES)
+        return BIO_READAHEAD_MIN;
+    return BIO_READAHEAD_MAX;
+}
+
+/* Submit async reads of bios in [start, end) which are not cached */
+static uint64_t submit_readahead(uint8_t dev, uint64_t start, uint64_t end)
+{
+    uint64_t sector = start;
+
+    while (sector < end)
+    {
+        struct bio *bio = find_bio(dev, sector);
+
+        if (!bio)
+        {
+            /* Read-ahead never sleeps waiting a bio */
+            bio = try_alloc_bio();
+            if (!bio)
+                break;
+
+            assign_bio(bio, dev, sector);
+            bio_stats.readaheads += 1;
+        }
+
+        if (!(bio->flag & (BIO_FLAG_UPDATED | BIO_FLAG_READING)))
+            submit_read(bio);
+
+        sector = bio_end(bio);
+    }
+
+    return sector;
+}
+
+/*
+ * Detect sequential reads of the device, then read the next window of
+ * bios ahead when the reader goes past the middle of the last window,
+ * the window doubles each time.
+ */
+static void readahead(struct bio *bio)
 {
-    if (!(bio->flag & BIO_FLAG_UPDATED))
+    struct readahead *ra = &readaheads[bio->dev];
+    uint64_t next = bio_end(bio);
+    uint64_t capacity = iosched_get_capacity(bio->dev);
+    uint64_t end = 0;
+
+    /* More reads of the same bio */
+    if (next == ra->next && ra->window > 0)
+        return ;
+
+    if (bio->sector == ra->next)
+    {
+        if (ra->window == 0)
+            ra->window = BIO_READAHEAD_MIN;
+    }
+    else
     {
-        struct ide_dma_io io;
+        ra->window = 0;
+        ra->end = 0;
+    }
+
+    ra->next = next;
+    if (ra->window == 0 ||
+        ra->end > next + ra->window / 2 * SECTORS_PER_BIO)
+        return ;
+
+    ra->window = KMIN(ra->window, readahead_max_window());
+    end = KMIN(next + ra->window * SECTORS_PER_BIO, BASE_SECTOR(capacity));
+    ra->end = submit_readahead(bio->dev, KMAX(ra->end, next), end);
+    ra->window = KMIN(ra->window * 2, BIO_READAHEAD_MAX);
+}
 
-        io.drive = bio->dev;
-        io.sector_count = SECTORS_PER_BIO;
-        io.start = bio->sector;
-        io.buffer = CAST_VIRTUAL_TO_PHYSICAL(bio->buffer);
-        io.size = PAGE_SIZE;
-        io.data = bio;
-        io.complete_func = ide_read_complete;
+void bio_submit_read(struct bio *bio, bio_callback_t callback)
+{
+    /* Data is cached already */
+    if (bio->flag & BIO_FLAG_UPDATED)
+    {
+        iosched_plug(bio->dev);
+        readahead(bio);
+        iosched_unplug(bio->dev);
 
-        ide_dma_read_sectors(&io);
-        sleep_wait_bio_complete(bio);
+        if (callback)
+            callback(bio, true);
+        return ;
     }
 
+    bio->callback = callback;
+    iosched_plug(bio->dev);
+
+    /* The read and read-ahead are merged into one request */
+    if (!(bio->flag & BIO_FLAG_READING))
+        submit_read(bio);
+    readahead(bio);
+
+    iosched_unplug(bio->dev);
+}
+
+bool bio_wait(struct bio *bio)
+{
+    while (bio->flag & BIO_FLAG_READING)
+        wait_queue_sleep(&bio->io_wait);
+
     return (bio->flag & BIO_FLAG_UPDATED) != 0;
 }
 
+bool bio_read(struct bio *bio)
+{
+    bio_submit_read(bio, NULL);
+    return bio_wait(bio);
+}
+
+bool bio_read_batch(struct bio **bios, uint32_t count)
+{
+    bool success = true;
+
+    /* Plug devices, so adjacent bios are merged into one request */
+    for (uint32_t i = 0; i < count; ++i)
+        iosched_plug(bios[i]->dev);
+
+    for (uint32_t i = 0; i < count; ++i)
+        bio_submit_read(bios[i], NULL);
+
+    for (uint32_t i = 0; i < count; ++i)
+        iosched_unplug(bios[i]->dev);
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        if (!bio_wait(bios[i]))
+            success = false;
+    }
+
+    return success;
+}
+
 static void ide_write_complete(struct ide_dma_io *io, bool error)
 {
     struct bio *bio = io->data;
 
-    /* Close interrupt as lock */
-    close_int();
+    bio->flag &= ~BIO_FLAG_WRITEBACK;
 
-    if (!error)
-        bio->flag |= BIO_FLAG_UPDATED;
-    bio->flag &= ~BIO_FLAG_DIRTY;
+    if (error)
+    {
+        bio_stats.write_errors += 1;
+        bio_write_errors[bio->dev] += 1;
+        printk("[%-8s] write error, dev %u, sector %u\n", "BIO",
+               bio->dev, (uint32_t)bio->sector);
+
+        if (++bio->write_errors >= BIO_WRITE_RETRIES &&
+            !(bio->flag & BIO_FLAG_DIRTY))
+        {
+            /* Give up a sector which keeps failing */
+            printk("[%-8s] give up writing dev %u, sector %u\n", "BIO",
+                   bio->dev, (uint32_t)bio->sector);
+            bio->write_errors = 0;
+            remove_from_dirty_list(bio);
+        }
+        else if (!(bio->flag & BIO_FLAG_DIRTY))
+        {
+            /* The bio stays dirty, it is written again when it expires */
+            bio->flag |= BIO_FLAG_DIRTY;
+            bio->dirty_ticks = sched_ticks();
+            remove_from_dirty_list(bio);
+            insert_into_dirty_list(bio);
+            ktask_wake_up_later(BIO_DIRTY_EXPIRE);
+        }
+    }
+    else
+    {
+        bio->write_errors = 0;
+
+        /* Keep it in dirty list if it is modified during writeback */
+        if (!(bio->flag & BIO_FLAG_DIRTY))
+            remove_from_dirty_list(bio);
+    }
+
+    wait_queue_wake_all(&bio_sync_wait);
 
     if (!(bio->flag & BIO_FLAG_REFFED))
         wake_up_sleep_process(bio);
-
-    start_int();
 }
 
-void bio_write(struct bio *bio)
+static void submit_write(struct bio *bio)
 {
     struct ide_dma_io io;
 
     io.drive = bio->dev;
-    io.sector_count = SECTORS_PER_BIO;
+    io.sector_count = bio_sectors(bio);
     io.start = bio->sector;
     io.buffer = CAST_VIRTUAL_TO_PHYSICAL(bio->buffer);
-    io.size = PAGE_SIZE;
+    io.size = bio_pages(bio) * PAGE_SIZE;
+    io.segments = NULL;
+    io.segment_count = 0;
+    io.data = bio;
     io.complete_func = ide_write_complete;
 
-    bio->flag |= BIO_FLAG_DIRTY;
-    bio->flag &= ~BIO_FLAG_UPDATED;
+    bio->flag &= ~BIO_FLAG_DIRTY;
+    bio->flag |= BIO_FLAG_WRITEBACK;
+    bio_stats.writebacks += 1;
+
+    iosched_write(&io);
+}
+
+static int bio_sector_compare(const void *a, const void *b)
+{
+    const struct bio *bio1 = *(struct bio * const *)a;
+    const struct bio *bio2 = *(struct bio * const *)b;
+
+    if (bio1->dev != bio2->dev)
+        return bio1->dev < bio2->dev ? -1 : 1;
+    if (bio1->sector != bio2->sector)
+        return bio1->sector < bio2->sector ? -1 : 1;
+    return 0;
+}
+
+/* Write back bios in device and sector order, adjacent bios are merged */
+static void submit_write_batch(struct bio **bios, uint32_t count)
+{
+    uint32_t i = 0;
+
+    qsort(bios, count, sizeof(*bios), bio_sector_compare);
+
+    while (i < count)
+    {
+        uint8_t dev = bios[i]->dev;
+
+        iosched_plug(dev);
+        for (; i < count && bios[i]->dev == dev; ++i)
+            submit_write(bios[i]);
+        iosched_unplug(dev);
+    }
+}
+
+static inline bool can_write_back(const struct bio *bio)
+{
+    /*
+     * A bio which is referenced may be modified, and a bio under
+     * writeback must not have two writes pending.
+     */
+    return (bio->flag & BIO_FLAG_DIRTY) &&
+        !(bio->flag & (BIO_FLAG_REFFED | BIO_FLAG_WRITEBACK));
+}
+
+/*
+ * Write back dirty bios of the device(all devices if all_dev is true),
+ * only bios dirty for BIO_DIRTY_EXPIRE ticks unless force is true.
+ * Returns the number of bios submitted.
+ */
+static uint32_t write_back(uint8_t dev, bool all_dev, bool force)
+{
+    struct bio *batch[BIO_FLUSH_BATCH];
+    struct bio *bio = bio_dirty_head.dirty_next;
+    uint32_t now = sched_ticks();
+    uint32_t count = 0;
+    uint32_t total = 0;
+
+    while (bio != &bio_dirty_head)
+    {
+        /* Dirty list is in dirty order, the rest are younger */
+        if (!force && now - bio->dirty_ticks < BIO_DIRTY_EXPIRE)
+            break;
+
+        if (can_write_back(bio) && (all_dev || bio->dev == dev))
+        {
+            batch[count++] = bio;
+            if (count == BIO_FLUSH_BATCH)
+            {
+                submit_write_batch(batch, count);
+                total += count;
+                count = 0;
+            }
+        }
+
+        bio = bio->dirty_next;
+    }
+
+    submit_write_batch(batch, count);
+    return total + count;
+}
+
+static void bio_flush_task(void *data)
+{
+    (void)data;
+
+    /* Kernel task runs with interrupt enabled */
+    close_int();
+
+    /* Write back all dirty bios when too many or processes need bios */
+    if (dirty_over_limit() || !wait_queue_empty(&bio_free_wait))
+        write_back(0, true, true);
+    else
+        write_back(0, true, false);
 
-    ide_dma_write_sectors(&io);
+    if (bio_dirty_pages > 0)
+        ktask_wake_up_later(BIO_FLUSH_INTERVAL);
+
+    start_int();
+}
+
+void bio_write(struct bio *bio)
+{
+    /* Age of a dirty bio counts from its first modification */
+    if (!(bio->flag & BIO_FLAG_DIRTY))
+    {
+        bio->dirty_ticks = sched_ticks();
+
+        /* Move to tail of dirty list, so the list is in dirty order */
+        if (bio->dirty_next)
+            remove_from_dirty_list(bio);
+        insert_into_dirty_list(bio);
+    }
+
+    /* Buffer is up to date, and it is written back later */
+    bio->flag |= BIO_FLAG_UPDATED | BIO_FLAG_DIRTY;
+
+    if (dirty_over_limit())
+        ktask_wake_up();
+    else
+        ktask_wake_up_later(BIO_DIRTY_EXPIRE);
+}
+
+bool bio_sync(uint8_t dev)
+{
+    /* Referenced dirty bios are written too, as a range sync does */
+    return bio_sync_range(dev, 0, iosched_get_capacity(dev));
+}
+
+bool bio_sync_range(uint8_t dev, uint64_t start, uint64_t end)
+{
+    uint32_t errors = bio_write_errors[dev];
+
+    for (;;)
+    {
+        struct bio *bio = bio_dirty_head.dirty_next;
+        bool failed = bio_write_errors[dev] != errors;
+        bool pending = false;
+
+        iosched_plug(dev);
+        for (; bio != &bio_dirty_head; bio = bio->dirty_next)
+        {
+            if (bio->dev != dev || bio->sector >= end || bio_end(bio) <= start)
+                continue;
+
+            /*
+             * Referenced bio may be modified, it is written as it is now.
+             * After a write fails, only writes in flight are waited for.
+             */
+            if (!(bio->flag & BIO_FLAG_WRITEBACK))
+            {
+                if (failed)
+                    continue;
+                submit_write(bio);
+            }
+            pending = true;
+        }
+        iosched_unplug(dev);
+
+        if (!pending)
+            break;
+
+        wait_queue_sleep(&bio_sync_wait);
+    }
+
+    return bio_write_errors[dev] == errors;
+}
+
+void bio_mark_metadata(struct bio *bio)
+{
+    if (!(bio->flag & BIO_FLAG_METADATA))
+    {
+        bio->flag |= BIO_FLAG_METADATA;
+        protect_bio(bio);
+    }
 }
 
 void bio_release(struct bio *bio)
 {
     bio->flag &= ~BIO_FLAG_REFFED;
+    wake_up_sleep_process(bio);
+}
 
-    if (!(bio->flag & BIO_FLAG_DIRTY))
-        wake_up_sleep_process(bio);
+void bio_get_stats(struct bio_stats *stats)
+{
+    *stats = bio_stats;
+    stats->cached = bio_cache_pages;
+    stats->dirty = bio_dirty_pages;
+    stats->protected = bio_protected_pages;
+    stats->limit = bio_cache_limit;
+}
+
+void bio_print_statistics()
+{
+    printk("[%-8s] cached %u, limit %u, max %u, protected %u, hits %u, "
+           "misses %u, promotions %u, readaheads %u, evictions %u, "
+           "eviction rate %u%%, reclaimed %u, dirty %u, writebacks %u, "
+           "write errors %u\n", "BIO", bio_cache_pages, bio_cache_limit,
+           bio_cache_max, bio_protected_pages, bio_stats.hits,
+           bio_stats.misses, bio_stats.promotions, bio_stats.readaheads,
+           bio_stats.evictions, bio_stats.eviction_rate,
+           bio_stats.reclaimed, bio_dirty_pages, bio_stats.writebacks,
+           bio_stats.write_errors);
 }
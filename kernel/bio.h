@@ -6,12 +6,49 @@
 
 struct bio;
 
+/*
+ * Prototype of bio read complete callback:
+ *     void read_complete(struct bio *bio, bool success);
+ * It is called in IRQ ISR with interrupt closed, or in bio_submit_read
+ * if the bio is cached already.
+ */
+typedef void (*bio_callback_t)(struct bio *, bool);
+
+/* Statistics of block IO cache */
+struct bio_stats
+{
+    uint32_t hits;          /* bio_get found the bio in cache */
+    uint32_t misses;        /* bio_get allocated or reused a bio */
+    uint32_t readaheads;    /* Bios allocated by read-ahead */
+    uint32_t promotions;    /* Bios promoted to protected list */
+    uint32_t protected;     /* Pages in protected list */
+    uint32_t cached;        /* Pages in cache */
+    uint32_t limit;         /* Current limit of cached pages */
+    uint32_t evictions;     /* Cached pages reused for other sectors */
+    uint32_t eviction_rate; /* Evictions per 100 gets, last 1024 gets */
+    uint32_t reclaimed;     /* Pages freed to pmm under memory pressure */
+    uint32_t dirty;         /* Pages dirty or under writeback */
+    uint32_t writebacks;    /* Bios written back */
+    uint32_t write_errors;  /* Bios failed to write back */
+};
+
 /* Initialize block IO */
 void bio_initialize();
 
 /* Get block IO, after some operations, call bio_release to release */
 struct bio * bio_get(uint8_t dev, uint64_t sector);
 
+/*
+ * Get block IO for a large transfer from sector, the bio may have up to
+ * pages pages(16 at most) and it is read by one IO. It returns a smaller
+ * bio if the range is partly cached or memory is low, the data of the
+ * bio is contiguous from sector to bio_last_sector.
+ */
+struct bio * bio_get_extent(uint8_t dev, uint64_t sector, uint32_t pages);
+
+/* Get the first sector number of the bio */
+uint64_t bio_first_sector(struct bio *bio);
+
 /* Get the last sector number of the bio */
 uint64_t bio_last_sector(struct bio *bio);
 
@@ -27,13 +64,62 @@ char * bio_data(struct bio *bio);
  */
 void bio_advance_iter(struct bio *bio);
 
-/* Read sectors from block device */
+/*
+ * Read sectors from block device if they are not cached. Sequential
+ * reads of a device start async read-ahead of the following bios.
+ */
 bool bio_read(struct bio *bio);
 
-/* Write sector buffer content to block device */
+/*
+ * Submit async read of the bio referenced by caller, callback is called
+ * when the read completes if it is not NULL. Call bio_wait to wait for
+ * the read before using the data.
+ */
+void bio_submit_read(struct bio *bio, bio_callback_t callback);
+
+/* Wait for the submitted read of the bio, returns true if it succeeds */
+bool bio_wait(struct bio *bio);
+
+/*
+ * Submit reads of all bios referenced by caller, and then wait for all
+ * of them. Returns true if all reads succeed.
+ */
+bool bio_read_batch(struct bio **bios, uint32_t count);
+
+/*
+ * Mark the bio dirty after its sector buffer is modified, it is written
+ * back to block device later by flusher in sector ordered batches, so
+ * repeated writes of the bio are coalesced.
+ */
 void bio_write(struct bio *bio);
 
+/*
+ * Write back all dirty bios of the device and wait until they are on
+ * disk, referenced bios are written as they are now. Returns false if a
+ * write fails, the bio stays dirty in cache and is retried later.
+ */
+bool bio_sync(uint8_t dev);
+
+/*
+ * Write back dirty bios which have sectors in [start, end) of the device
+ * and wait until they are on disk, then the disk is up to date for
+ * direct IO of the range. Returns false if a write fails.
+ */
+bool bio_sync_range(uint8_t dev, uint64_t start, uint64_t end);
+
+/*
+ * Hint that the bio holds file system metadata, it is kept in protected
+ * list of the cache and reused after other bios.
+ */
+void bio_mark_metadata(struct bio *bio);
+
 /* Release the bio */
 void bio_release(struct bio *bio);
 
+/* Get statistics of block IO cache */
+void bio_get_stats(struct bio_stats *stats);
+
+/* Print statistics of block IO cache */
+void bio_print_statistics();
+
 #endif /* BIO_H */
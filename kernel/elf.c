@@ -57,6 +57,10 @@ static bool load_from_prog_header(const char *elf_data, size_t size,
     if (ph->p_offset >= size || ph->p_offset + ph->p_filesz > size)
         return false;
 
+    /* The segment must not overlap the user stack and kernel space */
+    if (vaddr_end < ph->p_vaddr || vaddr_end > PROC_USER_STACK_BOTTOM)
+        return false;
+
     /* This segment is empty, just returns true */
     if (ph->p_memsz == 0)
         return true;
@@ -64,35 +68,43 @@ static bool load_from_prog_header(const char *elf_data, size_t size,
     for (uint32_t vaddr = ph->p_vaddr - page_offset;
          vaddr < vaddr_end; vaddr += PAGE_SIZE)
     {
-        size_t sz_in_page = PAGE_SIZE - page_offset;
-        physical_addr_t paddr = pmm_alloc_page_address();
-        void *dest = CAST_PHYSICAL_TO_VIRTUAL(paddr + page_offset);
-        int extra_pages = 0;
+        size_t copy_size = KMIN(file_size, PAGE_SIZE - page_offset);
+        physical_addr_t paddr = 0;
+        void *dest = NULL;
+
+        /*
+         * Pages without file content(.bss) are zero filled anonymous
+         * memory, allocate them on demand.
+         */
+        if (file_size == 0)
+        {
+            if (!proc_map_anonymous(proc, (void *)vaddr))
+                return false;
+
+            page_offset = 0;
+            continue;
+        }
 
         /* Out of memory, load fail */
+        paddr = pmm_alloc_page_address();
         if (!paddr) return false;
 
         /* Fill zero in page */
+        dest = CAST_PHYSICAL_TO_VIRTUAL(paddr + page_offset);
         memset(CAST_PHYSICAL_TO_VIRTUAL(paddr), 0, PAGE_SIZE);
 
         /* Map memory page */
-        if ((extra_pages = vmm_map(proc->page_dir, (void *)vaddr,
-                                   paddr, VMM_WRITABLE | VMM_USER)) < 0)
+        if (!proc_map_page(proc, (void *)vaddr, paddr,
+                           VMM_WRITABLE | VMM_USER))
         {
             pmm_free_page_address(paddr);
             return false;
         }
 
-        proc->mem_pages += extra_pages + 1;
-
-        if (file_size != 0)
-        {
-            /* Copy elf file content to destination */
-            size_t copy_size = KMIN(file_size, sz_in_page);
-            memcpy(dest, elf_data + file_offset, copy_size);
-            file_offset += copy_size;
-            file_size -= copy_size;
-        }
+        /* Copy elf file content to destination */
+        memcpy(dest, elf_data + file_offset, copy_size);
+        file_offset += copy_size;
+        file_size -= copy_size;
 
         page_offset = 0;
     }
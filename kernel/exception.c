@@ -2,6 +2,7 @@
 #include <kernel/gdt.h>
 #include <kernel/idt.h>
 #include <kernel/klib.h>
+#include <kernel/scheduler.h>
 
 static inline void setup_handle(uint8_t num, void *handle)
 {
@@ -99,6 +100,12 @@ static void general_protection_fault_handle(uint32_t error_code)
 
 static void page_fault_handle(void *virtual_address, uint32_t error_code)
 {
+    struct process *proc = sched_get_running_proc();
+
+    /* Demand paging of the running process */
+    if (proc && proc_page_fault(proc, virtual_address, error_code))
+        return ;
+
     panic("Page fault exception at %p, error code: 0x%x",
           virtual_address, error_code);
 }
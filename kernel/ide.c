@@ -1,8 +1,11 @@
 #include <kernel/ide.h>
-#include <kernel/ktask.h>
+#include <kernel/iosched.h>
 #include <kernel/klib.h>
 #include <kernel/pic.h>
+#include <kernel/wait.h>
+#include <kernel/scheduler.h>
 #include <mm/slab.h>
+#include <mm/pmm.h>
 
 /* Base address register of IDE */
 enum ide_bar
@@ -77,9 +80,17 @@ enum ide_bus_master
 enum bus_master_cmd
 {
     BUS_MASTER_CMD_WRITE = 0x0,
+    BUS_MASTER_CMD_START = 0x1,
     BUS_MASTER_CMD_READ = 0x8,
 };
 
+enum bus_master_status
+{
+    BUS_MASTER_STATUS_ACTIVE = 0x1,
+    BUS_MASTER_STATUS_ERROR = 0x2,
+    BUS_MASTER_STATUS_IRQ = 0x4,
+};
+
 struct drive
 {
     uint8_t bus;            /* 0(Primary) or 1(Secondary) */
@@ -96,10 +107,15 @@ struct drive
 struct prd_entry
 {
     uint32_t physical_addr;
-    uint16_t size;
-    uint16_t reserved;
+    uint16_t size;          /* 0 means 64KB */
+    uint16_t reserved;      /* Bit 15 is set for the last entry */
 };
 
+/* PRD table is one page, it never crosses a 64KB boundary */
+#define PRD_TABLE_ENTRIES (PAGE_SIZE / sizeof(struct prd_entry))
+#define PRD_BOUNDARY 0x10000
+#define PRD_LAST_ENTRY 0x8000
+
 struct dma_io_data
 {
     struct ide_dma_io io;
@@ -112,10 +128,9 @@ struct dma_io_data
     struct dma_io_data *next;
 };
 
-static struct drive drives[IDE_ATA_BUS_COUNT * IDE_ATA_DRIVE_COUNT];
-static struct prd_entry prdt[IDE_ATA_BUS_COUNT];
+static struct drive drives[IDE_MAX_DRIVES];
+static struct prd_entry *prdt[IDE_ATA_BUS_COUNT];
 static struct dma_io_data dma_io_data[IDE_ATA_BUS_COUNT];
-static struct kernel_task ide_task;
 static struct kmem_cache *io_data_cache;
 
 static void initialize_io_data()
@@ -129,6 +144,62 @@ static void initialize_io_data()
 
     /* Create struct dma_io_data cache */
     io_data_cache = slab_create_kmem_cache(sizeof(struct dma_io_data), sizeof(void *));
+
+    /* Alloc PRD tables */
+    for (uint32_t i = 0; i < IDE_ATA_BUS_COUNT; ++i)
+    {
+        prdt[i] = cast_p2v_or_null(pmm_alloc_page_address());
+        if (!prdt[i])
+            panic("[IDE] - alloc PRD table failed.");
+    }
+}
+
+/*
+ * Fill the segment into PRD table from entry index, split the segment
+ * when it crosses a 64KB boundary. Returns the next entry index.
+ */
+static uint32_t fill_prd_entries(struct prd_entry *table, uint32_t index,
+                                 physical_addr_t addr, size_t size)
+{
+    while (size > 0)
+    {
+        size_t bytes = KMIN(size, PRD_BOUNDARY - (addr & (PRD_BOUNDARY - 1)));
+
+        if (index >= PRD_TABLE_ENTRIES)
+            panic("[IDE] - PRD table overflow.");
+
+        table[index].physical_addr = addr;
+        table[index].size = bytes & 0xffff;
+        table[index].reserved = 0;
+
+        addr += bytes;
+        size -= bytes;
+        ++index;
+    }
+
+    return index;
+}
+
+/* Prepare PRD table for the IO, returns the physical address of table */
+static physical_addr_t prepare_prdt(const struct ide_dma_io *io,
+                                    struct prd_entry *table)
+{
+    uint32_t count = 0;
+
+    if (io->segments)
+    {
+        for (uint32_t i = 0; i < io->segment_count; ++i)
+            count = fill_prd_entries(table, count, io->segments[i].addr,
+                                     io->segments[i].size);
+    }
+    else
+    {
+        count = fill_prd_entries(table, count, io->buffer, io->size);
+    }
+
+    /* Set it as the last PRD entry */
+    table[count - 1].reserved = PRD_LAST_ENTRY;
+    return CAST_VIRTUAL_TO_PHYSICAL(table);
 }
 
 static void start_io_operation(const struct dma_io_data *data)
@@ -138,17 +209,12 @@ static void start_io_operation(const struct dma_io_data *data)
     uint16_t count = data->io.sector_count;
     uint64_t start = data->io.start;
     struct drive *d = &drives[data->io.drive];
-    struct prd_entry *prdt_address = &prdt[d->bus];
-
-    /* Prepare PRDT */
-    prdt_address->physical_addr = data->io.buffer;
-    prdt_address->size = data->io.size;
-    prdt_address->reserved = 0x8000;    /* Set it as the last PRD entry */
+    physical_addr_t prdt_address = prepare_prdt(&data->io, prdt[d->bus]);
 
     /* Stop DMA first, and then send command. */
     out_byte(d->bm_reg + IDE_BUS_MASTER_CMD, 0x0);
-    out_dword(d->bm_reg + IDE_BUS_MASTER_PRDT, CAST_VIRTUAL_TO_PHYSICAL(prdt_address));
-    out_byte(d->bm_reg + IDE_BUS_MASTER_CMD, bm_cmd | 0x1);
+    out_dword(d->bm_reg + IDE_BUS_MASTER_PRDT, prdt_address);
+    out_byte(d->bm_reg + IDE_BUS_MASTER_CMD, bm_cmd | BUS_MASTER_CMD_START);
 
     if (d->lba48)
     {
@@ -194,57 +260,57 @@ static void complete_io_operation(struct dma_io_data *dma_data_head,
     io.complete_func(&io, error);
 }
 
-static void check_if_io_complete(uint8_t bus)
+static void handle_irq(uint8_t bus)
 {
     struct dma_io_data *dma_data_head = &dma_io_data[bus];
     struct dma_io_data *dma_data = dma_data_head->next;
+    struct drive *d = &drives[bus * IDE_ATA_DRIVE_COUNT];
+    uint8_t status = in_byte(d->bm_reg + IDE_BUS_MASTER_STATUS);
+    uint8_t ata_status = 0;
 
-    if (dma_data != dma_data_head)
-    {
-        struct drive *d = &drives[dma_data->io.drive];
-        uint8_t status = in_byte(d->bm_reg + IDE_BUS_MASTER_STATUS);
+    /* Read status register to clear the interrupt of drive */
+    ata_status = in_byte(d->base_reg + IDE_REGISTER_COMMAND_STATUS);
 
-        if (status & 0x2)
-        {
-            /* Error, clear bus master status bit 1 */
-            out_byte(d->bm_reg + IDE_BUS_MASTER_STATUS, 0x2);
+    /* Spurious interrupt, e.g. raised by non DMA command */
+    if (!(status & BUS_MASTER_STATUS_IRQ) || dma_data == dma_data_head)
+        return ;
 
-            /* Reset drives */
-            out_byte(d->control_reg, 0x4);
-            out_byte(d->control_reg, 0);
+    /* Stop DMA, and clear the interrupt and error bits of bus master */
+    out_byte(d->bm_reg + IDE_BUS_MASTER_CMD, 0x0);
+    out_byte(d->bm_reg + IDE_BUS_MASTER_STATUS, status);
 
-            /* Retry if the error is the first occurrence */
-            if (dma_data->retry == 0)
-            {
-                dma_data->retry = 1;
-                start_io_operation(dma_data);
-            }
-            else
-            {
-                complete_io_operation(dma_data_head, dma_data, true);
-            }
+    if ((status & BUS_MASTER_STATUS_ERROR) ||
+        (ata_status & (IDE_ATA_STATUS_ERR | IDE_ATA_STATUS_DF)))
+    {
+        /* Reset drives */
+        out_byte(d->control_reg, 0x4);
+        out_byte(d->control_reg, 0);
+
+        /* Retry if the error is the first occurrence */
+        if (dma_data->retry == 0)
+        {
+            dma_data->retry = 1;
+            start_io_operation(dma_data);
         }
-        else if (!(status & 0x1))
+        else
         {
-            complete_io_operation(dma_data_head, dma_data, false);
+            complete_io_operation(dma_data_head, dma_data, true);
         }
     }
-}
-
-static void task_function(void *data)
-{
-    (void)data;
-
-    for (uint32_t i = IDE_ATA_BUS_PRIMARY; i < IDE_ATA_BUS_COUNT; ++i)
-        check_if_io_complete(i);
+    else
+    {
+        complete_io_operation(dma_data_head, dma_data, false);
+    }
 }
 
 static void irq_isr14()
 {
+    handle_irq(IDE_ATA_BUS_PRIMARY);
 }
 
 static void irq_isr15()
 {
+    handle_irq(IDE_ATA_BUS_SECONDARY);
 }
 
 static void detect_drive(struct drive *d)
@@ -310,6 +376,12 @@ static void detect_drive(struct drive *d)
 
 void ide_initialize(uint16_t bm_dma)
 {
+    /* Each bus serves one request at a time */
+    static const struct iosched_driver driver =
+    {
+        "IDE", ide_dma_read_sectors, ide_dma_write_sectors, NULL
+    };
+
     uint32_t count = 0;
     bool primary_exist = false;
     bool secondary_exist = false;
@@ -341,6 +413,8 @@ void ide_initialize(uint16_t bm_dma)
                 uint32_t bytes = d->sectors * SECTOR_SIZE;
                 printk("  [ATA%u-%u] %u bytes, model: %s\n",
                        d->bus, d->drive, bytes, d->model);
+                iosched_add_device(&driver, 1, d->sectors,
+                                   bus * IDE_ATA_DRIVE_COUNT + drive);
                 ++count;
             }
         }
@@ -348,14 +422,7 @@ void ide_initialize(uint16_t bm_dma)
 
     initialize_io_data();
 
-    /* Register task function when there is one drive at least. */
-    if (count > 0)
-    {
-        ide_task.task_func = task_function;
-        ide_task.data = NULL;
-        ktask_register(&ide_task);
-    }
-
+    /* IO completion is handled in IRQ ISRs */
     if (primary_exist) pic_register_isr(IRQ14, irq_isr14);
     if (secondary_exist) pic_register_isr(IRQ15, irq_isr15);
 
@@ -393,7 +460,7 @@ static void check_drive(const struct ide_dma_io *io_data)
     uint64_t start = io_data->start;
     uint16_t sector_count = io_data->sector_count;
 
-    if (drive >= IDE_ATA_BUS_COUNT * IDE_ATA_DRIVE_COUNT || !drives[drive].exist)
+    if (drive >= IDE_MAX_DRIVES || !drives[drive].exist)
         panic("[IDE] - drive not exist, drive no: %d.", drive);
 
     d = &drives[drive];
@@ -401,9 +468,38 @@ static void check_drive(const struct ide_dma_io *io_data)
         panic("[IDE] - out of sector's range, total sectors: %u, start: %u, count: %u.",
               (uint32_t)d->sectors, (uint32_t)start, sector_count);
 
-    if (io_data->size != sector_count * SECTOR_SIZE)
+    if (sector_count == 0 || sector_count >
+        (d->lba48 ? IDE_LBA48_MAX_SECTORS : IDE_LBA28_MAX_SECTORS))
+        panic("[IDE] - invalid sector count: %u.", sector_count);
+
+    if (io_data->segments)
+    {
+        size_t size = 0;
+
+        if (io_data->segment_count == 0 ||
+            io_data->segment_count > IDE_DMA_MAX_SEGMENTS)
+            panic("[IDE] - invalid segment count: %u.",
+                  io_data->segment_count);
+
+        for (uint32_t i = 0; i < io_data->segment_count; ++i)
+        {
+            const struct ide_dma_segment *seg = &io_data->segments[i];
+            if (seg->size == 0 || seg->size > PRD_BOUNDARY ||
+                ((seg->addr | seg->size) & 1))
+                panic("[IDE] - invalid segment, address: 0x%x, size: %u.",
+                      seg->addr, seg->size);
+            size += seg->size;
+        }
+
+        if (size != sector_count * SECTOR_SIZE)
+            panic("[IDE] - io segments size(%u) != 512 * sector_count(%u).",
+                  size, sector_count);
+    }
+    else if (io_data->size != sector_count * SECTOR_SIZE)
+    {
         panic("[IDE] - io buffer size(%u) != 512 * sector_count(%u).",
               io_data->size, sector_count);
+    }
 }
 
 void ide_dma_read_sectors(const struct ide_dma_io *io_data)
@@ -424,33 +520,62 @@ void ide_dma_write_sectors(const struct ide_dma_io *io_data)
     dma_io_sectors(io_data, BUS_MASTER_CMD_WRITE, cmd);
 }
 
+/* Waiting data of sync read/write */
+struct sync_io
+{
+    bool done;
+    bool error;
+    struct wait_queue wait;
+};
+
 static void sync_io_complete(struct ide_dma_io *io_data, bool error)
 {
-    *(bool *)io_data->data = error;
+    struct sync_io *sync = io_data->data;
+
+    sync->done = true;
+    sync->error = error;
+    wait_queue_wake_all(&sync->wait);
 }
 
 static inline bool sync_io_sectors(const struct ide_io *io_data,
                                    void (*io_func)(const struct ide_dma_io *))
 {
-    bool error = false;
+    struct sync_io sync;
     struct ide_dma_io io;
+    bool enabled = int_enabled();
+
+    sync.done = false;
+    sync.error = false;
+    wait_queue_init(&sync.wait);
 
     io.drive = io_data->drive;
     io.start = io_data->start;
     io.sector_count = io_data->sector_count;
     io.buffer = io_data->buffer;
     io.size = io_data->size;
-    io.data = &error;
+    io.segments = NULL;
+    io.segment_count = 0;
+    io.data = &sync;
     io.complete_func = sync_io_complete;
 
+    /* The completion IRQ can not come between checking done and sleeping */
+    close_int();
+
     io_func(&io);
 
-    /* Wait io complete */
-    for (uint8_t bus = drives[io.drive].bus;
-         dma_io_data[bus].next != &dma_io_data[bus];)
-        check_if_io_complete(bus);
+    /* Wait io complete, halt until IRQ when there is no process to sleep */
+    while (!sync.done)
+    {
+        if (sched_get_running_proc())
+            wait_queue_sleep(&sync.wait);
+        else
+            wait_int();
+    }
+
+    if (enabled)
+        start_int();
 
-    return !error;
+    return !sync.error;
 }
 
 bool ide_read_sectors(const struct ide_io *io_data)
@@ -5,6 +5,16 @@
 
 #define SECTOR_SIZE 512
 
+/* Drives of primary and secondary bus */
+#define IDE_MAX_DRIVES 4
+
+/* Max sectors of one DMA request */
+#define IDE_LBA28_MAX_SECTORS 256
+#define IDE_LBA48_MAX_SECTORS 65535
+
+/* Max segments of one DMA request, each segment is 64KB at most */
+#define IDE_DMA_MAX_SEGMENTS 256
+
 void ide_initialize(uint16_t bm_dma);
 
 struct ide_dma_io;
@@ -12,10 +22,23 @@ struct ide_dma_io;
  * Prototype of io complete function:
  *     void io_complete(struct ide_dma_io *io_data, bool error);
  * If error is true, then an error was occurred when doing IO.
+ * The function is called in IRQ ISR with interrupt closed.
  */
 typedef void (*ide_on_io_complete_t)(struct ide_dma_io *, bool);
 
-/* IO data struct for DMA read/write */
+/* Physically contiguous memory segment of scatter-gather DMA */
+struct ide_dma_segment
+{
+    physical_addr_t addr;   /* Even address */
+    size_t size;            /* Even size, 64KB at most */
+};
+
+/*
+ * IO data struct for DMA read/write.
+ * The IO buffer is the segment list when segments is not NULL, the list
+ * should be valid until the IO is complete, otherwise it is the single
+ * contiguous buffer [buffer, buffer + size).
+ */
 struct ide_dma_io
 {
     uint8_t drive;
@@ -24,6 +47,8 @@ struct ide_dma_io
 
     physical_addr_t buffer;
     size_t size;
+    const struct ide_dma_segment *segments;
+    uint32_t segment_count;
     void *data;
     ide_on_io_complete_t complete_func;
 };
@@ -0,0 +1,394 @@
+#include <kernel/iosched.h>
+#include <kernel/scheduler.h>
+#include <kernel/klib.h>
+#include <kernel/pit.h>
+#include <mm/slab.h>
+
+#define MAX_SEGMENT_SIZE 0x10000
+
+/* Requests are dispatched in sector order unless one waits 500ms */
+#define REQUEST_DEADLINE (TIMER_HZ / 2)
+
+/* Submitted IO, it is a part of a request */
+struct io_part
+{
+    struct ide_dma_io io;
+    struct io_part *next;
+};
+
+/* Request consists of IOs of adjacent sectors */
+struct io_request
+{
+    struct ide_dma_io io;           /* Merged IO sent to driver */
+    struct ide_dma_segment segments[IOSCHED_MAX_SEGMENTS];
+    bool write;                     /* Write request */
+    uint32_t submit_ticks;          /* Submit ticks of the oldest IO */
+
+    struct io_part *parts;          /* IOs in sector order */
+    struct io_part *parts_tail;
+
+    struct io_request *prev;        /* Pending requests sorted by sector */
+    struct io_request *next;
+};
+
+struct request_queue
+{
+    const struct iosched_driver *driver;
+    uint64_t sectors;               /* Total sectors of device */
+    uint32_t depth;                 /* Max requests dispatched to driver */
+    uint32_t active;                /* Requests dispatched to driver */
+    struct io_request *pending;     /* Pending requests */
+    uint64_t head_sector;           /* Sector after the last dispatched */
+    uint32_t plugged;               /* Plug count */
+    struct iosched_stats stats;
+};
+
+static struct request_queue queues[IOSCHED_MAX_DEVICES];
+static struct kmem_cache *request_cache;
+static struct kmem_cache *part_cache;
+
+static void complete_request(struct ide_dma_io *io, bool error);
+
+void iosched_initialize()
+{
+    request_cache = slab_create_kmem_cache(
+        sizeof(struct io_request), sizeof(void *));
+    part_cache = slab_create_kmem_cache(
+        sizeof(struct io_part), sizeof(void *));
+
+    if (!request_cache || !part_cache)
+        panic("[IOSCHED] - slab initialize failed.");
+}
+
+int iosched_add_device(const struct iosched_driver *driver,
+                       uint32_t depth, uint64_t sectors, int dev)
+{
+    if (dev < 0)
+    {
+        for (dev = IDE_MAX_DRIVES; dev < IOSCHED_MAX_DEVICES; ++dev)
+        {
+            if (!queues[dev].driver)
+                break;
+        }
+
+        if (dev == IOSCHED_MAX_DEVICES)
+            return -1;
+    }
+    else if (dev >= IOSCHED_MAX_DEVICES || queues[dev].driver)
+    {
+        panic("[IOSCHED] - add invalid device: %d.", dev);
+    }
+
+    queues[dev].driver = driver;
+    queues[dev].sectors = sectors;
+    queues[dev].depth = KMAX(depth, 1);
+    return dev;
+}
+
+uint64_t iosched_get_capacity(uint8_t dev)
+{
+    if (dev >= IOSCHED_MAX_DEVICES || !queues[dev].driver)
+        return 0;
+    return queues[dev].sectors;
+}
+
+static inline struct request_queue * get_queue(uint8_t drive)
+{
+    if (drive >= IOSCHED_MAX_DEVICES || !queues[drive].driver)
+        panic("[IOSCHED] - invalid device: %u.", drive);
+    return &queues[drive];
+}
+
+static inline uint64_t request_end(const struct io_request *req)
+{
+    return req->io.start + req->io.sector_count;
+}
+
+static inline bool older_than(uint32_t ticks1, uint32_t ticks2)
+{
+    return (int32_t)(ticks1 - ticks2) < 0;
+}
+
+static void add_segment(struct io_request *req,
+                        physical_addr_t addr, size_t size)
+{
+    struct ide_dma_segment *last = NULL;
+
+    if (req->io.segment_count > 0)
+        last = &req->segments[req->io.segment_count - 1];
+
+    /* Coalesce physically contiguous segments */
+    if (last && last->addr + last->size == addr &&
+        last->size + size <= MAX_SEGMENT_SIZE)
+    {
+        last->size += size;
+    }
+    else
+    {
+        req->segments[req->io.segment_count].addr = addr;
+        req->segments[req->io.segment_count].size = size;
+        req->io.segment_count += 1;
+    }
+
+    req->io.size += size;
+}
+
+static struct io_request * alloc_request(const struct ide_dma_io *io,
+                                         bool write)
+{
+    struct io_request *req = slab_alloc(request_cache);
+    struct io_part *part = slab_alloc(part_cache);
+
+    if (!req || !part)
+        panic("[IOSCHED] - alloc request failed.");
+
+    if (io->sector_count > IOSCHED_MAX_SECTORS ||
+        (io->segments && io->segment_count > IOSCHED_MAX_SEGMENTS))
+        panic("[IOSCHED] - IO is too large, sectors: %u, segments: %u.",
+              io->sector_count, io->segment_count);
+
+    part->io = *io;
+    part->next = NULL;
+
+    req->io.drive = io->drive;
+    req->io.start = io->start;
+    req->io.sector_count = io->sector_count;
+    req->io.buffer = 0;
+    req->io.size = 0;
+    req->io.segments = req->segments;
+    req->io.segment_count = 0;
+    req->io.data = req;
+    req->io.complete_func = complete_request;
+
+    if (io->segments)
+    {
+        for (uint32_t i = 0; i < io->segment_count; ++i)
+            add_segment(req, io->segments[i].addr, io->segments[i].size);
+    }
+    else
+    {
+        add_segment(req, io->buffer, io->size);
+    }
+
+    req->write = write;
+    req->submit_ticks = sched_ticks();
+    req->parts = req->parts_tail = part;
+    req->prev = req->next = NULL;
+    return req;
+}
+
+static inline bool can_merge(const struct io_request *front,
+                             const struct io_request *back)
+{
+    return front->write == back->write &&
+        request_end(front) == back->io.start &&
+        front->io.sector_count + back->io.sector_count <= IOSCHED_MAX_SECTORS &&
+        front->io.segment_count + back->io.segment_count <= IOSCHED_MAX_SEGMENTS;
+}
+
+/* Move all IOs of back into front, back is freed */
+static void merge_request(struct io_request *front, struct io_request *back)
+{
+    for (uint32_t i = 0; i < back->io.segment_count; ++i)
+        add_segment(front, back->segments[i].addr, back->segments[i].size);
+
+    front->io.sector_count += back->io.sector_count;
+    front->parts_tail->next = back->parts;
+    front->parts_tail = back->parts_tail;
+
+    if (older_than(back->submit_ticks, front->submit_ticks))
+        front->submit_ticks = back->submit_ticks;
+
+    slab_free(request_cache, back);
+}
+
+static void insert_request(struct request_queue *q, struct io_request *prev,
+                           struct io_request *req)
+{
+    req->prev = prev;
+    req->next = prev ? prev->next : q->pending;
+
+    if (req->next)
+        req->next->prev = req;
+
+    if (prev)
+        prev->next = req;
+    else
+        q->pending = req;
+
+    q->stats.depth += 1;
+    q->stats.max_depth = KMAX(q->stats.max_depth, q->stats.depth);
+}
+
+static void remove_request(struct request_queue *q, struct io_request *req)
+{
+    if (req->prev)
+        req->prev->next = req->next;
+    else
+        q->pending = req->next;
+
+    if (req->next)
+        req->next->prev = req->prev;
+
+    req->prev = req->next = NULL;
+    q->stats.depth -= 1;
+}
+
+/*
+ * Pick the request which waits longer than deadline, otherwise pick the
+ * next request in sector order after the last dispatched one(C-LOOK).
+ */
+static struct io_request * pick_request(struct request_queue *q)
+{
+    struct io_request *oldest = q->pending;
+    struct io_request *req = NULL;
+
+    for (req = q->pending->next; req; req = req->next)
+    {
+        if (older_than(req->submit_ticks, oldest->submit_ticks))
+            oldest = req;
+    }
+
+    if (sched_ticks() - oldest->submit_ticks >= REQUEST_DEADLINE)
+    {
+        q->stats.expired += 1;
+        return oldest;
+    }
+
+    for (req = q->pending; req; req = req->next)
+    {
+        if (req->io.start >= q->head_sector)
+            return req;
+    }
+
+    return q->pending;
+}
+
+static void dispatch(struct request_queue *q)
+{
+    uint32_t count = 0;
+
+    /* Keep at most depth requests in the driver */
+    for (; q->active < q->depth && !q->plugged && q->pending; ++count)
+    {
+        struct io_request *req = pick_request(q);
+        remove_request(q, req);
+
+        q->active += 1;
+        q->head_sector = request_end(req);
+        q->stats.dispatched += 1;
+
+        if (req->write)
+            q->driver->write(&req->io);
+        else
+            q->driver->read(&req->io);
+    }
+
+    if (count > 0 && q->driver->kick)
+        q->driver->kick(q - queues);
+}
+
+static void complete_request(struct ide_dma_io *io, bool error)
+{
+    struct io_request *req = io->data;
+    struct request_queue *q = get_queue(req->io.drive);
+    struct io_part *part = req->parts;
+
+    q->active -= 1;
+    slab_free(request_cache, req);
+
+    /* Keep the drive busy, and then complete all IOs of the request */
+    dispatch(q);
+
+    while (part)
+    {
+        struct io_part *next = part->next;
+        part->io.complete_func(&part->io, error);
+        slab_free(part_cache, part);
+        part = next;
+    }
+}
+
+static void submit_io(const struct ide_dma_io *io, bool write)
+{
+    struct request_queue *q = get_queue(io->drive);
+    struct io_request *req = alloc_request(io, write);
+    struct io_request *prev = NULL;
+    struct io_request *next = q->pending;
+
+    q->stats.submitted += 1;
+
+    /* Find the position in sector order */
+    while (next && next->io.start < req->io.start)
+    {
+        prev = next;
+        next = next->next;
+    }
+
+    if (prev && can_merge(prev, req))
+    {
+        /* Back merge */
+        merge_request(prev, req);
+        req = prev;
+        q->stats.back_merges += 1;
+    }
+    else
+    {
+        insert_request(q, prev, req);
+    }
+
+    if (next && can_merge(req, next))
+    {
+        /* Front merge */
+        remove_request(q, next);
+        merge_request(req, next);
+        q->stats.front_merges += 1;
+    }
+
+    dispatch(q);
+}
+
+void iosched_read(const struct ide_dma_io *io)
+{
+    submit_io(io, false);
+}
+
+void iosched_write(const struct ide_dma_io *io)
+{
+    submit_io(io, true);
+}
+
+void iosched_plug(uint8_t drive)
+{
+    get_queue(drive)->plugged += 1;
+}
+
+void iosched_unplug(uint8_t drive)
+{
+    struct request_queue *q = get_queue(drive);
+
+    if (q->plugged > 0 && --q->plugged == 0)
+        dispatch(q);
+}
+
+void iosched_get_stats(uint8_t drive, struct iosched_stats *stats)
+{
+    *stats = get_queue(drive)->stats;
+}
+
+void iosched_print_statistics()
+{
+    for (uint32_t i = 0; i < IOSCHED_MAX_DEVICES; ++i)
+    {
+        const struct iosched_stats *stats = &queues[i].stats;
+        if (stats->submitted == 0)
+            continue;
+
+        printk("[%-8s] dev %u(%s): submitted %u, dispatched %u, "
+               "back merges %u, front merges %u, expired %u, "
+               "depth %u, max depth %u\n", "IOSched", i,
+               queues[i].driver->name, stats->submitted, stats->dispatched,
+               stats->back_merges, stats->front_merges, stats->expired,
+               stats->depth, stats->max_depth);
+    }
+}
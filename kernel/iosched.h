@@ -0,0 +1,76 @@
+#ifndef IOSCHED_H
+#define IOSCHED_H
+
+#include <kernel/ide.h>
+
+/* Max devices of IO scheduler */
+#define IOSCHED_MAX_DEVICES 8
+
+/* Max size of a request, a submitted IO should not be larger than it */
+#define IOSCHED_MAX_SECTORS 256
+#define IOSCHED_MAX_SEGMENTS 32
+
+/*
+ * Block device driver, requests are dispatched to it. If kick is not
+ * NULL, it is called once after a batch of requests is dispatched, so
+ * the driver can notify the device once for the batch.
+ */
+struct iosched_driver
+{
+    const char *name;
+    void (*read)(const struct ide_dma_io *io);
+    void (*write)(const struct ide_dma_io *io);
+    void (*kick)(uint8_t dev);
+};
+
+/* Statistics of the request queue of a device */
+struct iosched_stats
+{
+    uint32_t submitted;     /* IOs submitted */
+    uint32_t dispatched;    /* Requests dispatched to driver */
+    uint32_t back_merges;   /* IOs merged at the end of a request */
+    uint32_t front_merges;  /* IOs merged at the start of a request */
+    uint32_t expired;       /* Requests dispatched by deadline */
+    uint32_t depth;         /* Pending requests */
+    uint32_t max_depth;     /* Max pending requests */
+};
+
+void iosched_initialize();
+
+/*
+ * Add a block device of sectors, at most depth requests are dispatched
+ * to the driver at the same time. IDE drives use their drive numbers,
+ * other devices pass dev as -1 to use the first free number after IDE
+ * drives. Returns the device number, or -1 if there is no free device
+ * number.
+ */
+int iosched_add_device(const struct iosched_driver *driver,
+                       uint32_t depth, uint64_t sectors, int dev);
+
+/* Get total sectors of the device, 0 if the device does not exist */
+uint64_t iosched_get_capacity(uint8_t dev);
+
+/*
+ * Submit read/write IO into the request queue of device io->drive, adjacent
+ * IOs are merged into one request, the complete function of each IO is
+ * called when its request is complete. IOs of the same sectors should
+ * not be pending at the same time, they may be reordered.
+ * All functions should be called with interrupt closed.
+ */
+void iosched_read(const struct ide_dma_io *io);
+void iosched_write(const struct ide_dma_io *io);
+
+/*
+ * Plug the request queue of the device, requests are not dispatched
+ * until it is unplugged, so a burst of IOs can be merged. Plugs nest.
+ */
+void iosched_plug(uint8_t drive);
+void iosched_unplug(uint8_t drive);
+
+/* Get statistics of the request queue */
+void iosched_get_stats(uint8_t drive, struct iosched_stats *stats);
+
+/* Print statistics of all used request queues */
+void iosched_print_statistics();
+
+#endif /* IOSCHED_H */
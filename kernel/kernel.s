@@ -11,13 +11,17 @@ global set_idtr
 global set_cr3
 global set_tss
 global in_byte
+global in_word
 global in_dword
 global insw
 global out_byte
+global out_word
 global out_dword
 global close_int
 global start_int
+global int_enabled
 global halt
+global wait_int
 global switch_kcontext
 global ret_user_space
 global syscall_entry
@@ -83,8 +87,9 @@ set_cr3:
     mov     eax, dword [esp + 4]
     mov     cr3, eax
 
+    ; Enable paging, and write protect read only pages in ring 0 too
     mov     eax, cr0
-    or      eax, 0x80000000
+    or      eax, 0x80010000
     mov     cr0, eax
     ret
 
@@ -101,6 +106,14 @@ in_byte:
     nop
     ret
 
+in_word:
+    mov     edx, dword [esp + 4]
+    xor     eax, eax
+    in      ax, dx
+    nop
+    nop
+    ret
+
 in_dword:
     mov     edx, dword [esp + 4]
     xor     eax, eax
@@ -126,6 +139,14 @@ out_byte:
     nop
     ret
 
+out_word:
+    mov     edx, dword [esp + 4]
+    mov     ax, word [esp + 8]
+    out     dx, ax
+    nop
+    nop
+    ret
+
 out_dword:
     mov     edx, dword [esp + 4]
     mov     eax, dword [esp + 8]
@@ -142,8 +163,26 @@ start_int:
     sti
     ret
 
+; Returns 1 if interrupt is enabled, the IF bit of eflags
+int_enabled:
+    pushfd
+    pop     eax
+    shr     eax, 9
+    and     eax, 1
+    ret
+
 halt:
     hlt
+    ret
+
+; Enable interrupt and halt until an interrupt is handled, then close
+; interrupt. sti delays interrupt until hlt is executed, so the wake up
+; interrupt can not be lost between them.
+wait_int:
+    sti
+    hlt
+    cli
+    ret
 
 ; Switch kernel stack, prototype in c:
 ;     void switch_kcontext(struct kstack_context **cur,
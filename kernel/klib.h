@@ -17,17 +17,25 @@ void set_tss(uint16_t selector);
 
 /* IO functions */
 uint8_t in_byte(uint16_t port);
+uint16_t in_word(uint16_t port);
 uint32_t in_dword(uint16_t port);
 void insw(uint16_t port, uint32_t count, void *buffer);
 void out_byte(uint16_t port, uint8_t value);
+void out_word(uint16_t port, uint16_t value);
 void out_dword(uint16_t port, uint32_t value);
 
 /* Close/start interrupt */
 void close_int();
 void start_int();
 
+/* Check whether interrupt is enabled */
+bool int_enabled();
+
 void halt();
 
+/* Wait for an interrupt with interrupt enabled, returns with it closed */
+void wait_int();
+
 /* Switch kernel stack context */
 struct kstack_context;
 void switch_kcontext(struct kstack_context **cur,
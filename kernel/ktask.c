@@ -2,23 +2,39 @@
 #include <kernel/klib.h>
 #include <kernel/process.h>
 #include <kernel/scheduler.h>
+#include <kernel/wait.h>
 #include <mm/vmm.h>
 #include <mm/pmm.h>
 #include <mm/paging.h>
 
 static struct kernel_task task_head = { NULL, NULL, &task_head, &task_head };
+static struct wait_queue ktask_wait = WAIT_QUEUE_INIT(ktask_wait);
+static bool ktask_pending;
+
+/* Tick to wake up kernel task process when timer is armed */
+static bool ktask_timer_armed;
+static uint32_t ktask_wake_tick;
 
 static void ktask_main()
 {
     for (;;)
     {
-        struct kernel_task *task = task_head.next;
-        for (; task != &task_head; task = task->next)
-            task->task_func(task->data);
+        struct kernel_task *task = NULL;
+        struct kernel_task *next = NULL;
 
+        /* Sleep until an interrupt makes work available */
         close_int();
-        sched();
+        while (!ktask_pending)
+            wait_queue_sleep(&ktask_wait);
+        ktask_pending = false;
         start_int();
+
+        /* A task function may unregister its task */
+        for (task = task_head.next; task != &task_head; task = next)
+        {
+            next = task->next;
+            task->task_func(task->data);
+        }
     }
 }
 
@@ -42,7 +58,9 @@ void ktask_initialize()
     if (!ktask->page_dir)
         panic("Kernel task vmm alloc fail");
 
+    /* Kernel task only runs when there is work, run it before others */
     ktask->state = PROC_STATE_RUNNING;
+    ktask->nice = SCHED_NICE_MIN;
     ktask->entry = (uint32_t)ktask_main;
 
     pg_copy_kernel_space(ktask->page_dir);
@@ -63,3 +81,29 @@ void ktask_unregister(struct kernel_task *task)
     task->next->prev = task->prev;
     task->prev = task->next = NULL;
 }
+
+void ktask_wake_up()
+{
+    ktask_pending = true;
+    wait_queue_wake_all(&ktask_wait);
+}
+
+void ktask_wake_up_later(uint32_t ticks)
+{
+    uint32_t tick = sched_ticks() + ticks;
+
+    if (!ktask_timer_armed || (int32_t)(tick - ktask_wake_tick) < 0)
+    {
+        ktask_wake_tick = tick;
+        ktask_timer_armed = true;
+    }
+}
+
+void ktask_timer()
+{
+    if (ktask_timer_armed && (int32_t)(sched_ticks() - ktask_wake_tick) >= 0)
+    {
+        ktask_timer_armed = false;
+        ktask_wake_up();
+    }
+}
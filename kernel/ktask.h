@@ -1,6 +1,8 @@
 #ifndef KTASK_H
 #define KTASK_H
 
+#include <stdint.h>
+
 /* Kernel task function data struct */
 struct kernel_task
 {
@@ -15,8 +17,24 @@ void ktask_initialize();
 /*
  * Register/unregister kernel task function.
  * Hold kernel_task struct when it register, release until unregister.
+ * A task function may unregister its own task.
  */
 void ktask_register(struct kernel_task *task);
 void ktask_unregister(struct kernel_task *task);
 
+/*
+ * Kernel task process sleeps when there is no work, interrupt handlers
+ * call this function to run all kernel task functions once.
+ */
+void ktask_wake_up();
+
+/*
+ * Run all kernel task functions once after ticks timer ticks, the
+ * earliest of pending requests is kept.
+ */
+void ktask_wake_up_later(uint32_t ticks);
+
+/* Timer ISR calls this function every tick */
+void ktask_timer();
+
 #endif /* KTASK_H */
@@ -15,5 +15,6 @@ void panic(const char *fmt, ...)
     va_end(ap);
     printk("%s\n\n%s", buf, desc);
 
-    halt();
+    for (;;)
+        halt();
 }
@@ -1,10 +1,16 @@
 #include <kernel/pci.h>
 #include <kernel/klib.h>
 #include <kernel/ide.h>
+#include <kernel/ahci.h>
+#include <kernel/virtio_blk.h>
 
 #define PCI_ENABLE_FLAG 0x80000000
 #define INVALID_VENDOR_ID 0xffff
 
+/* Legacy(transitional) virtio block device */
+#define VIRTIO_VENDOR_ID 0x1af4
+#define VIRTIO_BLK_LEGACY_DEVICE_ID 0x1001
+
 enum pci_config_port
 {
     PCI_CONFIG_ADDRESS_PORT = 0xcf8,
@@ -18,7 +24,15 @@ enum pci_class
 
 enum pci_subclass
 {
-    PCI_SUBCLASS_IDE = 0x1
+    PCI_SUBCLASS_IDE = 0x1,
+    PCI_SUBCLASS_SATA = 0x6
+};
+
+enum pci_command
+{
+    PCI_COMMAND_IO = 0x1,
+    PCI_COMMAND_MEMORY = 0x2,
+    PCI_COMMAND_BUS_MASTER = 0x4
 };
 
 static uint32_t config_read(uint32_t bus, uint32_t device,
@@ -31,6 +45,16 @@ static uint32_t config_read(uint32_t bus, uint32_t device,
     return in_dword(PCI_CONFIG_DATA_PORT);
 }
 
+static void config_write(uint32_t bus, uint32_t device,
+                         uint32_t func, uint32_t offset, uint32_t value)
+{
+    uint32_t address = PCI_ENABLE_FLAG | (bus << 16) |
+        (device << 11) | (func << 8) | (offset & 0xfc);
+
+    out_dword(PCI_CONFIG_ADDRESS_PORT, address);
+    out_dword(PCI_CONFIG_DATA_PORT, value);
+}
+
 static inline uint16_t config_read_low_word(uint32_t bus, uint32_t device,
                                             uint32_t func, uint32_t offset)
 {
@@ -45,18 +69,46 @@ static inline uint16_t config_read_high_word(uint32_t bus, uint32_t device,
 
 static void check_device_function(uint8_t bus, uint8_t device, uint8_t func)
 {
+    uint32_t id = config_read(bus, device, func, 0);
     uint32_t code = config_read(bus, device, func, 0x8);
     uint8_t class = (code >> 24) & 0xff;
     uint8_t subclass = (code >> 16) & 0xff;
     uint8_t prog_if = (code >> 8) & 0xff;
 
-    if (class == PCI_CLASS_MASS_STORAGE && subclass == PCI_SUBCLASS_IDE &&
+    if ((id & 0xffff) == VIRTIO_VENDOR_ID &&
+        (id >> 16) == VIRTIO_BLK_LEGACY_DEVICE_ID)
+    {
+        /* Legacy virtio registers are in IO space of BAR0 */
+        uint16_t bar0 = config_read(bus, device, func, 0x10) & 0xfffc;
+        uint8_t irq = config_read(bus, device, func, 0x3c) & 0xff;
+        uint32_t command = config_read(bus, device, func, 0x4);
+
+        command = (command & 0xffff) | PCI_COMMAND_IO | PCI_COMMAND_BUS_MASTER;
+        config_write(bus, device, func, 0x4, command);
+
+        virtio_blk_initialize(bar0, irq);
+    }
+    else if (class == PCI_CLASS_MASS_STORAGE && subclass == PCI_SUBCLASS_IDE &&
         (prog_if == 0x8a || prog_if == 0x80))
     {
         /* Get bus master register base address */
         uint16_t bar4 = config_read(bus, device, func, 0x20) & 0xfffc;
         ide_initialize(bar4);
     }
+    else if (class == PCI_CLASS_MASS_STORAGE &&
+             subclass == PCI_SUBCLASS_SATA && prog_if == 0x1)
+    {
+        /* AHCI base address is in BAR5, IRQ line is in interrupt line */
+        physical_addr_t bar5 = config_read(bus, device, func, 0x24) & 0xfffffff0;
+        uint8_t irq = config_read(bus, device, func, 0x3c) & 0xff;
+        uint32_t command = config_read(bus, device, func, 0x4);
+
+        /* Enable memory space and bus master DMA, keep status bits */
+        command = (command & 0xffff) | PCI_COMMAND_MEMORY | PCI_COMMAND_BUS_MASTER;
+        config_write(bus, device, func, 0x4, command);
+
+        ahci_initialize(bar5, irq);
+    }
 }
 
 static void check_device(uint8_t bus, uint8_t device)
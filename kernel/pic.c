@@ -2,6 +2,7 @@
 #include <kernel/gdt.h>
 #include <kernel/idt.h>
 #include <kernel/klib.h>
+#include <kernel/scheduler.h>
 
 static pic_isr_t isr_table[IRQ_NUM];
 static void *isr_entry_table[IRQ_NUM] =
@@ -83,6 +84,10 @@ void pic_enable_irq(uint8_t irq_line)
     {
         port = PIC_SLAVE_IMR_DATA;
         irq_line -= IRQ8;
+
+        /* Slave PIC raises interrupts through line 2 of master */
+        value = in_byte(PIC_MASTER_IMR_DATA) & ~(1 << IRQ2);
+        out_byte(PIC_MASTER_IMR_DATA, value);
     }
 
     value = in_byte(port) & ~(1 << irq_line);
@@ -122,6 +127,9 @@ void pic_interrupt(uint8_t irq_line)
 {
     isr_table[irq_line]();
     pic_send_eoi(irq_line);
+
+    /* EOI has been sent, it is safe to switch to another process */
+    sched_preempt();
 }
 
 void pic_register_isr(uint8_t irq_line, pic_isr_t isr)
@@ -50,6 +50,9 @@ enum pit_port
 #define PIT_BASE_HZ 1193182
 #define PIT_RELOAD_MAX 65535
 
+/* Frequency of the system timer */
+#define TIMER_HZ 50
+
 /* PIT init function, set IRQ0 timer frequency */
 void pit_initialize(uint32_t hz);
 
@@ -5,6 +5,7 @@
 #include <kernel/elf.h>
 #include <kernel/idt.h>
 #include <kernel/gdt.h>
+#include <fs/fs.h>
 #include <mm/vmm.h>
 #include <mm/pmm.h>
 #include <mm/slab.h>
@@ -12,16 +13,23 @@
 #include <string.h>
 
 /*
- * Addresses of process's stacks.
- * Kernel stack address and user stack address should not be in the
- * same page directory entry.
+ * Address of process's kernel stack.
+ * Kernel stack address and user stack address(PROC_USER_STACK) should
+ * not be in the same page directory entry.
  */
 #define PROC_KERNEL_STACK (KERNEL_BASE - 16 * PAGE_SIZE)
-#define PROC_USER_STACK (KERNEL_BASE - 1024 * PAGE_SIZE)
 
 /* System call INT number */
 #define SYSCALL_INT_NUM 0x80
 
+/* Error code bits of page fault */
+enum page_fault_error
+{
+    PAGE_FAULT_PRESENT = 0x1,
+    PAGE_FAULT_WRITE = 0x2,
+    PAGE_FAULT_USER = 0x4,
+};
+
 static struct kmem_cache *proc_cache;
 
 /* PID bitmap */
@@ -30,6 +38,9 @@ static char pid_map[PROC_MAX_NUM / 8];
 /* PID generator */
 static pid_t pid_gen;
 
+/* Read only page shared by all untouched anonymous memory */
+static physical_addr_t zero_page;
+
 static pid_t alloc_pid()
 {
     for (uint32_t i = 0; i < PROC_MAX_NUM; ++i)
@@ -61,6 +72,12 @@ void proc_initialize()
 
     proc_cache = slab_create_kmem_cache(
         sizeof(struct process), sizeof(void *));
+
+    zero_page = pmm_alloc_page_address();
+    if (!zero_page)
+        panic("Zero page alloc fail");
+
+    memset(CAST_PHYSICAL_TO_VIRTUAL(zero_page), 0, PAGE_SIZE);
 }
 
 struct process * proc_alloc()
@@ -82,6 +99,30 @@ struct process * proc_alloc()
     return proc;
 }
 
+static inline void set_pde_populated(struct process *proc, uint32_t pde)
+{
+    proc->pde_map[pde / 32] |= 1u << (pde % 32);
+}
+
+/*
+ * Returns the first populated page directory entry index which is not less
+ * than pde, returns PROC_USER_PDE_NUM if there is no one.
+ */
+static uint32_t next_populated_pde(const struct process *proc, uint32_t pde)
+{
+    while (pde < PROC_USER_PDE_NUM)
+    {
+        uint32_t bits = proc->pde_map[pde / 32] >> (pde % 32);
+        if (bits)
+            return pde + __builtin_ctz(bits);
+
+        /* Skip the whole empty word */
+        pde = ALIGN(pde + 1, 32);
+    }
+
+    return PROC_USER_PDE_NUM;
+}
+
 void proc_free(struct process *proc)
 {
     /* Free virtual address space */
@@ -89,8 +130,9 @@ void proc_free(struct process *proc)
     {
         struct page_directory *page_dir = proc->page_dir;
 
-        /* Free all user space memory pages */
-        for (uint32_t pde = 0; pde < KERNEL_BASE / (NUM_PTE * PAGE_SIZE); ++pde)
+        /* Free all user space memory pages, skip empty regions */
+        for (uint32_t pde = next_populated_pde(proc, 0);
+             pde < PROC_USER_PDE_NUM; pde = next_populated_pde(proc, pde + 1))
         {
             struct page_table *page_tab =
                 vmm_unmap_page_table_index(page_dir, pde, 0);
@@ -101,14 +143,15 @@ void proc_free(struct process *proc)
                 {
                     physical_addr_t paddr =
                         vmm_unmap_page_index(page_tab, pte, 0);
-                    if (paddr != 0)
+                    if (paddr != 0 && paddr != zero_page)
                     {
                         pmm_free_page_address(paddr);
                         proc->mem_pages -= 1;
                     }
                 }
 
-                vmm_free_page_table(page_tab);
+                /* All entries have been unmapped */
+                vmm_free_clean_page_table(page_tab);
                 proc->mem_pages -= 1;
             }
         }
@@ -128,36 +171,146 @@ void proc_free(struct process *proc)
     slab_free(proc_cache, proc);
 }
 
+bool proc_map_page(struct process *proc, void *vaddr,
+                   physical_addr_t paddr, uint32_t flag)
+{
+    int extra_pages = vmm_map(proc->page_dir, vaddr, paddr, flag);
+
+    if (extra_pages < 0)
+        return false;
+
+    set_pde_populated(proc, VMM_PDE_INDEX(vaddr));
+    proc->mem_pages += extra_pages + 1;
+    return true;
+}
+
+bool proc_map_anonymous(struct process *proc, void *vaddr)
+{
+    int extra_pages = vmm_reserve(proc->page_dir, vaddr,
+                                  VMM_WRITABLE | VMM_USER | VMM_ANONYMOUS);
+
+    if (extra_pages < 0)
+        return false;
+
+    set_pde_populated(proc, VMM_PDE_INDEX(vaddr));
+    proc->mem_pages += extra_pages;
+    return true;
+}
+
+bool proc_page_fault(struct process *proc, void *vaddr, uint32_t error_code)
+{
+    uint32_t flag = 0;
+    physical_addr_t paddr = 0;
+    struct page_table *page_tab = NULL;
+
+    if ((uint32_t)vaddr >= KERNEL_BASE)
+        return false;
+
+    page_tab = vmm_get_page_table_index(proc->page_dir,
+                                        VMM_PDE_INDEX(vaddr), NULL);
+    if (!page_tab)
+        return false;
+
+    paddr = vmm_get_page_index(page_tab, VMM_PTE_INDEX(vaddr), &flag);
+    if (!(flag & VMM_ANONYMOUS))
+        return false;
+
+    if (!(error_code & PAGE_FAULT_WRITE))
+    {
+        /* Read untouched anonymous memory, map the shared zero page */
+        if (flag & VMM_PRESENT)
+            return false;
+
+        vmm_map_page(page_tab, vaddr, zero_page,
+                     (flag & ~VMM_WRITABLE) | VMM_USER);
+        return true;
+    }
+
+    if ((flag & VMM_PRESENT) && paddr != zero_page)
+        return false;
+
+    /*
+     * First write to anonymous memory, copy the zero page into a private
+     * page, the page fault has invalidated the stale TLB entry already.
+     */
+    paddr = pmm_alloc_page_address();
+    if (!paddr)
+        return false;
+
+    memset(CAST_PHYSICAL_TO_VIRTUAL(paddr), 0, PAGE_SIZE);
+    vmm_map_page(page_tab, vaddr, paddr,
+                 VMM_ANONYMOUS | VMM_WRITABLE | VMM_USER);
+    proc->mem_pages += 1;
+    return true;
+}
+
+bool proc_pin_user_page(struct process *proc, void *vaddr, bool write,
+                        physical_addr_t *paddr)
+{
+    uint32_t flag = 0;
+    struct page_table *page_tab = NULL;
+
+    if ((uint32_t)vaddr >= KERNEL_BASE)
+        return false;
+
+    page_tab = vmm_get_page_table_index(proc->page_dir,
+                                        VMM_PDE_INDEX(vaddr), NULL);
+    if (!page_tab)
+        return false;
+
+    vmm_get_page_index(page_tab, VMM_PTE_INDEX(vaddr), &flag);
+
+    if (!(flag & VMM_PRESENT) || (write && !(flag & VMM_WRITABLE)))
+    {
+        uint32_t error_code = PAGE_FAULT_USER;
+
+        if (write)
+            error_code |= PAGE_FAULT_WRITE;
+        if (flag & VMM_PRESENT)
+            error_code |= PAGE_FAULT_PRESENT;
+
+        if (!proc_page_fault(proc, vaddr, error_code))
+            return false;
+
+        /* The zero page may be in TLB, it is replaced by a private page */
+        if (flag & VMM_PRESENT)
+            set_cr3(CAST_VIRTUAL_TO_PHYSICAL(proc->page_dir));
+    }
+
+    *paddr = vmm_get_page_index(page_tab, VMM_PTE_INDEX(vaddr), &flag);
+    return (flag & VMM_USER) != 0;
+}
+
 static bool alloc_proc_stacks(struct process *proc)
 {
-    int extra_pages = 0;
     physical_addr_t stack = pmm_alloc_page_address();
     if (!stack) return false;
 
     /* Map kernel stack */
-    if ((extra_pages = vmm_map(proc->page_dir,
-                               (void *)(PROC_KERNEL_STACK - PAGE_SIZE),
-                               stack, VMM_WRITABLE)) < 0)
+    if (!proc_map_page(proc, (void *)(PROC_KERNEL_STACK - PAGE_SIZE),
+                       stack, VMM_WRITABLE))
     {
         pmm_free_page_address(stack);
         return false;
     }
 
-    proc->mem_pages += extra_pages + 1;
-
     stack = pmm_alloc_page_address();
     if (!stack) return false;
 
     /* Map user stack */
-    if ((extra_pages = vmm_map(proc->page_dir,
-                               (void *)(PROC_USER_STACK - PAGE_SIZE),
-                               stack, VMM_WRITABLE | VMM_USER)) < 0)
+    if (!proc_map_page(proc, (void *)(PROC_USER_STACK - PAGE_SIZE),
+                       stack, VMM_WRITABLE | VMM_USER))
     {
         pmm_free_page_address(stack);
         return false;
     }
 
-    proc->mem_pages += extra_pages + 1;
+    /* The rest of user stack is allocated when it is touched */
+    for (uint32_t i = 2; i <= PROC_USER_STACK_PAGES; ++i)
+    {
+        if (!proc_map_anonymous(proc, (void *)(PROC_USER_STACK - i * PAGE_SIZE)))
+            return false;
+    }
 
     /* Setup addresses */
     proc->kernel_stack = PROC_KERNEL_STACK;
@@ -219,8 +372,9 @@ static bool init_proc_from_proc(struct process *clone,
 
     clone->mem_pages += 1;
 
-    /* Copy user space */
-    for (uint32_t pde = 0; pde < KERNEL_BASE / (NUM_PTE * PAGE_SIZE); ++pde)
+    /* Copy user space, only the populated regions need to be copied */
+    for (uint32_t pde = next_populated_pde(proc, 0);
+         pde < PROC_USER_PDE_NUM; pde = next_populated_pde(proc, pde + 1))
     {
         uint32_t tab_flag = 0;
         struct page_table *page_tab =
@@ -237,6 +391,7 @@ static bool init_proc_from_proc(struct process *clone,
              * table to the cloned page table
              */
             vmm_map_page_table_index(clone->page_dir, pde, clone_tab, tab_flag);
+            set_pde_populated(clone, pde);
             clone->mem_pages += 1;
 
             for (uint32_t pte = 0; pte < NUM_PTE; ++pte)
@@ -245,7 +400,12 @@ static bool init_proc_from_proc(struct process *clone,
                 physical_addr_t page =
                     vmm_get_page_index(page_tab, pte, &page_flag);
 
-                if (page)
+                if (page == zero_page || !(page_flag & VMM_PRESENT))
+                {
+                    /* Share the zero page and untouched anonymous memory */
+                    clone_tab->entries[pte] = page_tab->entries[pte];
+                }
+                else if (page)
                 {
                     physical_addr_t clone_page = pmm_alloc_page_address();
                     if (!clone_page)
@@ -285,6 +445,7 @@ struct process * proc_clone(struct process *proc)
               clone->mem_pages, proc->mem_pages);
 
     clone->state = PROC_STATE_RUNNING;
+    clone->nice = proc->nice;
     clone->context = proc->context;
     clone->entry = proc->entry;
     clone->kernel_stack = proc->kernel_stack;
@@ -296,9 +457,33 @@ struct process * proc_clone(struct process *proc)
     return clone;
 }
 
+int proc_close_file(struct process *proc, int fd)
+{
+    int result = 0;
+
+    if (fd < 0 || fd >= PROC_MAX_FILE_NUM || proc->files[fd] == NULL)
+        return -1;
+
+    proc->files[fd]->f_refs -= 1;
+    if (proc->files[fd]->f_refs == 0)
+    {
+        result = vfs_close(proc->files[fd]);
+        vfs_free_file(proc->files[fd]);
+    }
+
+    proc->files[fd] = NULL;
+    return result;
+}
+
 void proc_exit(struct process *proc, int status)
 {
+    /* Files are closed so their delayed data is written back */
+    for (int fd = 0; fd < PROC_MAX_FILE_NUM; ++fd)
+    {
+        if (proc->files[fd])
+            proc_close_file(proc, fd);
+    }
+
     proc->status = status;
-    proc->state = PROC_STATE_DEAD;
-    sched();
+    sched_exit();
 }
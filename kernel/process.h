@@ -1,9 +1,7 @@
 #ifndef PROCESS_H
 #define PROCESS_H
 
-#include <stdbool.h>
-#include <stddef.h>
-#include <stdint.h>
+#include <kernel/base.h>
 
 struct file;
 typedef short pid_t;
@@ -12,6 +10,19 @@ typedef short pid_t;
 #define PROC_MAX_NUM 1024
 #define FLAGS_IF (1 << 9)
 
+/* Number of page directory entries of user space, each entry maps 4MB */
+#define PROC_USER_PDE_NUM (KERNEL_BASE / 0x400000)
+
+/*
+ * User stack grows down from its top, max pages of it are reserved below
+ * the top and allocated on demand except the top one. Program segments
+ * must end below the bottom.
+ */
+#define PROC_USER_STACK (KERNEL_BASE - 1024 * PAGE_SIZE)
+#define PROC_USER_STACK_PAGES 64
+#define PROC_USER_STACK_BOTTOM \
+    (PROC_USER_STACK - PROC_USER_STACK_PAGES * PAGE_SIZE)
+
 /* Kernel stack context of each process */
 struct kstack_context
 {
@@ -63,6 +74,7 @@ struct process
     pid_t pid;                      /* Process ID */
     char *name;                     /* Process name, NULL terminated string */
     enum proc_state state;          /* Process state */
+    int8_t nice;                    /* Scheduling priority */
     void *page_dir;                 /* Virtual address space of process */
     struct trap_frame *trap;        /* Pointer to trap frame on stack */
     struct kstack_context *context; /* Store the esp of stack */
@@ -72,10 +84,12 @@ struct process
     uint32_t syscall_retvalue;      /* Return value of syscall */
     uint32_t mem_pages;             /* Memory pages used by process */
     int status;                     /* The exit status */
-    void *sleep;                    /* Process sleep chain */
     struct process *parent;         /* Process's parent */
-    struct process *prev;           /* Previous process in list */
-    struct process *next;           /* Next process in list */
+    struct process *prev;           /* Previous process in run list */
+    struct process *next;           /* Next process in run list */
+
+    /* Bitmap of user page directory entries which have page table */
+    uint32_t pde_map[PROC_USER_PDE_NUM / 32];
 
     struct file *files[PROC_MAX_FILE_NUM];  /* Array of files */
 };
@@ -84,10 +98,45 @@ void proc_initialize();
 struct process * proc_alloc();
 void proc_free(struct process *proc);
 
+/*
+ * Map physical page into the user space of the process, account the
+ * memory pages used by the process, returns true when success.
+ */
+bool proc_map_page(struct process *proc, void *vaddr,
+                   physical_addr_t paddr, uint32_t flag);
+
+/*
+ * Reserve zero filled anonymous memory page in the user space of the
+ * process, the physical page is allocated on demand.
+ */
+bool proc_map_anonymous(struct process *proc, void *vaddr);
+
+/*
+ * Handle page fault of the process, returns true when the fault is
+ * resolved, the faulting instruction can be restarted.
+ */
+bool proc_page_fault(struct process *proc, void *vaddr, uint32_t error_code);
+
+/*
+ * Make the user page of vaddr present(writable if write is true) as a
+ * user access would, and get its physical address for DMA. User pages
+ * are never paged out, the page stays while the process is in kernel.
+ * Returns false if vaddr is not accessible user memory.
+ */
+bool proc_pin_user_page(struct process *proc, void *vaddr, bool write,
+                        physical_addr_t *paddr);
+
 bool proc_exec(const char *elf, size_t size);
 
 struct process * proc_clone(struct process *proc);
 
+/*
+ * Close the file descriptor of the process, the file is closed when its
+ * last reference is dropped. Returns 0 on success, -1 on failure.
+ */
+int proc_close_file(struct process *proc, int fd);
+
+/* Exit the process, its open files are closed */
 void proc_exit(struct process *proc, int status);
 
 #endif /* PROCESS_H */
@@ -2,6 +2,7 @@
 #include <kernel/klib.h>
 #include <kernel/gdt.h>
 #include <kernel/pic.h>
+#include <kernel/ktask.h>
 
 struct tss
 {
@@ -36,12 +37,81 @@ struct tss
 
 typedef void (*sched_task_t)(struct process *);
 
+/* Runnable processes of the same priority in round-robin order */
+struct run_list
+{
+    struct process *head;
+    struct process *tail;
+};
+
+/* Run queue, the bit i of bitmap is set when run list i is not empty */
+struct run_queue
+{
+    uint32_t bitmap;
+    struct run_list lists[SCHED_PRIORITY_NUM];
+};
+
 static struct kstack_context *sched_context;
 static struct tss tss;
 
-static struct process list_head;
+static struct run_queue run_queue;
+static struct process *dead_procs;
 static struct process *current_proc;
 static sched_task_t sched_task;
+static bool need_resched;
+static uint32_t ticks;
+
+static inline uint32_t proc_priority(const struct process *proc)
+{
+    return proc->nice - SCHED_NICE_MIN;
+}
+
+static void enqueue_proc(struct process *proc)
+{
+    uint32_t priority = proc_priority(proc);
+    struct run_list *list = &run_queue.lists[priority];
+
+    proc->next = NULL;
+    proc->prev = list->tail;
+
+    if (list->tail)
+        list->tail->next = proc;
+    else
+        list->head = proc;
+
+    list->tail = proc;
+    run_queue.bitmap |= 1u << priority;
+}
+
+static void dequeue_proc(struct process *proc)
+{
+    uint32_t priority = proc_priority(proc);
+    struct run_list *list = &run_queue.lists[priority];
+
+    if (proc->prev)
+        proc->prev->next = proc->next;
+    else
+        list->head = proc->next;
+
+    if (proc->next)
+        proc->next->prev = proc->prev;
+    else
+        list->tail = proc->prev;
+
+    proc->prev = proc->next = NULL;
+
+    if (!list->head)
+        run_queue.bitmap &= ~(1u << priority);
+}
+
+/* Pick the first process of the highest priority, returns NULL if none */
+static inline struct process * pick_next_proc()
+{
+    if (!run_queue.bitmap)
+        return NULL;
+
+    return run_queue.lists[__builtin_ctz(run_queue.bitmap)].head;
+}
 
 static inline void flush_tss()
 {
@@ -52,12 +122,11 @@ static inline void flush_tss()
 
 static void sched_timer()
 {
-    /*
-     * Send EOI first, because sched
-     * will run into the user space of a process
-     */
-    pic_send_eoi(IRQ0);
-    sched();
+    ++ticks;
+    ktask_timer();
+
+    /* Time slice is over, sched_preempt switches to the scheduler */
+    need_resched = true;
 }
 
 static void init_trap_frame(struct process *proc)
@@ -119,27 +188,20 @@ static void init_context(struct process *proc)
 
 void sched_initialize()
 {
-    list_head.prev = &list_head;
-    list_head.next = &list_head;
-
     flush_tss();
     pic_register_isr(IRQ0, sched_timer);
 }
 
 void sched_add(struct process *proc)
 {
-    proc->next = list_head.next;
-    proc->prev = list_head.next->prev;
-    list_head.next->prev = proc;
-    list_head.next = proc;
+    if (proc->state == PROC_STATE_RUNNING)
+        enqueue_proc(proc);
 }
 
 void sched_remove(struct process *proc)
 {
-    proc->prev->next = proc->next;
-    proc->next->prev = proc->prev;
-    proc->prev = NULL;
-    proc->next = NULL;
+    if (proc->state == PROC_STATE_RUNNING)
+        dequeue_proc(proc);
 }
 
 void sched()
@@ -147,6 +209,63 @@ void sched()
     switch_kcontext(&current_proc->context, sched_context);
 }
 
+void sched_sleep()
+{
+    struct process *proc = current_proc;
+
+    dequeue_proc(proc);
+    proc->state = PROC_STATE_IO;
+    sched();
+}
+
+void sched_wake_up(struct process *proc)
+{
+    if (proc->state == PROC_STATE_IO)
+    {
+        proc->state = PROC_STATE_RUNNING;
+        enqueue_proc(proc);
+
+        /* Run the woken up process first if its priority is higher */
+        if (current_proc && proc->nice < current_proc->nice)
+            need_resched = true;
+    }
+}
+
+void sched_preempt()
+{
+    if (current_proc && need_resched)
+        sched();
+}
+
+void sched_exit()
+{
+    struct process *proc = current_proc;
+
+    dequeue_proc(proc);
+    proc->state = PROC_STATE_DEAD;
+    sched();
+}
+
+int sched_nice(struct process *proc, int inc)
+{
+    int nice = 0;
+
+    /* Clamp inc first so the addition can not overflow */
+    inc = KMAX(-SCHED_PRIORITY_NUM, KMIN(SCHED_PRIORITY_NUM, inc));
+    nice = KMAX(SCHED_NICE_USER_MIN, KMIN(SCHED_NICE_MAX, proc->nice + inc));
+
+    if (nice != proc->nice)
+    {
+        /* Move to the run list of new priority */
+        bool runnable = proc->state == PROC_STATE_RUNNING;
+        if (runnable) dequeue_proc(proc);
+        proc->nice = nice;
+        if (runnable) enqueue_proc(proc);
+    }
+
+    return nice;
+}
+
 static void sched_task_fork(struct process *parent)
 {
     struct process *child = proc_clone(parent);
@@ -168,37 +287,41 @@ pid_t sched_fork()
     return (pid_t)current_proc->syscall_retvalue;
 }
 
+uint32_t sched_ticks()
+{
+    return ticks;
+}
+
 struct process * sched_get_running_proc()
 {
     return current_proc;
 }
 
+static void free_dead_procs()
+{
+    while (dead_procs)
+    {
+        struct process *dead = dead_procs;
+        dead_procs = dead->next;
+        dead->next = NULL;
+        proc_free(dead);
+    }
+}
+
 void scheduler()
 {
     for (;;)
     {
-        struct process *proc =
-            current_proc ? current_proc->next : list_head.next;
-
-        /* Find a runnable process */
-        while (proc == &list_head || proc->state != PROC_STATE_RUNNING)
-        {
-            if (proc != &list_head && proc->state == PROC_STATE_DEAD)
-            {
-                /* Release the dead process */
-                struct process *dead = proc;
-                proc = proc->next;
-                sched_remove(dead);
-                proc_free(dead);
-            }
-            else
-            {
-                proc = proc->next;
-            }
-        }
+        struct process *proc = NULL;
 
         close_int();
+
+        /* Idle, halt the CPU until an interrupt wakes up a process */
+        while (!(proc = pick_next_proc()))
+            wait_int();
+
         current_proc = proc;
+        need_resched = false;
 
         /* Update TSS */
         tss.ss0 = KERNEL_DATA_SELECTOR;
@@ -208,6 +331,9 @@ void scheduler()
         /* Change to process virtual address space */
         set_cr3(CAST_VIRTUAL_TO_PHYSICAL(proc->page_dir));
 
+        /* Release dead processes, their address spaces are not in use */
+        free_dead_procs();
+
         if (!proc->context)
             init_context(proc);
 
@@ -219,5 +345,20 @@ void scheduler()
             sched_task(current_proc);
             sched_task = NULL;
         }
+
+        /* No process is running in the scheduler */
+        current_proc = NULL;
+
+        if (proc->state == PROC_STATE_RUNNING)
+        {
+            /* Round-robin in the run list of the same priority */
+            dequeue_proc(proc);
+            enqueue_proc(proc);
+        }
+        else if (proc->state == PROC_STATE_DEAD)
+        {
+            proc->next = dead_procs;
+            dead_procs = proc;
+        }
     }
 }
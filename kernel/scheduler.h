@@ -3,6 +3,20 @@
 
 #include <kernel/process.h>
 
+/*
+ * Nice value range of processes, lower nice value is higher priority.
+ * Each nice value has its own run list.
+ */
+#define SCHED_NICE_MIN (-16)
+#define SCHED_NICE_MAX 15
+#define SCHED_PRIORITY_NUM (SCHED_NICE_MAX - SCHED_NICE_MIN + 1)
+
+/*
+ * User processes start at nice 0 and never go below it, higher priorities
+ * are left to kernel processes.
+ */
+#define SCHED_NICE_USER_MIN 0
+
 /* Initialize scheduler */
 void sched_initialize();
 
@@ -16,10 +30,38 @@ void sched_remove(struct process *proc);
 /* Schedule to scheduler */
 void sched();
 
+/*
+ * Put the running process to sleep, the process is removed from the run
+ * queue until sched_wake_up it.
+ */
+void sched_sleep();
+
+/* Put the sleeping process back on the run queue */
+void sched_wake_up(struct process *proc);
+
+/*
+ * Switch to the scheduler if the time slice of the running process is over
+ * or a higher priority process is woken up. Called when an interrupt
+ * is done.
+ */
+void sched_preempt();
+
+/* Running process exits, the scheduler releases it */
+void sched_exit();
+
+/*
+ * Add inc to the nice value of the user process, the result is clamped
+ * into [SCHED_NICE_USER_MIN, SCHED_NICE_MAX], returns the new nice value.
+ */
+int sched_nice(struct process *proc, int inc);
+
 /* Syscall fork */
 pid_t sched_fork();
 
-/* Get the running process */
+/* Get timer ticks since the scheduler initialized, TIMER_HZ ticks/second */
+uint32_t sched_ticks();
+
+/* Get the running process, returns NULL when the scheduler is running */
 struct process * sched_get_running_proc();
 
 /* Run the scheduler */
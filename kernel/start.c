@@ -5,6 +5,7 @@
 #include <kernel/pci.h>
 #include <kernel/ide.h>
 #include <kernel/bio.h>
+#include <kernel/iosched.h>
 #include <kernel/exception.h>
 #include <kernel/keyboard.h>
 #include <kernel/console.h>
@@ -71,6 +72,71 @@ static void test_exec()
     }
 }
 
+#ifdef TEST_BIO_BENCHMARK
+/*
+ * Benchmark of block IO cache, working set is 512 bios(2MB) of disk. It is
+ * built with make DEFINES=-DTEST_BIO_BENCHMARK.
+ */
+#define TEST_BIO_DEVICE 1
+#define TEST_BIO_WORKING_SET 512
+#define TEST_BIO_ROUNDS 16
+#define TEST_BIO_SECTORS (TEST_BIO_WORKING_SET * (PAGE_SIZE / SECTOR_SIZE))
+
+static uint32_t test_bio_read_working_set()
+{
+    uint32_t start = sched_ticks();
+
+    for (uint32_t i = 0; i < TEST_BIO_WORKING_SET; ++i)
+    {
+        struct bio *bio = bio_get(TEST_BIO_DEVICE, i * (PAGE_SIZE / SECTOR_SIZE));
+        bio_read(bio);
+        bio_release(bio);
+    }
+
+    return sched_ticks() - start;
+}
+
+/* Runs once, the task unregisters itself */
+static void test_bio_benchmark(void *data)
+{
+    struct kernel_task *task = data;
+    uint32_t cold = 0;
+    uint32_t warm = 0;
+    struct bio_stats stats;
+
+    ktask_unregister(task);
+
+    /* Block IO is used with interrupt closed */
+    close_int();
+
+    cold = test_bio_read_working_set();
+    for (uint32_t i = 0; i < TEST_BIO_ROUNDS; ++i)
+        warm += test_bio_read_working_set();
+
+    bio_get_stats(&stats);
+    printk("[%-8s] %u bios: cold %u ticks, %u cached rounds %u ticks, "
+           "hits %u, misses %u\n", "Test", TEST_BIO_WORKING_SET, cold,
+           TEST_BIO_ROUNDS, warm, stats.hits, stats.misses);
+
+    start_int();
+}
+
+static void test_install_bio_benchmark()
+{
+    static struct kernel_task task = { test_bio_benchmark, &task, NULL, NULL };
+
+    if (iosched_get_capacity(TEST_BIO_DEVICE) < TEST_BIO_SECTORS)
+    {
+        printk("[%-8s] no disk %u for bio benchmark\n", "Test",
+               TEST_BIO_DEVICE);
+        return ;
+    }
+
+    ktask_register(&task);
+    ktask_wake_up();
+}
+#endif /* TEST_BIO_BENCHMARK */
+
 void init_paging(physical_addr_t bi)
 {
     struct boot_info *binfo = (void *)bi;
@@ -103,10 +169,11 @@ void kernel_entry()
     gdt_initialize();
     idt_initialize();
     pic_initialize();
-    pit_initialize(50);
+    pit_initialize(TIMER_HZ);
     kbd_initialize();
     excep_initialize();
     pci_initialize();
+    iosched_initialize();
     bio_initialize();
     vfs_initialize();
     proc_initialize();
@@ -119,6 +186,9 @@ void kernel_entry()
     printk("[%-8s] success!\n\n", "Entry");
 
     test_install_keyboard();
+#ifdef TEST_BIO_BENCHMARK
+    test_install_bio_benchmark();
+#endif
     test_exec();
     scheduler();
 }
@@ -76,24 +76,14 @@ static uint32_t sys_open(va_list ap)
 static uint32_t sys_close(va_list ap)
 {
     int fd = va_arg(ap, int);
-    struct process *proc = NULL;
-
-    if (fd < 0 || fd >= PROC_MAX_FILE_NUM)
-        return -1;
-
-    proc = sched_get_running_proc();
-    if (proc->files[fd] == NULL)
-        return -1;
-
-    proc->files[fd]->f_refs -= 1;
-    if (proc->files[fd]->f_refs == 0)
-    {
-        vfs_close(proc->files[fd]);
-        vfs_free_file(proc->files[fd]);
-    }
+    return proc_close_file(sched_get_running_proc(), fd);
+}
 
-    proc->files[fd] = NULL;
-    return 0;
+/* Check the buffer of a system call is all in user space */
+static bool user_buffer(const void *buffer, size_t bytes)
+{
+    return (uint32_t)buffer < KERNEL_BASE &&
+        bytes <= KERNEL_BASE - (uint32_t)buffer;
 }
 
 static uint32_t sys_read(va_list ap)
@@ -106,7 +96,7 @@ static uint32_t sys_read(va_list ap)
     if (fd < 0 || fd >= PROC_MAX_FILE_NUM)
         return -1;
 
-    if (proc->files[fd] == NULL)
+    if (proc->files[fd] == NULL || !user_buffer(buffer, bytes))
         return -1;
 
     return vfs_read(proc->files[fd], buffer, bytes);
@@ -122,12 +112,24 @@ static uint32_t sys_write(va_list ap)
     if (fd < 0 || fd >= PROC_MAX_FILE_NUM)
         return -1;
 
-    if (proc->files[fd] == NULL)
+    if (proc->files[fd] == NULL || !user_buffer(data, bytes))
         return -1;
 
     return vfs_write(proc->files[fd], data, bytes);
 }
 
+static uint32_t sys_nice(va_list ap)
+{
+    int inc = va_arg(ap, int);
+    return (uint32_t)sched_nice(sched_get_running_proc(), inc);
+}
+
+static uint32_t sys_sync(va_list ap)
+{
+    (void)ap;
+    return vfs_sync();
+}
+
 static syscall_t syscalls[] =
 {
     sys_prints,
@@ -137,7 +139,9 @@ static syscall_t syscalls[] =
     sys_open,
     sys_close,
     sys_read,
-    sys_write
+    sys_write,
+    sys_nice,
+    sys_sync
 };
 
 void syscall(struct trap_frame *trap)
@@ -0,0 +1,478 @@
+#include <kernel/virtio_blk.h>
+#include <kernel/iosched.h>
+#include <kernel/klib.h>
+#include <kernel/pic.h>
+#include <mm/pmm.h>
+
+#define VIRTIO_BLK_MAX_DEVICES 4
+
+/* Legacy virtio PCI registers, offset of IO port base */
+enum virtio_register
+{
+    VIRTIO_REGISTER_DEVICE_FEATURES = 0x0,
+    VIRTIO_REGISTER_GUEST_FEATURES = 0x4,
+    VIRTIO_REGISTER_QUEUE_ADDRESS = 0x8,
+    VIRTIO_REGISTER_QUEUE_SIZE = 0xc,
+    VIRTIO_REGISTER_QUEUE_SELECT = 0xe,
+    VIRTIO_REGISTER_QUEUE_NOTIFY = 0x10,
+    VIRTIO_REGISTER_DEVICE_STATUS = 0x12,
+    VIRTIO_REGISTER_ISR_STATUS = 0x13,
+    VIRTIO_REGISTER_BLK_CAPACITY = 0x14,
+};
+
+enum virtio_status
+{
+    VIRTIO_STATUS_ACKNOWLEDGE = 0x1,
+    VIRTIO_STATUS_DRIVER = 0x2,
+    VIRTIO_STATUS_DRIVER_OK = 0x4,
+    VIRTIO_STATUS_FAILED = 0x80,
+};
+
+enum virtio_isr
+{
+    VIRTIO_ISR_QUEUE = 0x1,
+};
+
+enum virtio_blk_feature
+{
+    VIRTIO_BLK_F_RO = 1 << 5,
+};
+
+enum virtio_blk_type
+{
+    VIRTIO_BLK_T_IN = 0,
+    VIRTIO_BLK_T_OUT = 1,
+};
+
+#define VIRTIO_BLK_S_OK 0
+
+/* Legacy virtqueue is aligned with 4KB, the used ring starts at a page */
+#define VRING_ALIGN PAGE_SIZE
+
+enum vring_desc_flag
+{
+    VRING_DESC_F_NEXT = 0x1,
+    VRING_DESC_F_WRITE = 0x2,       /* Device writes the buffer */
+};
+
+#define VRING_USED_F_NO_NOTIFY 0x1
+
+struct vring_desc
+{
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+};
+
+struct vring_avail
+{
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[];
+};
+
+struct vring_used_elem
+{
+    uint32_t id;                    /* Head descriptor of the chain */
+    uint32_t len;
+};
+
+struct vring_used
+{
+    uint16_t flags;
+    uint16_t idx;
+    struct vring_used_elem ring[];
+};
+
+/* Request is referenced by its header descriptor, header is the first */
+struct blk_request
+{
+    struct
+    {
+        uint32_t type;
+        uint32_t reserved;
+        uint64_t sector;
+    } header;
+
+    uint8_t status;                 /* Written by device */
+    uint8_t write;
+    struct ide_dma_io io;
+    struct blk_request *next;       /* Free list or waiting list */
+};
+
+struct device
+{
+    uint16_t iobase;
+    uint8_t dev;                    /* Device number of IO scheduler */
+    uint8_t read_only;
+    uint64_t sectors;               /* Total sectors */
+
+    /* Split virtqueue */
+    uint16_t queue_size;
+    uint16_t free_head;             /* Free descriptors list */
+    uint16_t num_free;
+    uint16_t avail_idx;             /* Next index of available ring */
+    uint16_t last_used;             /* Next index of used ring to handle */
+    bool need_kick;                 /* Available ring is updated */
+    volatile struct vring_desc *desc;
+    volatile struct vring_avail *avail;
+    volatile struct vring_used *used;
+
+    struct blk_request *free_requests;
+    struct blk_request *waiting;    /* Requests waiting for descriptors */
+    struct blk_request *waiting_tail;
+};
+
+static struct device devices[VIRTIO_BLK_MAX_DEVICES];
+static uint32_t device_count;
+static struct device *dev_devices[IOSCHED_MAX_DEVICES];
+
+static inline uint16_t descriptors_of(const struct blk_request *req)
+{
+    /* Header, data segments and status */
+    return (req->io.segments ? req->io.segment_count : 1) + 2;
+}
+
+static void fill_desc(struct device *d, uint16_t index, physical_addr_t addr,
+                      uint32_t len, uint16_t flags)
+{
+    d->desc[index].addr = addr;
+    d->desc[index].len = len;
+    d->desc[index].flags = flags;
+}
+
+/* Put request into available ring, descriptors should be enough */
+static void add_request(struct device *d, struct blk_request *req)
+{
+    const struct ide_dma_io *io = &req->io;
+    uint16_t data_flags = VRING_DESC_F_NEXT |
+        (req->write ? 0 : VRING_DESC_F_WRITE);
+    uint16_t head = d->free_head;
+    uint16_t index = head;
+
+    /* Free descriptors are chained by next, take them in order */
+    fill_desc(d, index, CAST_VIRTUAL_TO_PHYSICAL(&req->header),
+              sizeof(req->header), VRING_DESC_F_NEXT);
+    index = d->desc[index].next;
+
+    if (io->segments)
+    {
+        for (uint32_t i = 0; i < io->segment_count; ++i)
+        {
+            fill_desc(d, index, io->segments[i].addr,
+                      io->segments[i].size, data_flags);
+            index = d->desc[index].next;
+        }
+    }
+    else
+    {
+        fill_desc(d, index, io->buffer, io->size, data_flags);
+        index = d->desc[index].next;
+    }
+
+    fill_desc(d, index, CAST_VIRTUAL_TO_PHYSICAL(&req->status),
+              sizeof(req->status), VRING_DESC_F_WRITE);
+
+    d->free_head = d->desc[index].next;
+    d->num_free -= descriptors_of(req);
+
+    /* Device sees the descriptors before the index */
+    d->avail->ring[d->avail_idx % d->queue_size] = head;
+    d->avail->idx = ++d->avail_idx;
+    d->need_kick = true;
+}
+
+static void free_desc_chain(struct device *d, uint16_t head)
+{
+    uint16_t index = head;
+    uint16_t count = 1;
+
+    while (d->desc[index].flags & VRING_DESC_F_NEXT)
+    {
+        index = d->desc[index].next;
+        ++count;
+    }
+
+    d->desc[index].next = d->free_head;
+    d->free_head = head;
+    d->num_free += count;
+}
+
+/* Submit waiting requests in order while there are enough descriptors */
+static void submit_waiting(struct device *d)
+{
+    while (d->waiting && descriptors_of(d->waiting) <= d->num_free)
+    {
+        struct blk_request *req = d->waiting;
+        d->waiting = req->next;
+        if (!d->waiting)
+            d->waiting_tail = NULL;
+
+        add_request(d, req);
+    }
+}
+
+static void kick(uint8_t dev)
+{
+    struct device *d = dev_devices[dev];
+
+    /* One notification for all requests added since the last one */
+    if (d->need_kick && !(d->used->flags & VRING_USED_F_NO_NOTIFY))
+        out_word(d->iobase + VIRTIO_REGISTER_QUEUE_NOTIFY, 0);
+
+    d->need_kick = false;
+}
+
+static void handle_used(struct device *d)
+{
+    while (d->last_used != d->used->idx)
+    {
+        volatile struct vring_used_elem *elem =
+            &d->used->ring[d->last_used % d->queue_size];
+        uint16_t head = elem->id;
+        struct blk_request *req = CAST_PHYSICAL_TO_VIRTUAL(
+            (physical_addr_t)d->desc[head].addr);
+        struct ide_dma_io io = req->io;
+        bool error = req->status != VIRTIO_BLK_S_OK;
+
+        ++d->last_used;
+        free_desc_chain(d, head);
+
+        req->next = d->free_requests;
+        d->free_requests = req;
+
+        /* Earlier requests get freed descriptors first */
+        submit_waiting(d);
+        io.complete_func(&io, error);
+    }
+
+    kick(d->dev);
+}
+
+static void irq_isr()
+{
+    for (uint32_t i = 0; i < device_count; ++i)
+    {
+        struct device *d = &devices[i];
+
+        /* Reading ISR status acknowledges the interrupt */
+        if (in_byte(d->iobase + VIRTIO_REGISTER_ISR_STATUS) & VIRTIO_ISR_QUEUE)
+            handle_used(d);
+    }
+}
+
+static void check_io(const struct ide_dma_io *io, bool write)
+{
+    struct device *d = NULL;
+    size_t size = 0;
+
+    if (io->drive >= IOSCHED_MAX_DEVICES || !dev_devices[io->drive])
+        panic("[VIRTIO] - device not exist, device no: %d.", io->drive);
+
+    d = dev_devices[io->drive];
+    if (io->start >= d->sectors || d->sectors - io->start < io->sector_count)
+        panic("[VIRTIO] - out of sector's range, total sectors: %u, start: %u, count: %u.",
+              (uint32_t)d->sectors, (uint32_t)io->start, io->sector_count);
+
+    if (write && d->read_only)
+        panic("[VIRTIO] - write read only device: %d.", io->drive);
+
+    if (io->segments)
+    {
+        for (uint32_t i = 0; i < io->segment_count; ++i)
+            size += io->segments[i].size;
+    }
+    else
+    {
+        size = io->size;
+    }
+
+    if (io->sector_count == 0 || size != io->sector_count * SECTOR_SIZE)
+        panic("[VIRTIO] - io size(%u) != 512 * sector_count(%u).",
+              size, io->sector_count);
+
+    if (io->segments && io->segment_count + 2 > d->queue_size)
+        panic("[VIRTIO] - too many segments: %u.", io->segment_count);
+}
+
+static void blk_io_sectors(const struct ide_dma_io *io, bool write)
+{
+    struct device *d = NULL;
+    struct blk_request *req = NULL;
+
+    check_io(io, write);
+    d = dev_devices[io->drive];
+
+    /* IO scheduler dispatches at most depth requests */
+    req = d->free_requests;
+    if (!req)
+        panic("[VIRTIO] - no free request of device %d.", io->drive);
+    d->free_requests = req->next;
+
+    req->header.type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+    req->header.reserved = 0;
+    req->header.sector = io->start;
+    req->status = 0xff;
+    req->write = write;
+    req->io = *io;
+    req->next = NULL;
+
+    /* Device is notified by kick after the batch */
+    if (!d->waiting && descriptors_of(req) <= d->num_free)
+    {
+        add_request(d, req);
+    }
+    else
+    {
+        if (d->waiting_tail)
+            d->waiting_tail->next = req;
+        else
+            d->waiting = req;
+        d->waiting_tail = req;
+    }
+}
+
+static void virtio_blk_read_sectors(const struct ide_dma_io *io)
+{
+    blk_io_sectors(io, false);
+}
+
+static void virtio_blk_write_sectors(const struct ide_dma_io *io)
+{
+    blk_io_sectors(io, true);
+}
+
+/* Alloc and register the virtqueue 0, returns false if failed */
+static bool setup_queue(struct device *d)
+{
+    uint32_t size = 0;
+    uint32_t order = 0;
+    physical_addr_t queue = 0;
+    char *base = NULL;
+
+    out_word(d->iobase + VIRTIO_REGISTER_QUEUE_SELECT, 0);
+    d->queue_size = in_word(d->iobase + VIRTIO_REGISTER_QUEUE_SIZE);
+    if (d->queue_size == 0)
+        return false;
+
+    /* Descriptors and available ring, and then used ring at next page */
+    size = ALIGN(sizeof(struct vring_desc) * d->queue_size +
+                 sizeof(uint16_t) * (3 + d->queue_size), VRING_ALIGN) +
+        ALIGN(sizeof(uint16_t) * 3 +
+              sizeof(struct vring_used_elem) * d->queue_size, VRING_ALIGN);
+
+    while ((uint32_t)(PAGE_SIZE << order) < size)
+        ++order;
+
+    queue = pmm_alloc_pages_address(order);
+    if (!queue)
+        panic("[VIRTIO] - alloc virtqueue failed.");
+
+    base = CAST_PHYSICAL_TO_VIRTUAL(queue);
+    for (uint32_t i = 0; i < size; ++i)
+        base[i] = 0;
+
+    d->desc = (void *)base;
+    d->avail = (void *)(base + sizeof(struct vring_desc) * d->queue_size);
+    d->used = (void *)(base + ALIGN(sizeof(struct vring_desc) * d->queue_size +
+                                    sizeof(uint16_t) * (3 + d->queue_size),
+                                    VRING_ALIGN));
+
+    /* All descriptors are free */
+    for (uint16_t i = 0; i < d->queue_size; ++i)
+        d->desc[i].next = i + 1;
+    d->free_head = 0;
+    d->num_free = d->queue_size;
+    d->avail_idx = 0;
+    d->last_used = 0;
+
+    out_dword(d->iobase + VIRTIO_REGISTER_QUEUE_ADDRESS, queue / PAGE_SIZE);
+    return true;
+}
+
+/* Alloc requests in one page, returns the number of requests */
+static uint32_t setup_requests(struct device *d)
+{
+    struct blk_request *reqs = cast_p2v_or_null(pmm_alloc_page_address());
+    uint32_t count = PAGE_SIZE / sizeof(struct blk_request);
+
+    if (!reqs)
+        panic("[VIRTIO] - alloc requests failed.");
+
+    d->free_requests = NULL;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        reqs[i].next = d->free_requests;
+        d->free_requests = &reqs[i];
+    }
+
+    d->waiting = d->waiting_tail = NULL;
+    return count;
+}
+
+void virtio_blk_initialize(uint16_t iobase, uint8_t irq)
+{
+    static const struct iosched_driver driver =
+    {
+        "VirtIO", virtio_blk_read_sectors, virtio_blk_write_sectors, kick
+    };
+
+    struct device *d = NULL;
+    uint32_t features = 0;
+    uint32_t depth = 0;
+    int dev = 0;
+
+    printk("[%-8s] find virtio block device:\n", "VirtIO");
+
+    if (device_count == VIRTIO_BLK_MAX_DEVICES)
+    {
+        printk("[%-8s] too many devices.\n", "VirtIO");
+        return ;
+    }
+
+    d = &devices[device_count];
+    d->iobase = iobase;
+
+    /* Reset device, and then tell it a driver is found */
+    out_byte(iobase + VIRTIO_REGISTER_DEVICE_STATUS, 0);
+    out_byte(iobase + VIRTIO_REGISTER_DEVICE_STATUS,
+             VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+
+    /* No optional features are used */
+    features = in_dword(iobase + VIRTIO_REGISTER_DEVICE_FEATURES);
+    out_dword(iobase + VIRTIO_REGISTER_GUEST_FEATURES, 0);
+    d->read_only = (features & VIRTIO_BLK_F_RO) ? 1 : 0;
+
+    d->sectors = in_dword(iobase + VIRTIO_REGISTER_BLK_CAPACITY) |
+        ((uint64_t)in_dword(iobase + VIRTIO_REGISTER_BLK_CAPACITY + 4) << 32);
+
+    if (!setup_queue(d))
+    {
+        out_byte(iobase + VIRTIO_REGISTER_DEVICE_STATUS, VIRTIO_STATUS_FAILED);
+        printk("[%-8s] no virtqueue.\n", "VirtIO");
+        return ;
+    }
+
+    depth = KMIN(setup_requests(d), d->queue_size);
+    dev = iosched_add_device(&driver, depth, d->sectors, -1);
+    if (dev < 0)
+    {
+        out_byte(iobase + VIRTIO_REGISTER_DEVICE_STATUS, VIRTIO_STATUS_FAILED);
+        printk("[%-8s] no free device number.\n", "VirtIO");
+        return ;
+    }
+
+    d->dev = dev;
+    dev_devices[dev] = d;
+    ++device_count;
+
+    /* IO completion is handled in IRQ ISR */
+    pic_register_isr(irq, irq_isr);
+    out_byte(iobase + VIRTIO_REGISTER_DEVICE_STATUS, VIRTIO_STATUS_ACKNOWLEDGE |
+             VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+
+    printk("  [VIRTIO%u] dev %d, %u bytes, queue size %u, depth %u%s\n",
+           device_count - 1, dev, (uint32_t)(d->sectors * SECTOR_SIZE),
+           d->queue_size, depth, d->read_only ? ", read only" : "");
+}
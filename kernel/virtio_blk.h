@@ -0,0 +1,13 @@
+#ifndef VIRTIO_BLK_H
+#define VIRTIO_BLK_H
+
+#include <stdint.h>
+
+/*
+ * Init legacy virtio block device, iobase is the IO port base of BAR0,
+ * irq is the IRQ line of the device. The device is added to the IO
+ * scheduler as a block device.
+ */
+void virtio_blk_initialize(uint16_t iobase, uint8_t irq);
+
+#endif /* VIRTIO_BLK_H */
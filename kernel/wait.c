@@ -0,0 +1,77 @@
+#include <kernel/wait.h>
+#include <kernel/scheduler.h>
+
+void wait_queue_init(struct wait_queue *wq)
+{
+    wq->head.proc = NULL;
+    wq->head.exclusive = false;
+    wq->head.prev = &wq->head;
+    wq->head.next = &wq->head;
+}
+
+static inline void insert_after(struct wait_entry *pos,
+                                struct wait_entry *entry)
+{
+    entry->prev = pos;
+    entry->next = pos->next;
+    pos->next->prev = entry;
+    pos->next = entry;
+}
+
+static inline void remove_entry(struct wait_entry *entry)
+{
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    entry->prev = entry->next = NULL;
+}
+
+static void sleep_on(struct wait_queue *wq, bool exclusive)
+{
+    struct wait_entry entry;
+
+    entry.proc = sched_get_running_proc();
+    entry.exclusive = exclusive;
+
+    /* Exclusive waiters at tail, others at head */
+    if (exclusive)
+        insert_after(wq->head.prev, &entry);
+    else
+        insert_after(&wq->head, &entry);
+
+    /* The waker removes the entry from the queue */
+    sched_sleep();
+}
+
+void wait_queue_sleep(struct wait_queue *wq)
+{
+    sleep_on(wq, false);
+}
+
+void wait_queue_sleep_exclusive(struct wait_queue *wq)
+{
+    sleep_on(wq, true);
+}
+
+static bool wake_up_entry(struct wait_entry *entry)
+{
+    bool exclusive = entry->exclusive;
+
+    remove_entry(entry);
+    sched_wake_up(entry->proc);
+    return exclusive;
+}
+
+void wait_queue_wake_one(struct wait_queue *wq)
+{
+    while (!wait_queue_empty(wq))
+    {
+        if (wake_up_entry(wq->head.next))
+            break;
+    }
+}
+
+void wait_queue_wake_all(struct wait_queue *wq)
+{
+    while (!wait_queue_empty(wq))
+        wake_up_entry(wq->head.next);
+}
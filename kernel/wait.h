@@ -0,0 +1,52 @@
+#ifndef WAIT_H
+#define WAIT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct process;
+
+/* Wait entry of a sleeping process, it lives on the process kernel stack */
+struct wait_entry
+{
+    struct process *proc;       /* Sleeping process */
+    bool exclusive;             /* Exclusive waiter */
+    struct wait_entry *prev;
+    struct wait_entry *next;
+};
+
+/*
+ * Queue of sleeping processes. Non-exclusive waiters are in front of
+ * exclusive waiters, so a wake up walks the queue from head.
+ */
+struct wait_queue
+{
+    struct wait_entry head;     /* Sentry node */
+};
+
+#define WAIT_QUEUE_INIT(wq) { { NULL, false, &(wq).head, &(wq).head } }
+
+void wait_queue_init(struct wait_queue *wq);
+
+static inline bool wait_queue_empty(const struct wait_queue *wq)
+{
+    return wq->head.next == &wq->head;
+}
+
+/*
+ * Put the running process to sleep on the wait queue until it is woken up.
+ * Callers close interrupt as lock, and check their wait condition again
+ * when it returns.
+ */
+void wait_queue_sleep(struct wait_queue *wq);
+
+/* Same as wait_queue_sleep, but wait_queue_wake_one wakes one of them */
+void wait_queue_sleep_exclusive(struct wait_queue *wq);
+
+/* Wake up all non-exclusive waiters and the first exclusive waiter */
+void wait_queue_wake_one(struct wait_queue *wq);
+
+/* Wake up all waiters */
+void wait_queue_wake_all(struct wait_queue *wq);
+
+#endif /* WAIT_H */
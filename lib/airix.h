@@ -54,4 +54,17 @@ int read(int fd, void *buf, size_t nbyte);
  */
 int write(int fd, const void *buf, size_t nbyte);
 
+/*
+ * Add inc to the nice value of the calling process, a lower nice value
+ * is a higher scheduling priority. The nice value is limited in [0, 15].
+ * Returns the new nice value.
+ */
+int nice(int inc);
+
+/*
+ * Write cached data of all files to disk.
+ * If successful, returns 0, returns -1 on failure.
+ */
+int sync();
+
 #endif /* AIRIX_H */
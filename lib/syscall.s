@@ -18,3 +18,5 @@ syscall 4, open
 syscall 5, close
 syscall 6, read
 syscall 7, write
+syscall 8, nice
+syscall 9, sync
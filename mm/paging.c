@@ -4,6 +4,10 @@
 
 static struct page_directory *pg_dir;
 
+/* Page tables of IO window and the next free address in the window */
+static struct page_table *io_page_tables[PG_IO_SIZE / (NUM_PTE * PAGE_SIZE)];
+static uint32_t io_next = PG_IO_BASE;
+
 physical_addr_t pg_init_paging(physical_addr_t page_aligned_free)
 {
     struct page_directory *page_dir;
@@ -51,6 +55,10 @@ physical_addr_t pg_complete_paging(physical_addr_t page_aligned_free,
     uint64_t physical_addr = NUM_PTE * PAGE_SIZE;
     uint64_t max_physical_addr = pmm_max_physical_address(entries, num);
 
+    /* Physical memory should not overlap IO window */
+    max_physical_addr = KMIN(max_physical_addr,
+                             (uint64_t)VIRTUAL_TO_PHYSICAL(PG_IO_BASE));
+
     /* Clear virtual address's [0, 4MB) to physical address's [0, 4MB) map */
     pg_dir->entries[0] = VMM_WRITABLE;
 
@@ -76,12 +84,52 @@ physical_addr_t pg_complete_paging(physical_addr_t page_aligned_free,
         page_aligned_free += PAGE_SIZE;
     }
 
+    /*
+     * Install empty paging tables for IO window, so the window is shared
+     * by all processes which copy kernel space.
+     */
+    for (uint32_t i = 0; i < ARRAY_SIZE(io_page_tables); ++i)
+    {
+        uint32_t virtual_addr = PG_IO_BASE + i * NUM_PTE * PAGE_SIZE;
+        struct page_table *pg_tab = CAST_PHYSICAL_TO_VIRTUAL(page_aligned_free);
+
+        for (uint32_t j = 0; j < NUM_PTE; ++j)
+            pg_tab->entries[j] = VMM_WRITABLE;
+
+        pg_dir->entries[VMM_PDE_INDEX((void *)virtual_addr)] =
+            (pde_t)CAST_VIRTUAL_TO_PHYSICAL(pg_tab)
+            | VMM_WRITABLE | VMM_PRESENT;
+
+        io_page_tables[i] = pg_tab;
+        page_aligned_free += PAGE_SIZE;
+    }
+
     /* Refresh paging directory */
     set_cr3(CAST_VIRTUAL_TO_PHYSICAL(pg_dir));
 
     return page_aligned_free;
 }
 
+void * pg_map_io(physical_addr_t paddr, size_t size)
+{
+    physical_addr_t start = paddr & ~(PAGE_SIZE - 1);
+    uint32_t pages = ALIGN_PAGE(paddr + size - start) / PAGE_SIZE;
+    uint32_t vaddr = io_next;
+
+    if (size == 0 || pages > (PG_IO_SIZE - (io_next - PG_IO_BASE)) / PAGE_SIZE)
+        return NULL;
+
+    for (uint32_t i = 0; i < pages; ++i, io_next += PAGE_SIZE)
+    {
+        uint32_t index = (io_next - PG_IO_BASE) / (NUM_PTE * PAGE_SIZE);
+        vmm_map_page(io_page_tables[index], (void *)io_next,
+                     start + i * PAGE_SIZE, VMM_WRITABLE |
+                     VMM_WRITE_THROUGH | VMM_CACHE_DISABLE);
+    }
+
+    return (void *)(vaddr + (paddr - start));
+}
+
 void pg_copy_kernel_space(struct page_directory *vaddr_space)
 {
     uint32_t kpde_start = VMM_PDE_INDEX((void *)KERNEL_BASE);
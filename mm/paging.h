@@ -5,6 +5,13 @@
 #include <mm/vmm.h>
 #include <kernel/base.h>
 
+/*
+ * Virtual address window for memory mapped IO, physical memory is mapped
+ * into kernel space below it.
+ */
+#define PG_IO_BASE 0xFF800000
+#define PG_IO_SIZE 0x800000
+
 /*
  * Init paging, the first step.
  * Returns the next free physical address.
@@ -25,4 +32,11 @@ physical_addr_t pg_complete_paging(physical_addr_t page_aligned_free,
  */
 void pg_copy_kernel_space(struct page_directory *vaddr_space);
 
+/*
+ * Map the memory mapped IO registers [paddr, paddr + size) into the IO
+ * window with cache disabled. Returns the virtual address of paddr, or
+ * NULL if the IO window is used up.
+ */
+void * pg_map_io(physical_addr_t paddr, size_t size);
+
 #endif /* PAGING_H */
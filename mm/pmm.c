@@ -52,6 +52,9 @@ struct free_blocks
 };
 
 static struct boot_allocator boot_allocator;
+static pmm_reclaim_func_t reclaims[PMM_MAX_RECLAIMS];
+static uint32_t num_reclaims;
+static bool reclaiming;
 static struct page *pages;
 static struct free_blocks *free_blocks;
 static const uint32_t order_pages[BUDDY_MAX_ORDER] =
@@ -232,7 +235,7 @@ static uint32_t alloc_block(uint32_t free_order, uint32_t order)
     return block - pages;
 }
 
-uint32_t pmm_alloc_pages(uint32_t order)
+static uint32_t alloc_pages(uint32_t order)
 {
     for (uint32_t check = order; check < BUDDY_MAX_ORDER; ++check)
     {
@@ -248,6 +251,47 @@ uint32_t pmm_alloc_pages(uint32_t order)
     return 0;
 }
 
+static uint32_t reclaim_pages(uint32_t pages)
+{
+    uint32_t freed = 0;
+
+    /* Reclaim functions free pages, they never alloc pages again */
+    if (reclaiming)
+        return 0;
+
+    reclaiming = true;
+    for (uint32_t i = 0; i < num_reclaims && freed < pages; ++i)
+        freed += reclaims[i](pages - freed);
+    reclaiming = false;
+
+    return freed;
+}
+
+void pmm_register_reclaim(pmm_reclaim_func_t func)
+{
+    if (num_reclaims == PMM_MAX_RECLAIMS)
+        panic("[PMM] - too many reclaim functions.");
+    reclaims[num_reclaims++] = func;
+}
+
+uint32_t pmm_alloc_pages(uint32_t order)
+{
+    uint32_t need = order_pages[order] + PMM_LOW_PAGES;
+    uint32_t page_num = 0;
+
+    /* Keep the last free pages, reclaim cached pages before using them */
+    if (free_blocks->num_pages < need)
+        reclaim_pages(need - free_blocks->num_pages);
+
+    page_num = alloc_pages(order);
+
+    /* No free block large enough, it may be merged after reclaiming */
+    if (!page_num && reclaim_pages(order_pages[order]) > 0)
+        page_num = alloc_pages(order);
+
+    return page_num;
+}
+
 void pmm_free_pages(uint32_t page_num, uint32_t order)
 {
     struct page *block = &pages[page_num];
@@ -362,6 +406,11 @@ uint64_t pmm_max_physical_address(struct mmap_entry *entries, uint32_t num)
     return get_max_physical_address(entries, num);
 }
 
+uint32_t pmm_num_free_pages()
+{
+    return free_blocks->num_pages;
+}
+
 void pmm_print_statistics(struct mmap_entry *entries, uint32_t num)
 {
     if (entries)
@@ -29,6 +29,10 @@ enum pmm_mm_entry_type
 #define BUDDY_MAX_ORDER 11
 #define MEM_ALIGNMENT 4
 
+/* Reclaim functions are called when free pages are lower than it */
+#define PMM_LOW_PAGES 256
+#define PMM_MAX_RECLAIMS 4
+
 #define PAGE_SIZE 4096
 #define PAGE_NUMBER(addr) ((uint32_t)(addr) / PAGE_SIZE)
 #define PAGE_ADDRESS(page_num) (physical_addr_t)((page_num) * PAGE_SIZE)
@@ -48,6 +52,18 @@ uint64_t pmm_max_physical_address(struct mmap_entry *entries, uint32_t num);
 /* Alloc 2 ^ order pages, returns start page number or 0 if failed */
 uint32_t pmm_alloc_pages(uint32_t order);
 
+/* Get the number of free pages */
+uint32_t pmm_num_free_pages();
+
+/*
+ * Reclaim function frees at least pages of cached memory if it can,
+ * returns the number of freed pages. It must not alloc pages.
+ */
+typedef uint32_t (*pmm_reclaim_func_t)(uint32_t pages);
+
+/* Register a reclaim function called when free memory is low */
+void pmm_register_reclaim(pmm_reclaim_func_t func);
+
 /* Print memory statistics information */
 void pmm_print_statistics(struct mmap_entry *entries, uint32_t num);
 
@@ -2,6 +2,13 @@
 #include <mm/pmm.h>
 #include <kernel/klib.h>
 
+/* Max number of cleared page tables kept for reuse */
+#define PAGE_TABLE_CACHE_SIZE 16
+
+/* Cache of page tables which all entries are not present */
+static struct page_table *page_table_cache[PAGE_TABLE_CACHE_SIZE];
+static uint32_t page_table_cache_count;
+
 static struct page_table * get_page_table(struct page_directory *page_dir,
                                           void *vaddr)
 {
@@ -29,23 +36,46 @@ void vmm_free_vaddr_space(struct page_directory *page_dir)
     pmm_free_page_address(paddr);
 }
 
+static inline void clear_page_table(struct page_table *page_tab)
+{
+    for (uint32_t i = 0; i < NUM_PTE; ++i)
+        page_tab->entries[i] = VMM_WRITABLE;
+}
+
 struct page_table * vmm_alloc_page_table()
 {
-    struct page_table *page_tab =
-        cast_p2v_or_null(pmm_alloc_page_address());
+    struct page_table *page_tab = NULL;
 
+    /* Reuse a cleared page table first */
+    if (page_table_cache_count > 0)
+        return page_table_cache[--page_table_cache_count];
+
+    page_tab = cast_p2v_or_null(pmm_alloc_page_address());
     if (page_tab)
-    {
-        for (uint32_t i = 0; i < NUM_PTE; ++i)
-            page_tab->entries[i] = VMM_WRITABLE;
-    }
+        clear_page_table(page_tab);
 
     return page_tab;
 }
 
 void vmm_free_page_table(struct page_table *page_tab)
 {
-    physical_addr_t paddr = CAST_VIRTUAL_TO_PHYSICAL(page_tab);
+    if (page_table_cache_count < PAGE_TABLE_CACHE_SIZE)
+        clear_page_table(page_tab);
+
+    vmm_free_clean_page_table(page_tab);
+}
+
+void vmm_free_clean_page_table(struct page_table *page_tab)
+{
+    physical_addr_t paddr = 0;
+
+    if (page_table_cache_count < PAGE_TABLE_CACHE_SIZE)
+    {
+        page_table_cache[page_table_cache_count++] = page_tab;
+        return ;
+    }
+
+    paddr = CAST_VIRTUAL_TO_PHYSICAL(page_tab);
     pmm_free_page_address(paddr);
 }
 
@@ -93,26 +123,58 @@ physical_addr_t vmm_get_page_index(struct page_table *page_tab,
     return page_tab->entries[index] & 0xFFFFF000;
 }
 
-int vmm_map(struct page_directory *page_dir, void *vaddr,
-            physical_addr_t paddr, uint32_t flag)
+/*
+ * Get the page table of vaddr, alloc it if it does not exist.
+ * Returns value is negative if alloc failure, otherwise the return value
+ * is extra used physical memory pages.
+ */
+static int prepare_page_table(struct page_directory *page_dir, void *vaddr,
+                              uint32_t flag, struct page_table **page_tab)
 {
-    int page = 0;
-    struct page_table *page_tab = get_page_table(page_dir, vaddr);
+    *page_tab = get_page_table(page_dir, vaddr);
 
-    if (!page_tab)
+    if (!*page_tab)
     {
-        page_tab = vmm_alloc_page_table();
+        *page_tab = vmm_alloc_page_table();
 
         /* Out of memory */
-        if (!page_tab) return -1;
+        if (!*page_tab) return -1;
 
-        page = 1;
-        vmm_map_page_table(page_dir, vaddr, page_tab, flag);
+        vmm_map_page_table(page_dir, vaddr, *page_tab, flag);
+        return 1;
     }
 
+    return 0;
+}
+
+int vmm_map(struct page_directory *page_dir, void *vaddr,
+            physical_addr_t paddr, uint32_t flag)
+{
+    struct page_table *page_tab = NULL;
+    int page = prepare_page_table(page_dir, vaddr, flag, &page_tab);
+
+    if (page < 0)
+        return page;
+
     if (page_tab->entries[VMM_PTE_INDEX(vaddr)] & VMM_PRESENT)
         panic("Remap virtual address at %p.", vaddr);
 
     vmm_map_page(page_tab, vaddr, paddr, flag);
     return page;
 }
+
+int vmm_reserve(struct page_directory *page_dir, void *vaddr, uint32_t flag)
+{
+    struct page_table *page_tab = NULL;
+    int page = prepare_page_table(page_dir, vaddr,
+                                  flag & ~VMM_ANONYMOUS, &page_tab);
+
+    if (page < 0)
+        return page;
+
+    if (page_tab->entries[VMM_PTE_INDEX(vaddr)] & VMM_PRESENT)
+        panic("Reserve mapped virtual address at %p.", vaddr);
+
+    page_tab->entries[VMM_PTE_INDEX(vaddr)] = (flag & 0xFFF) & ~VMM_PRESENT;
+    return page;
+}
@@ -13,6 +13,11 @@ enum vmm_flag
     VMM_PRESENT = 0x1,
     VMM_WRITABLE = 0x2,
     VMM_USER = 0x4,
+    VMM_WRITE_THROUGH = 0x8,
+    VMM_CACHE_DISABLE = 0x10,
+
+    /* Bits available for software */
+    VMM_ANONYMOUS = 0x200,  /* Zero filled memory, allocated on demand */
 };
 
 /* Page directory entry type */
@@ -42,10 +47,21 @@ struct page_directory * vmm_alloc_vaddr_space();
 
 void vmm_free_vaddr_space(struct page_directory *page_dir);
 
+/*
+ * Alloc a page table which all entries are not present, the page table
+ * is reused from the cache of freed page tables if there is one.
+ */
 struct page_table * vmm_alloc_page_table();
 
+/* Free the page table, the page table is cleared if it is cached */
 void vmm_free_page_table(struct page_table *page_tab);
 
+/*
+ * Free the page table which all entries are not present already,
+ * the page table is cached without clearing it again.
+ */
+void vmm_free_clean_page_table(struct page_table *page_tab);
+
 void vmm_map_page_table_index(struct page_directory *page_dir, uint32_t index,
                               struct page_table *page_tab, uint32_t flag);
 
@@ -101,4 +117,11 @@ physical_addr_t vmm_unmap_page(struct page_table *page_tab,
 int vmm_map(struct page_directory *page_dir, void *vaddr,
             physical_addr_t paddr, uint32_t flag);
 
+/*
+ * Set a not present entry with flag for virtual address in the page
+ * directory, the entry can be mapped later by page fault handler.
+ * Returns value is the same as vmm_map.
+ */
+int vmm_reserve(struct page_directory *page_dir, void *vaddr, uint32_t flag);
+
 #endif /* VMM_H */
@@ -9,6 +9,21 @@
 #define DEFAULT_IMG_NAME "axfs.img"
 #define ALIGN_4(size) (((size) + 4) & ~(4 - 1))
 
+/* Directories of more blocks are indexed, leaves are filled to 3/4 */
+#define DX_MIN_BLOCKS 2
+#define DX_LEAF_FILL (AX_FS_BLOCK_SIZE * 3 / 4)
+#define BLOCK_ENTRIES (AX_FS_BLOCK_SIZE / sizeof(uint32_t))
+
+/* Entry of a directory being indexed */
+struct dx_dir_entry
+{
+    uint32_t hash;
+    uint32_t inode;
+    uint8_t name_len;
+    uint8_t file_type;
+    char name[UINT8_MAX];
+};
+
 struct ax_super_block super_block;
 
 static char * dupstr(const char *s)
@@ -80,7 +95,7 @@ uint32_t alloc_inode_no(FILE *img)
     uint32_t inodes_count = super_block.s_inodes_count;
     uint32_t inodes_per_group = super_block.s_inodes_per_group;
     uint32_t bg_num = inodes_count / inodes_per_group +
-        (inodes_count % inodes_per_group) ? 1 : 0;
+        ((inodes_count % inodes_per_group) ? 1 : 0);
 
     for (uint32_t i = 0; i < bg_num; ++i)
     {
@@ -351,7 +366,7 @@ uint32_t alloc_block_from_block_group(FILE *img, uint32_t bg_no)
 uint32_t alloc_block(FILE *img)
 {
     uint32_t bg_num = super_block.s_blocks_count / AX_FS_BLOCKS_PER_GROUP +
-        (super_block.s_blocks_count % AX_FS_BLOCKS_PER_GROUP) ? 1 : 0;
+        ((super_block.s_blocks_count % AX_FS_BLOCKS_PER_GROUP) ? 1 : 0);
 
     for (uint32_t i = 0; i < bg_num; ++i)
     {
@@ -873,6 +888,7 @@ uint32_t create_file_inode(FILE *img, char *dst, struct ax_inode *inode)
     {
         bool is_dir_name;
 
+        sep = name;
         while (*sep && *sep != '/')
             ++sep;
 
@@ -1060,6 +1076,123 @@ bool has_enough_space(size_t size)
     return required_blocks <= super_block.s_free_blocks_count;
 }
 
+uint32_t alloc_data_block(FILE *img, const void *data, size_t len)
+{
+    uint32_t block = alloc_block(img);
+
+    update_block_data(img, block, data, len);
+    update_block_bitmap(img, block);
+
+    super_block.s_free_blocks_count -= 1;
+    return block;
+}
+
+/*
+ * Build the extent tree of inode bottom up, full node blocks are written
+ * until the entries fit in i_block.
+ */
+void write_extent_tree(FILE *img, struct ax_inode *inode,
+                       struct ax_extent *extents, uint32_t count)
+{
+    struct ax_extent_header *root = (struct ax_extent_header *)inode->i_block;
+    struct ax_extent *entries = extents;
+    uint16_t depth = 0;
+
+    while (count > AX_EXT_ROOT_MAX)
+    {
+        uint32_t nodes = (count + AX_EXT_NODE_MAX - 1) / AX_EXT_NODE_MAX;
+        struct ax_extent *indexes = malloc(nodes * sizeof(*indexes));
+
+        if (!indexes)
+        {
+            fprintf(stderr, "malloc failed.\n");
+            exit(1);
+        }
+
+        for (uint32_t i = 0; i < nodes; ++i)
+        {
+            uint8_t data[AX_FS_BLOCK_SIZE] = { 0 };
+            struct ax_extent_header *header = (struct ax_extent_header *)data;
+            uint32_t first = i * AX_EXT_NODE_MAX;
+            uint32_t n = count - first < AX_EXT_NODE_MAX ?
+                count - first : AX_EXT_NODE_MAX;
+
+            header->eh_magic = AX_EXT_MAGIC;
+            header->eh_entries = n;
+            header->eh_max = AX_EXT_NODE_MAX;
+            header->eh_depth = depth;
+            memcpy(header + 1, entries + first, n * sizeof(*entries));
+
+            indexes[i].ee_block = entries[first].ee_block;
+            indexes[i].ee_len = 0;
+            indexes[i].ee_start = alloc_data_block(img, data, sizeof(data));
+        }
+
+        if (entries != extents)
+            free(entries);
+
+        entries = indexes;
+        count = nodes;
+        depth += 1;
+    }
+
+    memset(inode->i_block, 0, sizeof(inode->i_block));
+    root->eh_magic = AX_EXT_MAGIC;
+    root->eh_entries = count;
+    root->eh_max = AX_EXT_ROOT_MAX;
+    root->eh_depth = depth;
+    memcpy(root + 1, entries, count * sizeof(*entries));
+
+    if (entries != extents)
+        free(entries);
+}
+
+/* Write data into new blocks, adjacent blocks are mapped by one extent */
+void write_data_into_extents(FILE *img, FILE *sfile, struct ax_inode *inode,
+                             size_t size)
+{
+    struct ax_extent *extents = NULL;
+    uint32_t count = 0;
+    uint32_t capacity = 0;
+
+    for (uint32_t index = 0; size > 0; ++index)
+    {
+        uint8_t data[AX_FS_BLOCK_SIZE];
+        size_t block_size = size > AX_FS_BLOCK_SIZE ? AX_FS_BLOCK_SIZE : size;
+        uint32_t block;
+
+        fread(data, 1, block_size, sfile);
+        block = alloc_data_block(img, data, block_size);
+        size -= block_size;
+
+        if (count > 0 &&
+            extents[count - 1].ee_start + extents[count - 1].ee_len == block)
+        {
+            extents[count - 1].ee_len += 1;
+            continue;
+        }
+
+        if (count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 16;
+            extents = realloc(extents, capacity * sizeof(*extents));
+            if (!extents)
+            {
+                fprintf(stderr, "realloc failed.\n");
+                exit(1);
+            }
+        }
+
+        extents[count].ee_block = index;
+        extents[count].ee_len = 1;
+        extents[count].ee_start = block;
+        count += 1;
+    }
+
+    write_extent_tree(img, inode, extents, count);
+    free(extents);
+}
+
 bool write_file(FILE *img, FILE *sfile, char *dst)
 {
     size_t size;
@@ -1082,6 +1215,14 @@ bool write_file(FILE *img, FILE *sfile, char *dst)
 
     inode.i_size = size;
 
+    if (super_block.s_feature_incompat & AX_FEATURE_INCOMPAT_EXTENTS)
+    {
+        write_data_into_extents(img, sfile, &inode, size);
+        update_inode(img, ino, &inode);
+        update_super_block(img);
+        return true;
+    }
+
     /* Write data into direct blocks */
     write_data_into_blocks(img, sfile, inode.i_block,
                            AX_FS_DIRECT_BLOCK_COUNT, &size);
@@ -1150,6 +1291,337 @@ void copy_file(FILE *img, const char *src, const char *dst)
     fclose(sfile);
 }
 
+uint32_t map_indirect_block(FILE *img, uint32_t *indirect,
+                            uint32_t indirect_index, uint32_t index,
+                            uint32_t level, bool alloc)
+{
+    uint32_t blocks[BLOCK_ENTRIES];
+    uint32_t span = 1;
+    uint32_t block;
+
+    if (indirect[indirect_index] == 0)
+    {
+        if (!alloc)
+            return 0;
+        alloc_indirect_block(img, indirect, indirect_index);
+    }
+
+    for (uint32_t i = 1; i < level; ++i)
+        span *= BLOCK_ENTRIES;
+
+    read_block_data(img, indirect[indirect_index], blocks, sizeof(blocks));
+
+    if (level == 1)
+    {
+        if (blocks[index] == 0 && alloc)
+            alloc_indirect_block(img, blocks, index);
+        block = blocks[index];
+    }
+    else
+    {
+        block = map_indirect_block(img, blocks, index / span, index % span,
+                                   level - 1, alloc);
+    }
+
+    if (alloc)
+        update_block_data(img, indirect[indirect_index],
+                          blocks, sizeof(blocks));
+
+    return block;
+}
+
+/*
+ * Get the block of index in inode, it is allocated with indirect blocks
+ * if alloc is true, the caller updates the inode.
+ */
+uint32_t map_block(FILE *img, struct ax_inode *inode, uint32_t index,
+                   bool alloc)
+{
+    uint32_t span = BLOCK_ENTRIES;
+
+    if (index < AX_FS_DIRECT_BLOCK_COUNT)
+    {
+        if (inode->i_block[index] == 0 && alloc)
+            alloc_indirect_block(img, inode->i_block, index);
+        return inode->i_block[index];
+    }
+
+    index -= AX_FS_DIRECT_BLOCK_COUNT;
+    for (uint32_t level = 1; level <= 3; ++level)
+    {
+        if (index < span)
+            return map_indirect_block(img, inode->i_block,
+                                      AX_FS_1_INDIRECT_BLOCK_INDEX + level - 1,
+                                      index, level, alloc);
+        index -= span;
+        span *= BLOCK_ENTRIES;
+    }
+
+    return 0;
+}
+
+int compare_dx_dir_entry(const void *lhs, const void *rhs)
+{
+    const struct dx_dir_entry *l = lhs;
+    const struct dx_dir_entry *r = rhs;
+
+    if (l->hash != r->hash)
+        return l->hash < r->hash ? -1 : 1;
+
+    if (l->name_len != r->name_len)
+        return l->name_len < r->name_len ? -1 : 1;
+
+    return memcmp(l->name, r->name, l->name_len);
+}
+
+/*
+ * Read entries of directory except "." and "..", blocks is set to the
+ * number of directory blocks.
+ */
+struct dx_dir_entry * read_dir_entries(FILE *img, struct ax_inode *inode,
+                                       uint32_t *count, uint32_t *blocks)
+{
+    struct dx_dir_entry *entries = NULL;
+    uint32_t capacity = 0;
+
+    *count = 0;
+    for (*blocks = 0; ; *blocks += 1)
+    {
+        uint8_t data[AX_FS_BLOCK_SIZE];
+        struct ax_directory_entry *entry;
+        uint32_t block = map_block(img, inode, *blocks, false);
+
+        if (block == 0)
+            break;
+
+        read_block_data(img, block, data, sizeof(data));
+
+        for (uint32_t offset = 0; offset < AX_FS_BLOCK_SIZE;
+             offset += entry->rec_len)
+        {
+            entry = (struct ax_directory_entry *)(data + offset);
+            if (entry->rec_len == 0)
+                break;
+
+            if (entry->file_type == AX_FT_UNKNOWN ||
+                (entry->name_len == 1 && entry->name[0] == '.') ||
+                (entry->name_len == 2 && memcmp(entry->name, "..", 2) == 0))
+                continue;
+
+            if (*count == capacity)
+            {
+                capacity = capacity ? capacity * 2 : 64;
+                entries = realloc(entries, capacity * sizeof(*entries));
+                if (!entries)
+                {
+                    fprintf(stderr, "realloc failed.\n");
+                    exit(1);
+                }
+            }
+
+            entries[*count].hash = ax_dx_hash((const char *)entry->name,
+                                              entry->name_len);
+            entries[*count].inode = entry->inode;
+            entries[*count].name_len = entry->name_len;
+            entries[*count].file_type = entry->file_type;
+            memcpy(entries[*count].name, entry->name, entry->name_len);
+            *count += 1;
+        }
+    }
+
+    return entries;
+}
+
+void write_dx_leaf(FILE *img, uint32_t block,
+                   const struct dx_dir_entry *entries, uint32_t count)
+{
+    uint8_t data[AX_FS_BLOCK_SIZE] = { 0 };
+    uint32_t offset = 0;
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        struct ax_directory_entry *entry =
+            (struct ax_directory_entry *)(data + offset);
+        uint16_t rec_len = ALIGN_4(sizeof(*entry) + entries[i].name_len);
+
+        entry->inode = entries[i].inode;
+        entry->rec_len = i + 1 < count ? rec_len : AX_FS_BLOCK_SIZE - offset;
+        entry->name_len = entries[i].name_len;
+        entry->file_type = entries[i].file_type;
+        memcpy(entry->name, entries[i].name, entries[i].name_len);
+        offset += rec_len;
+    }
+
+    update_block_data(img, block, data, sizeof(data));
+}
+
+void write_dot_entry(uint8_t *data, const char *name, uint32_t ino,
+                     uint16_t rec_len)
+{
+    struct ax_directory_entry *entry = (struct ax_directory_entry *)data;
+
+    entry->inode = ino;
+    entry->rec_len = rec_len;
+    entry->name_len = strlen(name);
+    entry->file_type = AX_FT_DIR;
+    memcpy(entry->name, name, entry->name_len);
+}
+
+/*
+ * Rewrite a large directory as a hashed index and leaf blocks sorted by
+ * hash, subdirectories are indexed recursively.
+ */
+void index_dir(FILE *img, uint32_t ino, uint32_t parent)
+{
+    struct ax_inode inode;
+    struct dx_dir_entry *entries;
+    uint32_t *leaf_start;
+    uint32_t count, blocks;
+    uint32_t leaves = 0;
+    uint32_t nodes = 0;
+    uint32_t used = 0;
+
+    get_inode(img, ino, &inode);
+    entries = read_dir_entries(img, &inode, &count, &blocks);
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        if (entries[i].file_type == AX_FT_DIR)
+            index_dir(img, entries[i].inode, ino);
+    }
+
+    if (blocks < DX_MIN_BLOCKS)
+    {
+        free(entries);
+        return ;
+    }
+
+    qsort(entries, count, sizeof(*entries), compare_dx_dir_entry);
+
+    /* Split entries into leaves, names of the same hash stay together */
+    leaf_start = malloc((count + 1) * sizeof(*leaf_start));
+    if (!leaf_start)
+    {
+        fprintf(stderr, "malloc failed.\n");
+        exit(1);
+    }
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        uint16_t rec_len = ALIGN_4(sizeof(struct ax_directory_entry) +
+                                   entries[i].name_len);
+
+        if (i == 0 || (used + rec_len > DX_LEAF_FILL &&
+                       entries[i].hash != entries[i - 1].hash))
+        {
+            leaf_start[leaves++] = i;
+            used = 0;
+        }
+        else if (used + rec_len > AX_FS_BLOCK_SIZE)
+        {
+            fprintf(stderr, "Too many names of the same hash in inode %u, "
+                    "it is not indexed.\n", ino);
+            free(leaf_start);
+            free(entries);
+            return ;
+        }
+
+        used += rec_len;
+    }
+    leaf_start[leaves] = count;
+
+    if (leaves > AX_FS_DX_ROOT_LIMIT)
+        nodes = (leaves + AX_FS_DX_NODE_LIMIT - 1) / AX_FS_DX_NODE_LIMIT;
+
+    if (nodes > AX_FS_DX_ROOT_LIMIT)
+    {
+        fprintf(stderr, "Directory inode %u is too large to be indexed.\n",
+                ino);
+        free(leaf_start);
+        free(entries);
+        return ;
+    }
+
+    /* Block 0 is the root, index nodes and leaves follow it */
+    {
+        uint8_t data[AX_FS_BLOCK_SIZE] = { 0 };
+        struct ax_dx_root *root =
+            (struct ax_dx_root *)(data + AX_FS_DX_ROOT_OFFSET);
+        uint32_t first_leaf = 1 + nodes;
+        uint32_t total = first_leaf + leaves;
+
+        write_dot_entry(data, ".", ino, AX_FS_DOT_REC_LEN);
+        write_dot_entry(data + AX_FS_DOT_REC_LEN, "..", parent,
+                        AX_FS_BLOCK_SIZE - AX_FS_DOT_REC_LEN);
+
+        root->magic = AX_FS_DX_MAGIC;
+        root->hash_version = AX_FS_DX_HASH_FNV;
+        root->levels = nodes > 0 ? 1 : 0;
+        root->countlimit.limit = AX_FS_DX_ROOT_LIMIT;
+
+        if (nodes == 0)
+        {
+            for (uint32_t i = 0; i < leaves; ++i)
+            {
+                root->entries[i].hash =
+                    i == 0 ? 0 : entries[leaf_start[i]].hash;
+                root->entries[i].block = first_leaf + i;
+            }
+            root->countlimit.count = leaves;
+        }
+
+        for (uint32_t n = 0; n < nodes; ++n)
+        {
+            uint8_t node_data[AX_FS_BLOCK_SIZE] = { 0 };
+            struct ax_directory_entry *empty =
+                (struct ax_directory_entry *)node_data;
+            struct ax_dx_node *node =
+                (struct ax_dx_node *)(node_data + AX_FS_DX_NODE_OFFSET);
+            uint32_t first = n * AX_FS_DX_NODE_LIMIT;
+
+            empty->rec_len = AX_FS_BLOCK_SIZE;
+            node->countlimit.limit = AX_FS_DX_NODE_LIMIT;
+
+            for (uint32_t i = first; i < leaves &&
+                 i < first + AX_FS_DX_NODE_LIMIT; ++i)
+            {
+                node->entries[i - first].hash =
+                    i == 0 ? 0 : entries[leaf_start[i]].hash;
+                node->entries[i - first].block = first_leaf + i;
+                node->countlimit.count += 1;
+            }
+
+            root->entries[n].hash = node->entries[0].hash;
+            root->entries[n].block = 1 + n;
+            update_block_data(img, map_block(img, &inode, 1 + n, true),
+                              node_data, sizeof(node_data));
+        }
+        root->countlimit.count += nodes;
+
+        update_block_data(img, map_block(img, &inode, 0, true),
+                          data, sizeof(data));
+
+        for (uint32_t i = 0; i < leaves; ++i)
+            write_dx_leaf(img, map_block(img, &inode, first_leaf + i, true),
+                          entries + leaf_start[i],
+                          leaf_start[i + 1] - leaf_start[i]);
+
+        /* Blocks left after leaves become empty */
+        for (uint32_t i = total; i < blocks; ++i)
+            init_dir_block(img, map_block(img, &inode, i, false));
+
+        inode.i_size = (uint64_t)(total > blocks ? total : blocks) *
+            AX_FS_BLOCK_SIZE;
+        update_inode(img, ino, &inode);
+    }
+
+    super_block.s_feature_compat |= AX_FEATURE_COMPAT_DIR_INDEX;
+    update_super_block(img);
+
+    free(leaf_start);
+    free(entries);
+}
+
 void cpfs(const char *img_path, char *arg)
 {
     FILE *img = fopen(img_path, "r+");
@@ -1179,6 +1651,8 @@ void cpfs(const char *img_path, char *arg)
         }
     }
 
+    index_dir(img, AX_FS_ROOT_INO, AX_FS_ROOT_INO);
+
     fclose(img);
 }
 
@@ -1189,7 +1663,8 @@ Options:\n\
     -n      Specify fs name.\n\
     -s      Specify fs size in MB.\n\
     -i      Specify inode number of each block group.\n\
-    -c      Copy files: src:dst[, ... ] e.g. file:/file\n");
+    -c      Copy files: src:dst[, ... ] e.g. file:/file\n\
+    -e      Map files by extents.\n");
 
     exit(1);
 }
@@ -1207,7 +1682,7 @@ int main(int argc, char **argv)
         usage();
     }
 
-    while ((ch = getopt(argc, argv, "n:s:i:c:")) != -1)
+    while ((ch = getopt(argc, argv, "n:s:i:c:e")) != -1)
     {
         switch (ch)
         {
@@ -1227,6 +1702,10 @@ int main(int argc, char **argv)
             copy = dupstr(optarg);
             break;
 
+        case 'e':
+            super_block.s_feature_incompat |= AX_FEATURE_INCOMPAT_EXTENTS;
+            break;
+
         default:
             usage();
         }